@@ -0,0 +1,308 @@
+#include <benchmark/benchmark.h>
+#include "json/json.h"
+#include "imgexp.h"
+#include "imgexputil.h"
+#include <boost/filesystem.hpp>
+#include <map>
+#include <random>
+
+using namespace std;
+using namespace imgexp;
+using namespace imgexp::util;
+
+namespace imgexpbench {
+	//=========================================================================
+	//== Generators
+	//=========================================================================
+	//Where a planted pattern sits in scan order
+	enum Position {
+		EARLY = 0,
+		LATE = 1,
+		ABSENT = 2,
+	};
+
+	//Every pattern's pixels are this color plus its index, so patterns never match each other
+	const Color PatternColor(0x20, 0x40, 0x60);
+	Color ColorFor(unsigned pattern)
+	{
+		return Color(PatternColor.Red(), PatternColor.Green(), static_cast<BYTE>(PatternColor.Blue() + pattern));
+	}
+
+	//A frame of random noise that never contains a pattern color, except for selectivity
+	//(per mille) of its pixels. Those take the color of one of the first patterns patterns,
+	//making them candidate anchors that fail further in.
+	vector<Color> MakeNoise(long width, long height, long selectivity, unsigned patterns, unsigned seed)
+	{
+		mt19937 random(seed);
+		uniform_int_distribution<int> byte(0, 0xff);
+		uniform_int_distribution<int> perMille(0, 999);
+		uniform_int_distribution<unsigned> pattern(0, patterns - 1);
+
+		vector<Color> colors(width * height);
+		for (auto &color : colors)
+		{
+			if (perMille(random) < selectivity)
+			{
+				color = ColorFor(pattern(random));
+				continue;
+			}
+
+			//red never matches PatternColor's
+			color = Color(static_cast<BYTE>(byte(random) | 0x80), static_cast<BYTE>(byte(random)), static_cast<BYTE>(byte(random)));
+		}
+
+		return colors;
+	}
+
+	//pixels offsets inside a side x side box, always including the anchor at 0,0
+	vector<Point> MakeShape(long pixels, long side, unsigned seed)
+	{
+		mt19937 random(seed);
+		uniform_int_distribution<long> coordinate(0, side - 1);
+
+		map<Point, bool> shape;
+		shape[Point(0, 0)] = true;
+		while (static_cast<long>(shape.size()) < pixels)
+			shape[Point(coordinate(random), coordinate(random))] = true;
+
+		vector<Point> offsets;
+		for (auto &offset : shape)
+			offsets.push_back(offset.first);
+
+		return offsets;
+	}
+
+	Expression *MakeExpression(const vector<Point> &shape, const Color &color)
+	{
+		map<Point, PixelMatch*> pointMatches;
+		for (auto &offset : shape)
+			pointMatches[offset] = new ExactPixelMatch(color);
+
+		return BuildExpressionTree(pointMatches);
+	}
+
+	//Search area covering coverage percent of the anchors that keep shape inside the frame
+	Area MakeSearchArea(long width, long height, long side, long coverage)
+	{
+		long right = max(0L, (width - side) * coverage / 100);
+		return Area(0, 0, right, height - side);
+	}
+
+	//Where the index'th pattern is planted; patterns are laid out 32 to a row so their boxes don't overlap
+	Point PositionIn(const Area &area, Position position, long side, long index)
+	{
+		Point step((index % 32) * (side + 1), (index / 32) * (side + 1));
+		return position == EARLY ? Point(area.Left() + 1, area.Top() + 1) + step : Point(area.Right() - 1, area.Bottom() - 1) - step;
+	}
+
+	void Plant(vector<Color> &colors, long width, long height, const vector<Point> &shape, const Point &at, const Color &color)
+	{
+		//rows are stored bottom up
+		for (auto &offset : shape)
+		{
+			auto pt = at + offset;
+			colors[(height - 1 - pt.Y()) * width + pt.X()] = color;
+		}
+	}
+
+	Bitmap *MakeBitmap(long width, long height, const vector<Color> &colors)
+	{
+		BITMAPINFOHEADER info = {};
+		info.biSize = sizeof(BITMAPINFOHEADER);
+		info.biWidth = width;
+		info.biHeight = height;
+		info.biPlanes = 1;
+		info.biBitCount = 24;
+		info.biSizeImage = static_cast<DWORD>(colors.size() * sizeof(Color));
+
+		auto copy = new Color[colors.size()];
+		copy_n(colors.begin(), colors.size(), copy);
+		return new Bitmap(info, copy);
+	}
+
+	//Bitmap::FromFile's layout: the headers followed by the rows
+	void WriteBitmap(const string &fileName, long width, long height, const vector<Color> &colors)
+	{
+		BITMAPINFOHEADER info = {};
+		info.biSize = sizeof(BITMAPINFOHEADER);
+		info.biWidth = width;
+		info.biHeight = height;
+		info.biPlanes = 1;
+		info.biBitCount = 24;
+		info.biSizeImage = static_cast<DWORD>(colors.size() * sizeof(Color));
+
+		BITMAPFILEHEADER header = {};
+		header.bfType = 0x4d42;
+		header.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+		header.bfSize = header.bfOffBits + info.biSizeImage;
+
+		ofstream output(fileName.c_str(), ios_base::binary | ios_base::trunc);
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		output.write(reinterpret_cast<const char*>(&info), sizeof(info));
+		output.write(reinterpret_cast<const char*>(colors.data()), info.biSizeImage);
+	}
+
+	string TempFile(const string &ext)
+	{
+		auto tempFile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		return tempFile.generic_string() + ext;
+	}
+
+	//A frame with count patterns, each planted at position if it isn't ABSENT
+	struct Scene {
+		long width;
+		long height;
+		vector<Color> colors;
+		vector<PixelPattern> patterns;
+
+		Scene(long width, long height, long pixels, long count, Position position, long selectivity, long coverage)
+			: width(width), height(height)
+		{
+			const long side = 16;
+			colors = MakeNoise(width, height, selectivity, static_cast<unsigned>(count), 1);
+
+			auto area = MakeSearchArea(width, height, side, coverage);
+			for (long i = 0; i < count; ++i)
+			{
+				auto shape = MakeShape(pixels, side, static_cast<unsigned>(i + 1));
+				auto color = ColorFor(static_cast<unsigned>(i));
+
+				if (position != ABSENT)
+					Plant(colors, width, height, shape, PositionIn(area, position, side, i), color);
+
+				patterns.push_back(PixelPattern(Size(width, height), static_cast<PatternId>(i + 1),
+					MakeExpression(shape, color), new vector<Area>(1, area)));
+			}
+		}
+	};
+
+	//One dimension at a time from 1024x768, 16 pixels, late, no false candidates, full coverage
+	void UpdateArgs(benchmark::internal::Benchmark *b)
+	{
+		b->ArgNames({ "width", "height", "pixels", "position", "selectivity", "coverage" });
+		b->Args({ 1024, 768, 16, LATE, 0, 100 });
+		b->Args({ 640, 480, 16, LATE, 0, 100 });
+		b->Args({ 1920, 1080, 16, LATE, 0, 100 });
+		b->Args({ 1024, 768, 4, LATE, 0, 100 });
+		b->Args({ 1024, 768, 64, LATE, 0, 100 });
+		b->Args({ 1024, 768, 16, EARLY, 0, 100 });
+		b->Args({ 1024, 768, 16, ABSENT, 0, 100 });
+		b->Args({ 1024, 768, 16, LATE, 10, 100 });
+		b->Args({ 1024, 768, 16, LATE, 100, 100 });
+		b->Args({ 1024, 768, 16, LATE, 0, 25 });
+		b->Args({ 1024, 768, 16, LATE, 0, 50 });
+	}
+
+	//=========================================================================
+	//== Benchmarks
+	//=========================================================================
+	void BM_PixelPatternUpdate(benchmark::State &state)
+	{
+		Scene scene(state.range(0), state.range(1), state.range(2), 1,
+			static_cast<Position>(state.range(3)), state.range(4), state.range(5));
+		unique_ptr<Bitmap> frame(MakeBitmap(scene.width, scene.height, scene.colors));
+		auto &pattern = scene.patterns[0];
+
+		while (state.KeepRunning())
+		{
+			//a full search every time rather than the found location's recheck
+			pattern.Reset();
+			pattern.Update(*frame);
+			benchmark::DoNotOptimize(pattern.Found());
+		}
+
+		state.SetItemsProcessed(state.iterations());
+		state.SetBytesProcessed(state.iterations() * scene.width * scene.height * sizeof(Color));
+	}
+	BENCHMARK(BM_PixelPatternUpdate)->Apply(UpdateArgs)->Unit(benchmark::kMicrosecond);
+
+	void BM_SingleParserParse(benchmark::State &state)
+	{
+		Scene scene(1024, 768, 16, state.range(0), static_cast<Position>(state.range(1)), 0, 100);
+		unique_ptr<Bitmap> frame(MakeBitmap(scene.width, scene.height, scene.colors));
+
+		SingleParser parser(Size(scene.width, scene.height));
+		for (auto &pattern : scene.patterns)
+			parser.AddPattern(pattern);
+
+		while (state.KeepRunning())
+			parser.Parse(*frame);
+
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK(BM_SingleParserParse)
+		->ArgNames({ "patterns", "position" })
+		->Args({ 1, LATE })->Args({ 8, LATE })->Args({ 64, LATE })
+		->Args({ 8, EARLY })->Args({ 8, ABSENT })
+		->Unit(benchmark::kMillisecond);
+
+	//With moving set the patterns alternate between two places every frame, so every frame is
+	//a recheck that fails and a fresh search. Otherwise every frame after the first is a recheck.
+	void BM_SeriesParserNext(benchmark::State &state)
+	{
+		Scene early(1024, 768, 16, state.range(0), EARLY, 0, 100);
+		Scene late(1024, 768, 16, state.range(0), LATE, 0, 100);
+		unique_ptr<Bitmap> frames[] = {
+			unique_ptr<Bitmap>(MakeBitmap(early.width, early.height, early.colors)),
+			unique_ptr<Bitmap>(MakeBitmap(late.width, late.height, late.colors)),
+		};
+		bool moving = state.range(1) != 0;
+
+		SeriesParser parser(Size(early.width, early.height));
+		for (auto &pattern : early.patterns)
+			parser.AddPattern(pattern);
+
+		size_t frame = 0;
+		while (state.KeepRunning())
+			parser.Next(*frames[moving ? frame++ % 2 : 0]);
+
+		state.SetItemsProcessed(state.iterations());
+	}
+	BENCHMARK(BM_SeriesParserNext)
+		->ArgNames({ "patterns", "moving" })
+		->Args({ 1, 0 })->Args({ 64, 0 })->Args({ 1, 1 })->Args({ 8, 1 })
+		->Unit(benchmark::kMicrosecond);
+
+	void BM_BitmapFromFile(benchmark::State &state)
+	{
+		long width = state.range(0);
+		long height = state.range(1);
+		auto fileName = TempFile(".bmp");
+		WriteBitmap(fileName, width, height, MakeNoise(width, height, 0, 1, 1));
+
+		while (state.KeepRunning())
+			delete Bitmap::FromFile(fileName);
+
+		state.SetBytesProcessed(state.iterations() * width * height * sizeof(Color));
+		boost::filesystem::remove(fileName);
+	}
+	BENCHMARK(BM_BitmapFromFile)
+		->ArgNames({ "width", "height" })
+		->Args({ 640, 480 })->Args({ 1024, 768 })->Args({ 1920, 1080 })
+		->Unit(benchmark::kMicrosecond);
+
+	void BM_PixelPatternFromFile(benchmark::State &state)
+	{
+		auto shape = MakeShape(state.range(0), 16, 1);
+		PixelPattern pattern(Size(1024, 768), 1, MakeExpression(shape, PatternColor));
+
+		auto fileName = TempFile(".pattern");
+		{
+			Json::StyledWriter writer;
+			ofstream output(fileName.c_str(), ios_base::trunc);
+			output << writer.write(pattern);
+		}
+
+		while (state.KeepRunning())
+			delete PixelPattern::FromFile(fileName);
+
+		state.SetItemsProcessed(state.iterations());
+		boost::filesystem::remove(fileName);
+	}
+	BENCHMARK(BM_PixelPatternFromFile)
+		->ArgNames({ "pixels" })
+		->Arg(4)->Arg(16)->Arg(64)->Arg(256)
+		->Unit(benchmark::kMicrosecond);
+}
+
+BENCHMARK_MAIN();
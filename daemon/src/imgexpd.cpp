@@ -0,0 +1,404 @@
+#include "json/json.h"
+#include "imgexp.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+using namespace std;
+using namespace imgexp;
+
+namespace imgexpd {
+	const char *USAGE =
+		"usage: imgexpd [options] --size <width>x<height> <patterns>\n"
+		"\n"
+		"Keeps the patterns in <patterns> (a directory of .pattern files or a pattern bundle)\n"
+		"loaded and answers match requests on the named pipe \\\\.\\pipe\\<name>, one client per\n"
+		"connection, any number of connections at once. Each request and response is a JSON\n"
+		"object on a line of its own:\n"
+		"\n"
+		"  {\"id\": 1, \"file\": \"c:\\\\frames\\\\1.bmp\"}\n"
+		"  {\"id\": 2, \"ring\": \"capture\", \"slots\": 4, \"timeout\": 1000, \"patterns\": [3, 7]}\n"
+		"  {\"id\": 2, \"found\": [{\"id\": 3, \"x\": 198, \"y\": 24}], \"ms\": 1.5, \"version\": 1}\n"
+		"  {\"id\": 1, \"error\": \"...\"}\n"
+		"\n"
+		"\"file\" loads a .bmp; \"ring\" parses the next frame committed to that FrameRing, waiting up\n"
+		"to \"timeout\" ms (default 1000); connections naming the same ring take its frames in turn.\n"
+		"\"patterns\" limits the request to those ids. \"id\" is echoed back as is. A request longer\n"
+		"than 1 MiB is answered with an error and the connection closed.\n"
+		"\n"
+		"  --size <w>x<h>   the size of every frame, which the patterns have to match\n"
+		"  --pipe <name>    the pipe's name; imgexpd by default\n"
+		"  --threads <n>    load the patterns on n workers; 0 (the default) is one per core\n"
+		"  --watch          reload the pattern directory whenever it changes\n";
+
+	const DWORD PIPE_BUFFER_SIZE = 64 * 1024;
+	//a client that goes past this without a newline is answered with an error and disconnected
+	const size_t MAX_REQUEST_SIZE = 1024 * 1024;
+	const unsigned long DEFAULT_RING_TIMEOUT = 1000;
+
+	struct Options {
+		string patterns;
+		Size size;
+		string pipe = "imgexpd";
+		unsigned threads = 0;
+		bool watch = false;
+	};
+
+	//A ring is read by one consumer, so every connection that names it shares one. lock is held from
+	//Read through Release, so one frame is parsed at a time and each exactly once.
+	struct SharedRing {
+		mutex lock;
+		unique_ptr<FrameRing> ring;
+	};
+
+	//The rings connections have read from, by name, for the life of the process
+	mutex ringsLock;
+	map<string, unique_ptr<SharedRing>> rings;
+
+	//=========================================================================
+	//== Arguments
+	//=========================================================================
+	bool ParseSize(const string &text, Size &size)
+	{
+		long width = 0;
+		long height = 0;
+		char x = 0;
+		istringstream input(text);
+		if (!(input >> width >> x >> height) || x != 'x' || width <= 0 || height <= 0 || !input.eof())
+			return false;
+
+		size = Size(width, height);
+		return true;
+	}
+
+	bool ParseOptions(int argc, char *argv[], Options &options, string &error)
+	{
+		bool sized = false;
+		for (int i = 1; i < argc; ++i)
+		{
+			string arg(argv[i]);
+			if (arg.compare(0, 2, "--") != 0)
+			{
+				if (!options.patterns.empty())
+				{
+					error = "only one pattern directory or bundle can be given";
+					return false;
+				}
+				options.patterns = arg;
+				continue;
+			}
+
+			if (arg == "--watch")
+			{
+				options.watch = true;
+				continue;
+			}
+
+			if (i + 1 == argc)
+			{
+				error = arg + " needs a value";
+				return false;
+			}
+
+			string value(argv[++i]);
+			if (arg == "--size")
+			{
+				if (!ParseSize(value, options.size))
+				{
+					error = "--size needs <width>x<height>";
+					return false;
+				}
+				sized = true;
+			}
+			else if (arg == "--pipe")
+			{
+				options.pipe = value;
+			}
+			else if (arg == "--threads")
+			{
+				if (value.empty() || value.find_first_not_of("0123456789") != string::npos)
+				{
+					error = "--threads needs a number";
+					return false;
+				}
+				options.threads = static_cast<unsigned>(stoul(value));
+			}
+			else
+			{
+				error = "unknown option " + arg;
+				return false;
+			}
+		}
+
+		if (!sized || options.patterns.empty())
+		{
+			error = "--size and patterns are required";
+			return false;
+		}
+
+		return true;
+	}
+
+	//=========================================================================
+	//== Requests
+	//=========================================================================
+	Json::Value Found(const FrameResult &result)
+	{
+		//in id order, so responses can be diffed
+		vector<PatternId> ids;
+		for (auto &found : result)
+			ids.push_back(found.first);
+		sort(ids.begin(), ids.end());
+
+		Json::Value found(Json::arrayValue);
+		for (auto id : ids)
+		{
+			Json::Value match;
+			match["id"] = static_cast<Json::UInt64>(id);
+			match["x"] = static_cast<Json::Int64>(result.at(id).X());
+			match["y"] = static_cast<Json::Int64>(result.at(id).Y());
+			found.append(match);
+		}
+		return found;
+	}
+
+	//The shared ring for name, which the caller opens under its lock
+	SharedRing &GetRing(const string &name)
+	{
+		lock_guard<mutex> guard(ringsLock);
+		auto &shared = rings[name];
+		if (!shared)
+			shared.reset(new SharedRing);
+		return *shared;
+	}
+
+	void Match(const Parser &parser, const PatternSnapshot &patterns, const Bitmap &frame, FrameResult &result, const vector<PatternId> *ids)
+	{
+		if (ids)
+			parser.Match(patterns, frame, result, *ids);
+		else
+			parser.Match(patterns, frame, result);
+	}
+
+	Json::Value Handle(const Parser &parser, const Json::Value &request)
+	{
+		Json::Value response;
+		response["id"] = request.get("id", Json::Value());
+
+		try
+		{
+			vector<PatternId> ids;
+			bool subset = request.isMember("patterns");
+			if (subset)
+			{
+				auto &patterns = request["patterns"];
+				for (unsigned i = 0; i < patterns.size(); ++i)
+					ids.push_back(static_cast<PatternId>(patterns[i].asUInt64()));
+			}
+
+			auto start = chrono::steady_clock::now();
+			//one set for the whole request, so the version reported is the one matched
+			auto patterns = parser.Patterns();
+			FrameResult result;
+			if (request.isMember("file"))
+			{
+				unique_ptr<Bitmap> frame(Bitmap::FromFile(request["file"].asString()));
+				Match(parser, patterns, *frame, result, subset ? &ids : nullptr);
+			}
+			else if (request.isMember("ring"))
+			{
+				auto name = request["ring"].asString();
+				auto &shared = GetRing(name);
+				lock_guard<mutex> guard(shared.lock);
+				if (!shared.ring)
+					shared.ring.reset(new FrameRing(name, parser.ImageSize(), request.get("slots", 1).asUInt()));
+
+				auto &ring = *shared.ring;
+				auto frame = ring.Read(request.get("timeout", static_cast<Json::UInt>(DEFAULT_RING_TIMEOUT)).asUInt());
+				if (!frame)
+				{
+					response["error"] = "no frame was committed in time";
+					return response;
+				}
+
+				try
+				{
+					Match(parser, patterns, *frame, result, subset ? &ids : nullptr);
+				}
+				catch (...)
+				{
+					ring.Release();
+					throw;
+				}
+				ring.Release();
+			}
+			else
+			{
+				response["error"] = "a file or ring is required";
+				return response;
+			}
+
+			response["found"] = Found(result);
+			response["ms"] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			response["version"] = static_cast<Json::UInt64>(patterns->version);
+		}
+		catch (const Exception &e)
+		{
+			response["error"] = e.Code() == ErrorCode::FileNotFound ? "file not found: " + e.Message() : e.Message();
+		}
+		catch (const exception &e)
+		{
+			response["error"] = e.what();
+		}
+
+		return response;
+	}
+
+	//=========================================================================
+	//== Connections
+	//=========================================================================
+	//Answers a client's requests in order until it disconnects, then closes pipe
+	void Serve(const Parser &parser, HANDLE pipe)
+	{
+		Trace::NameThread("imgexpd connection");
+		Json::Reader reader;
+		Json::FastWriter writer;
+		string pending;
+		char buffer[4096];
+		DWORD read = 0;
+		bool connected = true;
+
+		auto respond = [&](const Json::Value &response)
+		{
+			auto text = writer.write(response);
+			DWORD written = 0;
+			connected = WriteFile(pipe, text.data(), static_cast<DWORD>(text.size()), &written, nullptr) && written == text.size();
+		};
+
+		while (connected && ReadFile(pipe, buffer, sizeof(buffer), &read, nullptr) && read > 0)
+		{
+			pending.append(buffer, read);
+
+			size_t end;
+			while (connected && (end = pending.find('\n')) != string::npos)
+			{
+				auto line = pending.substr(0, end);
+				pending.erase(0, end + 1);
+				if (line.find_first_not_of(" \t\r") == string::npos)
+					continue;
+
+				Json::Value request;
+				Json::Value response;
+				if (reader.parse(line, request, false) && request.isObject())
+				{
+					TraceScope trace("parse", "imgexpd::Handle");
+					response = Handle(parser, request);
+				}
+				else
+				{
+					response["id"] = Json::Value();
+					response["error"] = "requests are JSON objects, one per line";
+				}
+
+				respond(response);
+			}
+
+			if (connected && pending.size() > MAX_REQUEST_SIZE)
+			{
+				Json::Value response;
+				response["id"] = Json::Value();
+				response["error"] = "requests are limited to 1 MiB";
+				respond(response);
+				connected = false;
+			}
+		}
+
+		FlushFileBuffers(pipe);
+		DisconnectNamedPipe(pipe);
+		CloseHandle(pipe);
+		Trace::ReleaseThread();
+	}
+
+	void PrintReport(const char *what, const LoadReport &report)
+	{
+		cerr << "imgexpd: " << what << " " << report.loaded << " patterns" << endl;
+		for (auto &error : report.errors)
+			cerr << "imgexpd: " << error.file << ": " << error.message << endl;
+	}
+
+	//Accepts connections forever, serving each on a thread of its own
+	int Listen(const Options &options, const Parser &parser)
+	{
+		auto name = "\\\\.\\pipe\\" + options.pipe;
+		cerr << "imgexpd: listening on " << name << endl;
+
+		for (;;)
+		{
+			auto pipe = CreateNamedPipe(name.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+				PIPE_UNLIMITED_INSTANCES, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, nullptr);
+			if (pipe == INVALID_HANDLE_VALUE)
+			{
+				cerr << "imgexpd: CreateNamedPipe failed with " << GetLastError() << endl;
+				return 2;
+			}
+
+			if (!ConnectNamedPipe(pipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED)
+			{
+				CloseHandle(pipe);
+				continue;
+			}
+
+			//the parser outlives every connection, as Listen never returns while they're served
+			thread(Serve, cref(parser), pipe).detach();
+		}
+	}
+}
+
+//Runs until it's killed. Exits with 2 if it can't start.
+int main(int argc, char *argv[])
+{
+	using namespace imgexpd;
+
+	Options options;
+	string error;
+	if (!ParseOptions(argc, argv, options, error))
+	{
+		cerr << "imgexpd: " << error << "\n\n" << USAGE;
+		return 2;
+	}
+
+	try
+	{
+		SingleParser parser(options.size);
+		boost::system::error_code ec;
+		bool directory = boost::filesystem::is_directory(options.patterns, ec);
+
+		unique_ptr<PatternWatcher> watcher;
+		if (directory && options.watch)
+		{
+			watcher.reset(new PatternWatcher(parser, options.patterns));
+			watcher->Start([](const LoadReport &report) { PrintReport("synced", report); });
+		}
+		else
+		{
+			PrintReport("loaded", directory
+				? parser.LoadDirectory(options.patterns, options.threads)
+				: parser.LoadBundle(options.patterns, options.threads));
+		}
+
+		return Listen(options, parser);
+	}
+	catch (const Exception &e)
+	{
+		cerr << "imgexpd: " << e.Message() << endl;
+	}
+	catch (const exception &e)
+	{
+		cerr << "imgexpd: " << e.what() << endl;
+	}
+	return 2;
+}
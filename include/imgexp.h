@@ -27,10 +27,17 @@ imgexp.h - imgexp types
 
 #include <json/json-forwards.h>
 #include <memory>
+#include <new>
 #include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <fstream>
 #include <streambuf>
 #include <unordered_map>
+#include <list>
 #include <boost/current_function.hpp>
 #include <boost/format.hpp>
 
@@ -103,6 +110,7 @@ void WriteAllText(const std::string &fileName, const std::string &text, bool app
 void RequireTypeName(const Json::Value &value, const std::string &cmpType);
 class Operand;
 Operand *CreateOperand(const Json::Value &value, const char* key);
+Operand *CreateOperand(const Json::Value &operandValue);
 //Definitions to make a type persistable to/from Json.
 //This should only be applied to concrete types.
 #define JsonPersistableDef(type)\
@@ -185,9 +193,9 @@ public:
 	JsonPersistableDef(Color);
 	Color();
 	Color(BYTE red, BYTE green, BYTE blue);
-	BYTE Blue() const;
-	BYTE Red() const;
-	BYTE Green() const;
+	inline BYTE Blue() const { return _blue; }
+	inline BYTE Red() const { return _red; }
+	inline BYTE Green() const { return _green; }
 	bool operator==(const Color &rhs) const;
 	bool operator!=(const Color &rhs) const;
 	bool operator>(const Color &rhs) const;
@@ -203,49 +211,246 @@ class Bitmap {
 	const BITMAPINFOHEADER _bitmapInfo;
 	const long _width;
 	const long _height;
+	const bool _ownsColors;
+	//0 until Hash first computes it
+	mutable std::atomic<unsigned long long> _hash;
 public:
 	::imgexp::Size Size() const;
 	long Width() const;
 	long Height() const;
 	static Bitmap *FromFile(const std::string &fileName);
-	Bitmap(const BITMAPINFOHEADER &bitmapInfo, const Color colors[]);
+	//Takes ownership of colors unless ownsColors is false, when they must outlive the bitmap
+	Bitmap(const BITMAPINFOHEADER &bitmapInfo, const Color colors[], bool ownsColors = true);
 	//note: no need for a cctor because _colors is const.
 	virtual ~Bitmap();
 	void Save(const std::string &fileName) const;
 	const _Color &Color(const Point &location) const;
 	const _Color &Color(const long x, const long y) const;
+	//64 bit hash of the size and colors, computed on first use. FromFile computes it while the colors
+	//are still in cache. Frames with equal hashes are taken to be identical.
+	unsigned long long Hash() const;
 };
 #pragma endregion
 
+#pragma region statistics
+typedef unsigned long PatternId;
+//What matching a pattern cost, summed over the frames it was matched against. Only counted when
+//built with IMGEXP_STATS defined; otherwise the counting compiles away and everything stays 0.
+struct PatternStats {
+	static const size_t DEPTHS = 16;
+	unsigned long long frames;
+	//anchors the pattern was evaluated at
+	unsigned long long anchors;
+	//pixel matches evaluated
+	unsigned long long leafTests;
+	//frames the pattern was still at the location it was Found at the frame before
+	unsigned long long foundHits;
+	//anchors by the number of pixel matches it took to decide them; the last bucket holds the rest
+	unsigned long long depths[DEPTHS];
+	//wall time spent in Update and Find
+	double seconds;
+	PatternStats();
+	PatternStats &operator+=(const PatternStats &rhs);
+};
+typedef std::unordered_map<PatternId, PatternStats> StatsMap;
+//How often each of the conjuncts of a pattern's top level AND failed at the anchors sampled by
+//profiling. Counted regardless of IMGEXP_STATS, as profiling is switched on at runtime.
+struct EvaluationProfile {
+	unsigned long long anchors = 0;
+	//per conjunct, in the order the pattern declares them
+	std::vector<unsigned long long> failures;
+	//A profile of a different number of conjuncts replaces this one rather than being added
+	EvaluationProfile &operator+=(const EvaluationProfile &rhs);
+};
+typedef std::unordered_map<PatternId, EvaluationProfile> ProfileMap;
+inline bool StatsEnabled()
+{
+#ifdef IMGEXP_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+#pragma endregion
+
 #pragma region expression tree
 class PixelPattern;
+class OperandArena;
+class PredicateTable;
+
+//Every pixel of a frame bucketed by a hash of its color, in scan order within each bucket, so the
+//pixels of one color can be visited without scanning the frame. Built by a counting sort.
+class ColorIndex {
+	static const size_t BUCKETS = 1 << 16;
+	const long _width;
+	//where each bucket's pixels start in _pixels, plus the end of the last
+	std::vector<unsigned> _starts;
+	//y * width + x
+	std::vector<unsigned> _pixels;
+public:
+	explicit ColorIndex(const Bitmap &frame);
+	static size_t Bucket(const Color &color);
+	//The pixels in color's bucket in scan order: every pixel of that color, along with any others
+	//that share its bucket
+	inline const unsigned *Begin(const Color &color) const { return _pixels.data() + _starts[Bucket(color)]; }
+	inline const unsigned *End(const Color &color) const { return _pixels.data() + _starts[Bucket(color) + 1]; }
+	inline size_t Count(const Color &color) const { return End(color) - Begin(color); }
+	inline Point PixelAt(unsigned pixel) const { return Point(pixel % _width, pixel / _width); }
+};
+
+//The colors in each row of a frame, quantized to 3 bits of red and green and 2 of blue, so a pattern
+//can rule out every anchor row that would put one of its pixel matches on a row without any color
+//it could match. Built in one pass.
+class RowColors {
+public:
+	static const size_t WORDS = 4;
+	//A bit per quantized color
+	struct ColorSet {
+		unsigned long long words[WORDS];
+	};
+	explicit RowColors(const Bitmap &frame);
+	static unsigned Quantize(const Color &color);
+	//Every quantized color holding some color in [min, max]; empty if min > max in any channel
+	static ColorSet Quantize(const Color &min, const Color &max);
+	//Whether row y has a color in set
+	inline bool Intersects(long y, const ColorSet &set) const
+	{
+		auto &row = _rows[y];
+		return ((row.words[0] & set.words[0]) | (row.words[1] & set.words[1]) |
+			(row.words[2] & set.words[2]) | (row.words[3] & set.words[3])) != 0;
+	}
+private:
+	std::vector<ColorSet> _rows;
+};
+
+//Per-frame scratch shared by every pattern a Parser matches against one frame
+class FrameContext {
+	const Bitmap &_frame;
+	const size_t _words;
+	//per shared subexpression slot: a "known" bit per pixel followed by a "value" bit per pixel
+	std::vector<std::vector<unsigned long long>> _memo;
+	bool _indexColors = false;
+	std::unique_ptr<ColorIndex> _colorIndex;
+	bool _summarizeRows = false;
+	std::unique_ptr<RowColors> _rowColors;
+	//per PredicateTable predicate: a bit per pixel, set where the pixel satisfies it
+	std::vector<std::vector<unsigned long long>> _planes;
+#ifdef IMGEXP_STATS
+	StatsMap _stats;
+	PatternStats *_charged = nullptr;
+#endif
+public:
+	explicit FrameContext(const Bitmap &frame);
+	inline const Bitmap &Frame() const { return _frame; }
+	//Gets the value shared subexpression slot had at pt, if it's been evaluated there this frame
+	bool Recall(unsigned slot, const Point &pt, bool &value) const;
+	void Remember(unsigned slot, const Point &pt, bool value);
+	//Lets patterns ask for the frame's ColorIndex
+	inline void IndexColors() { _indexColors = true; }
+	//The frame's ColorIndex, built by the first pattern to ask for it, or nullptr unless IndexColors
+	//was called
+	const ColorIndex *Colors();
+	//Lets patterns ask for the frame's RowColors
+	inline void SummarizeRows() { _summarizeRows = true; }
+	//The frame's RowColors, built by the first pattern to ask for it, or nullptr unless SummarizeRows
+	//was called
+	const RowColors *Rows();
+	//Computes a plane per predicate in table, so the pixel matches linked to them are a bit test
+	void ClassifyPixels(const PredicateTable &table);
+	//predicate's plane, a bit per pixel at y * width + x, or nullptr if it has none
+	inline const unsigned long long *Plane(unsigned predicate) const { return predicate < _planes.size() ? _planes[predicate].data() : nullptr; }
+	//Gets whether pt satisfies predicate, if it has a plane
+	inline bool Classified(unsigned predicate, const Point &pt, bool &value) const
+	{
+		if (predicate >= _planes.size())
+			return false;
+
+		auto bit = static_cast<size_t>(pt.Y()) * _frame.Width() + pt.X();
+		value = ((_planes[predicate][bit / 64] >> (bit % 64)) & 1) != 0;
+		return true;
+	}
+#ifdef IMGEXP_STATS
+	//Charges the costs that follow to pattern id, returning what it's cost so far this frame
+	inline PatternStats &Charge(PatternId id) { return *(_charged = &_stats[id]); }
+	inline void CountLeafTest() { if (_charged) ++_charged->leafTests; }
+	//Costs of the patterns matched this frame, with frames left 0
+	inline const StatsMap &Stats() const { return _stats; }
+#endif
+};
 
 class Operand {
 public:
 	Operand();
 	virtual ~Operand() {}
 	VJsonPersistableDef(Operand) = 0;
-	virtual bool Eval(const Bitmap &ss, const Point &start) const = 0;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const = 0;
+	//Deep copy. With an arena the copy and everything under it are allocated from it, in evaluation order.
+	virtual Operand *Clone(OperandArena *arena = nullptr) const = 0;
+	//Bytes a Clone into an arena will take, including everything under this operand
+	virtual size_t ArenaSize() const = 0;
+	//The operand that does the work; only differs for operands that stand in for another
+	virtual const Operand &Resolve() const { return *this; }
 	friend bool operator==(Operand const &lhs, Operand const &rhs) {
-		return lhs.Equals(rhs);
+		return lhs.Resolve().Equals(rhs.Resolve());
 	}
 	friend bool operator!=(Operand const &lhs, Operand const &rhs) {
-		return !lhs.Equals(rhs);
+		return !(lhs == rhs);
 	}
 protected:
 	virtual bool Equals(const Operand &rhs) const = 0;
 };
 
+//Per-channel lookup tables classifying a color against up to 64 color ranges at once: bit i of
+//Classify is set when the color is within range i in every channel
+class ColorClassifier {
+	unsigned long long _red[256];
+	unsigned long long _green[256];
+	unsigned long long _blue[256];
+	std::vector<std::pair<Color, Color>> _ranges;
+public:
+	static const size_t CAPACITY = 64;
+	ColorClassifier();
+	//The bit of [min, max], which equal ranges share, or 0 once CAPACITY ranges have been added
+	unsigned long long Add(const Color &min, const Color &max);
+	inline size_t Count() const { return _ranges.size(); }
+	inline unsigned long long Classify(const Color &color) const
+	{
+		return _red[color.Red()] & _green[color.Green()] & _blue[color.Blue()];
+	}
+};
+
+//The distinct color predicates of a Parser's pixel matches, each a range of colors (an exact color
+//is a range of one). Only grows, so an index stays valid in every later copy of the table.
+class PredicateTable {
+	//predicate i is bit i % 64 of classifier i / 64
+	std::vector<ColorClassifier> _classifiers;
+	//by min and max packed into 48 bits
+	std::unordered_map<unsigned long long, unsigned> _indexes;
+public:
+	//The index of [min, max], adding it if it's new
+	unsigned Add(const Color &min, const Color &max);
+	inline size_t Count() const { return _indexes.size(); }
+	inline size_t Words() const { return _classifiers.size(); }
+	//The predicates color satisfies among word * 64 to word * 64 + 63, a bit each
+	inline unsigned long long Classify(size_t word, const Color &color) const { return _classifiers[word].Classify(color); }
+};
+
 class PixelMatch : public Operand {
 public:
+	static const unsigned UNCLASSIFIED = ~0u;
 	Point Offset() const;
 	void Offset(Point val);
+	//The index of the pixel match's color predicate in its Parser's PredicateTable, or
+	//UNCLASSIFIED. Not copied by Clone.
+	inline unsigned Predicate() const { return _predicate; }
+	inline void Predicate(unsigned predicate) { _predicate = predicate; }
 	PixelMatch();
 	virtual bool Equals(const Operand &rhs) const;
 	VJsonPersistableDef(PixelMatch) = 0;
-	virtual bool Eval(const Bitmap &ss, const Point &start) const = 0;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const = 0;
 protected:
 	Point _offset;
+	unsigned _predicate = UNCLASSIFIED;
 };
 
 //A pixel color matches exactly
@@ -254,7 +459,9 @@ class ExactPixelMatch : public PixelMatch {
 public:
 	VJsonPersistableDef(ExactPixelMatch);
 	ExactPixelMatch(const _Color &color);
-	virtual bool Eval(const Bitmap &ss, const Point &start) const;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
 	_Color Color() const;
 	void Color(imgexp::_Color val);
 protected:
@@ -268,14 +475,109 @@ class RangePixelMatch : public PixelMatch {
 public:
 	VJsonPersistableDef(RangePixelMatch);
 	RangePixelMatch(const Color &min, const Color &max);
-	virtual bool Eval(const Bitmap &ss, const Point &start) const;
-	const Color &Min();
-	const Color &Max();
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+	const Color &Min() const;
+	const Color &Max() const;
+	//Adds the range to classifier and evaluates through its bit rather than comparing channels;
+	//nullptr, or a full classifier, to compare again. Not copied by Clone.
+	void Classify(ColorClassifier *classifier);
 protected:
 	virtual bool Equals(const Operand &rhs) const;
 private:
 	Color _min;
 	Color _max;
+	const ColorClassifier *_classifier = nullptr;
+	unsigned long long _class = 0;
+};
+
+//A small reference image matches exactly, its top left corner at the offset from the anchor. A mask
+//leaves pixels out of the comparison. The compared pixels are kept as runs along each row, each
+//compared with a single memcmp against the frame's row, stopping at the first that differs. It
+//doesn't match where any of it would be off the frame.
+class BitmapPatchMatch : public Operand {
+public:
+	//A run of compared pixels in a row of the patch
+	struct Span {
+		long y;
+		long x;
+		long count;
+	};
+	VJsonPersistableDef(BitmapPatchMatch);
+	//Copies width * height pixels, rows top down, and mask, a byte per pixel that's nonzero where the
+	//pixel is compared; every pixel is without one
+	BitmapPatchMatch(long width, long height, const _Color pixels[], const BYTE mask[] = nullptr);
+	//Copies area of bitmap
+	BitmapPatchMatch(const Bitmap &bitmap, const Area &area);
+	BitmapPatchMatch(const BitmapPatchMatch &rhs);
+	virtual ~BitmapPatchMatch();
+	Point Offset() const;
+	void Offset(Point val);
+	inline long Width() const { return _width; }
+	inline long Height() const { return _height; }
+	inline const _Color &Pixel(long x, long y) const { return _pixels[y * _width + x]; }
+	//Whether pixel x, y is compared
+	bool Masked(long x, long y) const;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+protected:
+	virtual bool Equals(const Operand &rhs) const;
+	BitmapPatchMatch();
+	//Constructs an arena-owned copy of rhs in storage Allocate'd from arena, its pixels and spans after it
+	BitmapPatchMatch(const BitmapPatchMatch &rhs, OperandArena &arena);
+	//Loads everything but the type, which is the caller's to check
+	void _Load(const Json::Value &value);
+	//What the pixels and spans take in an arena
+	size_t _DataArenaSize() const;
+	//Where the patch would be on ss from start; false if any of it would be off ss
+	bool Place(const Bitmap &ss, const Point &start, long &left, long &top) const;
+	Point _offset;
+	long _width = 0;
+	long _height = 0;
+	//rows top down
+	_Color *_pixels = nullptr;
+	Span *_spans = nullptr;
+	size_t _spanCount = 0;
+	//false when the pixels and spans live in an arena
+	bool _ownsPixels = true;
+private:
+	BitmapPatchMatch &operator=(const BitmapPatchMatch &rhs);
+	void _Init(long width, long height, const _Color pixels[], const BYTE mask[]);
+};
+
+//How far a FuzzyPatchMatch's patch is from the frame, summed over its compared pixels and channels
+enum class PatchDistance {
+	//absolute differences
+	SAD,
+	//squared differences
+	SSD,
+};
+
+//A patch matches while its distance from the frame is at most maxDistance, so compression noise
+//doesn't break it. Runs are compared 16 bytes at a time with SSE2, and comparing stops as soon as
+//the distance so far passes maxDistance.
+class FuzzyPatchMatch : public BitmapPatchMatch {
+public:
+	VJsonPersistableDef(FuzzyPatchMatch);
+	FuzzyPatchMatch(const BitmapPatchMatch &patch, unsigned long long maxDistance, PatchDistance distance = PatchDistance::SAD);
+	FuzzyPatchMatch(const FuzzyPatchMatch &rhs);
+	inline unsigned long long MaxDistance() const { return _maxDistance; }
+	inline PatchDistance Distance() const { return _distance; }
+	//The patch's distance from ss at start, or something over limit once it's known to be. Patches
+	//that would be partly off ss are always over.
+	unsigned long long DistanceAt(const Bitmap &ss, const Point &start, unsigned long long limit) const;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+protected:
+	virtual bool Equals(const Operand &rhs) const;
+	FuzzyPatchMatch(const FuzzyPatchMatch &rhs, OperandArena &arena);
+private:
+	unsigned long long _maxDistance = 0;
+	PatchDistance _distance = PatchDistance::SAD;
+	FuzzyPatchMatch &operator=(const FuzzyPatchMatch &rhs);
 };
 
 static std::string OpOrStr("OR");
@@ -297,6 +599,10 @@ class Expression : public Operand {
 	Operand * _left = nullptr;
 	Operand * _right = nullptr;
 	::imgexp::Operator _operator = ::imgexp::Operator::NONE;
+	//_right when it's an Expression, so Eval can walk down a chain rather than recurse into it
+	const Expression *_rightExpression = nullptr;
+	//false when the operands live in an arena
+	bool _ownsOperands = true;
 public:
 	Expression(Operand *left, ::imgexp::Operator op = ::imgexp::Operator::NONE, Operand *right = nullptr);
 	virtual ~Expression();
@@ -305,61 +611,701 @@ public:
 	imgexp::Operator Operator() const;
 	Operand * Right() const;
 	void SetRight(::imgexp::Operator op = ::imgexp::Operator::NONE, Operand *right = nullptr);
-	virtual bool Eval(const Bitmap &ss, const Point &start) const;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+	//Constructs an arena-owned expression in storage Allocate'd from arena ahead of its operands
+	static Expression *Place(OperandArena &arena, void *storage, Operand *left,
+		::imgexp::Operator op = ::imgexp::Operator::NONE, Operand *right = nullptr);
+protected:
+	virtual bool Equals(const Operand &rhs) const;
+};
+
+//AND or OR over any number of operands, evaluated in order with short circuiting
+class CompoundExpression : public Operand {
+	Operand **_operands = nullptr;
+	size_t _count = 0;
+	::imgexp::Operator _operator = ::imgexp::Operator::AND;
+	//false when the operands live in an arena
+	bool _ownsOperands = true;
+	CompoundExpression(const CompoundExpression &rhs);
+	CompoundExpression &operator=(const CompoundExpression &rhs);
+	CompoundExpression(::imgexp::Operator op, Operand **operands, size_t count);
+public:
+	//Takes ownership of operands once constructed
+	CompoundExpression(::imgexp::Operator op, const std::vector<Operand*> &operands);
+	virtual ~CompoundExpression();
+	VJsonPersistableDef(CompoundExpression);
+	imgexp::Operator Operator() const;
+	inline size_t Count() const { return _count; }
+	inline Operand *Get(size_t index) const { return _operands[index]; }
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+	//Constructs an arena-owned expression in storage Allocate'd from arena ahead of operands,
+	//which must be count operands Allocate'd from the same arena
+	static CompoundExpression *Place(OperandArena &arena, void *storage, ::imgexp::Operator op, Operand **operands, size_t count);
+protected:
+	virtual bool Equals(const Operand &rhs) const;
+};
+
+struct OptimizeReport {
+	size_t nodesBefore = 0;
+	size_t nodesAfter = 0;
+	//pixel tests dropped because another test on the same pixel covers them or was merged with them
+	size_t merged = 0;
+	//ANDs of tests on the same pixel that can never all pass
+	size_t contradictions = 0;
+};
+//Returns a heap copy of root with AND/OR chains flattened into CompoundExpressions, NONE expressions
+//removed and redundant or contradictory pixel tests at the same offset merged. An AND that can never
+//pass becomes a RangePixelMatch whose min is above its max.
+Operand *Optimize(const Operand &root, OptimizeReport &report);
+
+//Stands in for a subexpression a Parser shares between patterns. Within a frame it's evaluated
+//at most once per anchor, whichever pattern asks first; the rest reuse the result.
+class SharedOperand : public Operand {
+	const Operand *_target;
+	unsigned _slot;
+public:
+	SharedOperand(const Operand *target, unsigned slot);
+	//Serializes as the shared subexpression itself
+	virtual operator const Json::Value() const;
+	virtual bool Eval(const Bitmap &ss, const Point &start, FrameContext *context = nullptr) const;
+	virtual Operand *Clone(OperandArena *arena = nullptr) const;
+	virtual size_t ArenaSize() const;
+	virtual const Operand &Resolve() const;
+	inline unsigned Slot() const { return _slot; }
 protected:
 	virtual bool Equals(const Operand &rhs) const;
 };
 
+//Bump allocator for operand graphs. Everything allocated from it is destroyed and freed in one
+//shot when it is, so operands allocated from it must not delete each other.
+class OperandArena {
+	std::vector<char*> _blocks;
+	std::vector<Operand*> _operands;
+	char *_next = nullptr;
+	size_t _left = 0;
+	size_t _used = 0;
+	const size_t _blockSize;
+	OperandArena(const OperandArena &rhs);
+	OperandArena &operator=(const OperandArena &rhs);
+public:
+	//Sizes are rounded up to this so every allocation is suitably aligned
+	static const size_t ALIGNMENT = 16;
+	static inline size_t Align(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+	//blockSize is the size of each block; a single block of ArenaSize() holds a whole graph.
+	explicit OperandArena(size_t blockSize = 4096);
+	~OperandArena();
+	inline size_t Used() const { return _used; }
+	inline size_t Blocks() const { return _blocks.size(); }
+	//Raw storage for an operand that Track will be called on once it's constructed
+	void *Allocate(size_t size);
+	//Registers an operand constructed in Allocate'd storage for destruction with the arena
+	template <class T>
+	T *Track(T *operand)
+	{
+		_operands.push_back(operand);
+		return operand;
+	}
+	template <class T>
+	T *New(const T &rhs)
+	{
+		return Track(new (Allocate(sizeof(T))) T(rhs));
+	}
+};
+
+//A flip or rotation of a pattern's offsets within their bounding box, which keeps its top left
+enum class Transform {
+	NONE,
+	//flipped left to right
+	MIRROR_X,
+	//flipped top to bottom
+	MIRROR_Y,
+	//rotated clockwise
+	ROTATE_90,
+	ROTATE_180,
+	ROTATE_270,
+};
+
 typedef std::vector<std::vector<bool>> FlagMatrix;
-typedef unsigned long PatternId;
 class PixelPattern {
+	typedef std::vector<std::pair<Point, Color>> ExactLeaves;
+	typedef std::vector<std::pair<long, RowColors::ColorSet>> RowLeaves;
+	//_root under one of _transforms, compiled into an arena of its own
+	struct Variant {
+		Transform transform;
+		OperandArena *arena;
+		Operand *root;
+		ExactLeaves exactLeaves;
+		RowLeaves rowLeaves;
+	};
 	bool _changed = false;
 	PatternId _id = 0;
-	Expression *_root = nullptr;
+	//_root and everything under it live in _arena
+	OperandArena *_arena = nullptr;
+	Operand *_root = nullptr;
 	FlagMatrix *_flagMatrix = nullptr;
 	std::vector<Area> *_searchAreas = nullptr;
 	Size _imageSize;
+	//Keeps the subexpressions SharedOperands in _root stand in for alive
+	std::vector<std::shared_ptr<const Operand>> _sharedOperands;
 	//Not included in serialization or equality
 	Point *_found = nullptr;
+	//_root's conjuncts are compiled in this order of the declared ones; empty for the declared order
+	std::vector<unsigned> _evaluationOrder;
+	//The root as declared, saved in its place once _root is compiled in a learned order; nullptr until then
+	Json::Value *_declaredRoot = nullptr;
+	//What the order was learned from. Saved with the pattern, not included in equality.
+	EvaluationProfile _profile;
+	//The offsets and colors of the ExactPixelMatches among _root's top level conjuncts. Every match
+	//has each of them, so any one can find the candidate anchors in a ColorIndex.
+	ExactLeaves _exactLeaves;
+	//The row offsets and quantized colors of the Exact and RangePixelMatches among _root's top level
+	//conjuncts: an anchor row can only match if each of those rows has one of its colors
+	RowLeaves _rowLeaves;
+	//Classifies the colors for the RangePixelMatches _root and its variants own; nullptr if they
+	//have none
+	ColorClassifier *_classifier = nullptr;
+	//The transforms the pattern is also searched in, tried in this order after the declared one
+	std::vector<Transform> _transforms;
+	//_root under each of _transforms, recompiled with it
+	std::vector<Variant> _variants;
+	//What _found was found in. Not included in serialization or equality.
+	Transform _foundVariant = Transform::NONE;
 	static FlagMatrix *CreateFlagMatrix(const Size &imageSize, const std::vector<Area> &searchAreas);
+	//Fills exactLeaves and rowLeaves from root
+	static void _FindLeaves(const Operand &root, ExactLeaves &exactLeaves, RowLeaves &rowLeaves);
+	//Replaces _variants with _root under each of _transforms
+	void _CompileVariants();
+	void _DeleteVariants();
+	//Replaces _classifier with one for the RangePixelMatches _root and its variants own and links
+	//them to it
+	void _Classify();
+	//Whether anchors on row y can match, going by rows' colors
+	static bool _RowMayMatch(const RowLeaves &rowLeaves, const RowColors &rows, long y, long height);
+	//Sets the state Update would leave after Reset on ss if the pattern was found (or not)
+	void _Restore(const Bitmap &ss, const Point *found);
+	//Find without timing itself, for Update to time as a whole
+	bool _Find(const Bitmap &ss, Point &found, Transform &variant, FrameContext *context) const;
+	//Copies root into a new arena sized to hold all of it contiguously
+	void Compile(const Operand &root);
+	//Compiles root with the conjuncts of its top level AND in order (indexes into the declared ones)
+	void CompileInOrder(const Operand &root, const std::vector<unsigned> &order);
+	//The conjuncts of _root's top level AND, in declared order
+	std::vector<const Operand*> DeclaredConjuncts() const;
+	//Takes ownership of an already compiled root and the arena it lives in
+	PixelPattern(Size imageSize, PatternId id, OperandArena *arena, Operand *root, std::vector<Area> *searchAreas);
+	friend class PatternBundle;
+	friend struct Parser;
 public:
 	static const wchar_t* PIXEL_PATTERN_FILE_EXT;
+	//Takes ownership of root and searchAreas. root is compiled into the pattern's arena and deleted.
 	PixelPattern(Size imageSize, PatternId id, Expression *root, std::vector<Area> *searchAreas = nullptr);
+	PixelPattern(const PixelPattern &rhs);
+	//Steals rhs's compiled operands and state, leaving it empty
+	PixelPattern(PixelPattern &&rhs);
 	~PixelPattern();
 	JsonPersistableDef(PixelPattern);
 	static PixelPattern *FromFile(const std::string &file);
 	inline const Point *Found() const { return _found; }
+	//What Found was found in: NONE for the pattern as declared, otherwise one of its Transforms
+	inline Transform FoundVariant() const { return _foundVariant; }
 	inline bool Changed() const { return _changed; }
 	inline PatternId Id() const { return _id; }
+	inline const Size &ImageSize() const { return _imageSize; }
 	void Reset();
-	void Update(const Bitmap &ss);
+	void Update(const Bitmap &ss, FrameContext *context = nullptr);
+	//Scans ss for the first match without touching Found/Changed, so it's safe to call concurrently.
+	bool Find(const Bitmap &ss, Point &found, FrameContext *context = nullptr) const;
+	//Find, also giving what the match was found in
+	bool Find(const Bitmap &ss, Point &found, Transform &variant, FrameContext *context = nullptr) const;
+	//Every anchor the pattern or any of its variants matches at in ss, in scan order. Evaluates the
+	//expression over all anchors at once, a bit per anchor: pixel matches become rows of bits, from
+	//the context's planes if it has them, and operators become bitwise operations on whole words.
+	//Pixel matches whose pixel is off the frame don't match.
+	void FindAll(const Bitmap &ss, std::vector<Point> &found, FrameContext *context = nullptr) const;
+	//Recompiles the pattern from imgexp::Optimize(root). Drops any subexpression sharing.
+	//Drops any learned evaluation order.
+	OptimizeReport Optimize();
+	//Evaluates every conjunct, without short circuiting, at every sampleEvery'th anchor in ss and
+	//counts their failures into profile
+	void Sample(const Bitmap &ss, EvaluationProfile &profile, unsigned sampleEvery = 1) const;
+	//Adds profile to the pattern's and recompiles its conjuncts cheapest expected first: by their
+	//pixel matches over how often they fail. The first is the anchor's leading test. The order and
+	//profile are saved with the pattern and reapplied when it's loaded.
+	void LearnEvaluationOrder(const EvaluationProfile &profile);
+	inline const std::vector<unsigned> &EvaluationOrder() const { return _evaluationOrder; }
+	inline const EvaluationProfile &Profile() const { return _profile; }
+	inline const std::vector<Transform> &Transforms() const { return _transforms; }
+	//Also searches for the pattern under each of transforms, as a variant compiled with it. NONE and
+	//repeats are dropped. A scan tries every variant at each anchor, after the declared pattern, and
+	//only skips a row when none of them can match on it. Saved with the pattern.
+	void Transforms(const std::vector<Transform> &transforms);
 	bool operator==(const PixelPattern &rhs) const;
 	bool operator!=(const PixelPattern &rhs) const;
+private:
+	PixelPattern &operator=(const PixelPattern &rhs);
+};
+
+#pragma region concurrency
+//Lock-free single producer/single consumer ring buffer. Capacity is rounded up to a power of 2.
+template <class T>
+class SpscQueue {
+	std::vector<T> _slots;
+	const size_t _mask;
+	char _pad0[64];
+	//next slot to pop; only written by the consumer
+	std::atomic<size_t> _head;
+	char _pad1[64];
+	//next slot to push; only written by the producer
+	std::atomic<size_t> _tail;
+	static size_t RoundUp(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		return size;
+	}
+	SpscQueue(const SpscQueue &rhs);
+	SpscQueue &operator=(const SpscQueue &rhs);
+public:
+	explicit SpscQueue(size_t capacity)
+		: _slots(RoundUp(capacity)), _mask(RoundUp(capacity) - 1), _head(0), _tail(0)
+	{}
+	inline size_t Capacity() const { return _slots.size(); }
+	inline size_t Size() const { return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire); }
+	//Producer only. Returns false if the queue is full.
+	bool Push(const T &value)
+	{
+		auto tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == _slots.size())
+			return false;
+
+		_slots[tail & _mask] = value;
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+	//Consumer only. Returns false if the queue is empty.
+	bool Pop(T &value)
+	{
+		auto head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return false;
+
+		value = _slots[head & _mask];
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+};
+#pragma endregion
+
+#pragma region frame ring
+//Fixed size frames handed from a capturing process to a parsing one through named shared memory,
+//without copying or touching the disk. The producer Acquires a free slot, writes a frame's rows
+//into it and Commits it; the consumer Reads the oldest committed slot as a Bitmap over the shared
+//rows and Releases it once parsed. When every slot is committed Acquire waits for a Release, so
+//a slow consumer holds the producer back rather than losing frames. One producer, one consumer.
+class FrameRing {
+	//at the start of the shared memory, ahead of the slots
+	struct Header;
+	HANDLE _mapping = nullptr;
+	//counts the slots the producer can acquire
+	HANDLE _free = nullptr;
+	//counts the slots committed for the consumer
+	HANDLE _filled = nullptr;
+	Header *_header = nullptr;
+	Color *_slots = nullptr;
+	Size _frameSize;
+	unsigned _slotCount;
+	//slots Acquired and Read but not yet Committed and Released, or -1
+	long _writing = -1;
+	long _reading = -1;
+	Bitmap *_frame = nullptr;
+	void Close();
+	FrameRing(const FrameRing &rhs);
+	FrameRing &operator=(const FrameRing &rhs);
+public:
+	//Creates the ring under name, or opens the one another process created with the same frameSize
+	//and slots, waiting up to a second for that process to finish creating it
+	FrameRing(const std::string &name, const Size &frameSize, unsigned slots);
+	~FrameRing();
+	inline const Size &FrameSize() const { return _frameSize; }
+	inline unsigned Slots() const { return _slotCount; }
+	//Frames committed so far, across both ends
+	unsigned long long Committed() const;
+	//Producer. Waits up to timeout ms for a free slot and returns its colors, rows bottom up as in a
+	//.bmp; nullptr if none came free.
+	Color *Acquire(unsigned long timeout = INFINITE);
+	//Producer. Publishes the slot last Acquired as the next frame.
+	void Commit();
+	//Consumer. Waits up to timeout ms for the oldest committed frame; nullptr if none came. The
+	//bitmap is the ring's, over the shared colors, and is only valid until Release.
+	const Bitmap *Read(unsigned long timeout = INFINITE);
+	//Consumer. Hands the slot last Read back to the producer.
+	void Release();
+};
+#pragma endregion
+
+#pragma region tracing
+#ifdef _MSC_VER
+#define IMGEXP_THREAD_LOCAL __declspec(thread)
+#else
+#define IMGEXP_THREAD_LOCAL __thread
+#endif
+
+//A span on one thread's timeline. name and category must be string literals.
+struct TraceEvent {
+	const char *name;
+	const char *category;
+	//QueryPerformanceCounter ticks
+	long long start;
+	long long end;
+	unsigned thread;
+	//shown as the span's "id" argument unless it's -1
+	long long arg;
+};
+
+//Records spans into per-thread rings for chrome://tracing or Perfetto. A thread only takes a lock
+//the first time it records; after that recording is a push onto its own ring, and a full ring
+//drops the event rather than waiting on Flush. When tracing is off a span costs one atomic load.
+class Trace {
+	static std::atomic<bool> _enabled;
+public:
+	//Starts recording, giving threads that haven't recorded yet rings of capacity events
+	static void Start(size_t capacity = 1 << 16);
+	static void Stop();
+	inline static bool Enabled() { return _enabled.load(std::memory_order_relaxed); }
+	//Moves everything recorded so far out of the rings into fileName, as a trace event JSON array.
+	//Returns the number of events written.
+	static size_t Flush(const std::string &fileName);
+	//Events dropped because their thread's ring was full
+	static unsigned long long Dropped();
+	//Names the calling thread's track. name must be a string literal.
+	static void NameThread(const char *name);
+	//Hands the calling thread's ring on to the next thread that needs one. For threads that are about
+	//to exit; what they recorded is still flushed.
+	static void ReleaseThread();
+	static long long Now();
+	static void Record(const char *category, const char *name, long long start, long long arg);
+};
+
+//Traces the span from construction to destruction on the calling thread
+class TraceScope {
+	const char *_category;
+	const char *_name;
+	long long _arg;
+	long long _start;
+	TraceScope(const TraceScope &rhs);
+	TraceScope &operator=(const TraceScope &rhs);
+public:
+	inline TraceScope(const char *category, const char *name, long long arg = -1)
+		: _category(category), _name(Trace::Enabled() ? name : nullptr), _arg(arg), _start(_name ? Trace::Now() : 0)
+	{}
+	inline ~TraceScope()
+	{
+		if (_name)
+			Trace::Record(_category, _name, _start, _arg);
+	}
+};
+#pragma endregion
+
+//Published by a Parser for every pattern that's found after a frame when it wasn't before, isn't
+//found when it was, or is found somewhere else, going by where it was found after the frame before.
+struct ChangeEvent {
+	PatternId id;
+	//Parser::Frame() of the frame that caused the change
+	unsigned long long frame;
+	//where the pattern was found before the frame, if it was
+	bool wasFound;
+	Point oldLocation;
+	//where the pattern was found in the frame, if it was
+	bool found;
+	Point newLocation;
+};
+typedef SpscQueue<ChangeEvent> ChangeQueue;
+typedef std::function<void(const ChangeEvent &event)> ChangeCallback;
+
+#pragma region pattern bundles
+//A versioned binary file holding many compiled patterns. Opening one maps it read only and indexes
+//its records; loading a pattern decodes its fixed size operand records in evaluation order straight
+//into a single arena block, with no text parsing and no per-operand allocation.
+class PatternBundle {
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+	const char *_view = nullptr;
+	size_t _size = 0;
+	std::vector<size_t> _offsets;
+	PatternBundle(const PatternBundle &rhs);
+	PatternBundle &operator=(const PatternBundle &rhs);
+	void Close();
+public:
+	static const wchar_t* PATTERN_BUNDLE_FILE_EXT;
+	static const unsigned VERSION;
+	explicit PatternBundle(const std::string &fileName);
+	~PatternBundle();
+	inline size_t Count() const { return _offsets.size(); }
+	PatternId Id(size_t index) const;
+	//Caller owns the returned pattern
+	PixelPattern *Load(size_t index) const;
+	static void Write(const std::string &fileName, const std::vector<const PixelPattern*> &patterns);
+	//Compiles the JSON .pattern files into a bundle
+	static void Convert(const std::vector<std::string> &patternFiles, const std::string &bundleFile);
+};
+#pragma endregion
+
+//A file that couldn't be loaded by Parser::LoadDirectory/LoadBundle, and why
+struct LoadError {
+	std::string file;
+	ErrorCode code;
+	std::string message;
+};
+struct LoadReport {
+	size_t loaded = 0;
+	std::vector<LoadError> errors;
+};
+struct SharingReport {
+	//distinct subexpressions now shared
+	size_t shared = 0;
+	//subexpressions in patterns replaced by a shared one
+	size_t replaced = 0;
+};
+
+class PatternWatcher;
+typedef std::unordered_map<PatternId, std::shared_ptr<PixelPattern>> PatternMap;
+//An immutable version of a Parser's patterns. Every change publishes a new set sharing the patterns
+//that didn't change, so a frame parses against whichever set was current when it started while
+//patterns are added and removed on other threads. A set and the patterns only it holds are freed
+//once the last frame using it finishes.
+struct PatternSet {
+	unsigned long long version = 0;
+	PatternMap patterns;
+	//What the patterns' pixel matches are linked to; nullptr until one is
+	std::shared_ptr<const PredicateTable> predicates;
+};
+typedef std::shared_ptr<const PatternSet> PatternSnapshot;
+//Where each pattern was found in a frame. Patterns that weren't found are absent.
+typedef std::unordered_map<PatternId, Point> FrameResult;
+
+//The results of matching the frames seen most recently, keyed by frame Hash and pattern set version
+//so that changing the patterns never returns stale results. Least recently used results are evicted
+//once it's full. Safe to use from many threads.
+class ResultCache {
+	typedef std::pair<unsigned long long, unsigned long long> Key;
+	struct KeyHash {
+		inline size_t operator()(const Key &key) const { return std::hash<unsigned long long>()(key.first ^ (key.second * 0x9e3779b97f4a7c15ULL)); }
+	};
+	typedef std::list<std::pair<Key, FrameResult>> Entries;
+	//most recently used first
+	Entries _entries;
+	std::unordered_map<Key, Entries::iterator, KeyHash> _index;
+	const size_t _capacity;
+	mutable std::mutex _lock;
+	unsigned long long _hits = 0;
+	unsigned long long _misses = 0;
+	ResultCache(const ResultCache &rhs);
+	ResultCache &operator=(const ResultCache &rhs);
+public:
+	explicit ResultCache(size_t capacity);
+	inline size_t Capacity() const { return _capacity; }
+	size_t Size() const;
+	//Copies the result stored for the frame and version into result, counting a hit or a miss
+	bool Find(unsigned long long frameHash, unsigned long long version, FrameResult &result);
+	void Add(unsigned long long frameHash, unsigned long long version, const FrameResult &result);
+	void Clear();
+	unsigned long long Hits() const;
+	unsigned long long Misses() const;
+	//Hits over lookups, or 0 before the first
+	double HitRate() const;
 };
 
-typedef std::unordered_map<PatternId, PixelPattern*> PatternMap;
 struct Parser {
 	explicit Parser(const Size &imageSize);
 	virtual ~Parser();
+	//Adding and removing patterns is safe while other threads parse; a frame already being parsed
+	//finishes with the patterns it started with.
 	void AddPattern(const PixelPattern &pattern);
+	void AddPattern(PixelPattern &&pattern);
+	//Loads every .pattern file in directory on up to threads workers (0 = one per core). Files that
+	//fail to load, don't match the parser's image size or repeat an id already added are reported
+	//without stopping the rest; for repeated ids the first file in name order wins.
+	LoadReport LoadDirectory(const std::string &directory, unsigned threads = 0);
+	//As LoadDirectory, for every pattern in a PatternBundle
+	LoadReport LoadBundle(const std::string &fileName, unsigned threads = 0);
+	//Finds expressions of at least minLeaves pixel matches that are Equal across (or within) patterns
+	//and makes every occurrence share one copy, evaluated once per anchor per frame. Sharing is redone
+	//from scratch each call, so call it again after adding patterns. Not safe to call while parsing.
+	SharingReport ShareSubexpressions(size_t minLeaves = 4);
+	//Optimizes every pattern, totalling their reports. Drops sharing, so share afterwards.
+	//Not safe to call while parsing.
+	OptimizeReport Optimize();
 	void RemovePattern(PatternId id);
-	const PixelPattern *GetPattern(PatternId id) const;
+	//nullptr if there's no pattern with id. Keeps the pattern alive after it's removed.
+	std::shared_ptr<const PixelPattern> GetPattern(PatternId id) const;
+	//The current pattern set; holding on to it keeps its patterns alive. Never waits on a writer's
+	//_EditPatterns, but std::atomic_load on a shared_ptr isn't lock-free everywhere (MSVC guards it with
+	//a spinlock), so it can briefly wait on another thread loading or storing the set.
+	PatternSnapshot Patterns() const;
+	//Bumped every time the pattern set changes
+	inline unsigned long long Version() const { return Patterns()->version; }
+	//Matches every pattern against bmp without touching the patterns' state.
+	void Match(const Bitmap &bmp, FrameResult &result) const;
+	//As above, for just the patterns in ids. Ids with no pattern are skipped.
+	void Match(const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> &ids) const;
+	//As above, against patterns, a set Patterns returned, so the caller knows which version it matched
+	void Match(const PatternSnapshot &patterns, const Bitmap &bmp, FrameResult &result) const;
+	void Match(const PatternSnapshot &patterns, const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> &ids) const;
+	inline const Size &ImageSize() const { return _imageSize; }
+	//Number of frames parsed so far
+	inline unsigned long long Frame() const { return _frame; }
+	//Invokes callback on the parsing thread for every change. Not safe to call while parsing.
+	void AddChangeListener(const ChangeCallback &callback);
+	//Creates the queue every change is pushed to, for a single consumer on another thread to pop
+	//from. Events that don't fit are dropped and counted. Not safe to call while parsing.
+	ChangeQueue &EnableChangeQueue(size_t capacity);
+	//nullptr unless EnableChangeQueue was called
+	inline ChangeQueue *ChangeEvents() const { return _changeQueue; }
+	//Creates the cache Match and SingleParser::Parse look frames up in before matching them, and
+	//store their results in after. SeriesParser doesn't use it: where a pattern is found depends on
+	//where it was found the frame before. Not safe to call while parsing.
+	ResultCache &EnableResultCache(size_t capacity);
+	//nullptr unless EnableResultCache was called
+	inline ResultCache *Results() const { return _resultCache; }
+	//When on, patterns with an ExactPixelMatch among their top level conjuncts visit only the pixels of
+	//their rarest exact color when they search a frame, from a ColorIndex built once per frame. Pays
+	//off once enough patterns search each frame to cover building the index.
+	inline void IndexColors(bool indexColors) { _indexColors.store(indexColors, std::memory_order_relaxed); }
+	//When on, patterns with an Exact or RangePixelMatch among their top level conjuncts skip the
+	//anchor rows that put one on a row without a color it could match, going by a RowColors built
+	//once per frame. Pays off when patterns need colors most rows don't have.
+	inline void SummarizeRows(bool summarizeRows) { _summarizeRows.store(summarizeRows, std::memory_order_relaxed); }
+	//When on, every frame starts by testing each pixel against each distinct color predicate of the
+	//patterns' pixel matches, a plane of bits per predicate, and the pixel matches test their bit.
+	//Pays off when many patterns test the same few colors.
+	inline void ClassifyPixels(bool classifyPixels) { _classifyPixels.store(classifyPixels, std::memory_order_relaxed); }
+	inline unsigned long long DroppedChangeEvents() const { return _droppedChangeEvents.load(std::memory_order_relaxed); }
+	//Each pattern's costs summed over every frame parsed or matched since the last ResetStats. Frames
+	//answered from the result cache cost nothing and aren't counted. Empty unless built with IMGEXP_STATS.
+	StatsMap Stats() const;
+	//Each pattern's costs in the last frame parsed or matched
+	StatsMap LastFrameStats() const;
+	void ResetStats();
+	//Samples every sampleEvery'th anchor of every pattern in each frame parsed or matched, other than
+	//those answered from the result cache, to learn their evaluation orders from; 0 stops. Evaluates
+	//every sampled conjunct, so it's slow.
+	void Profile(unsigned sampleEvery = 64);
+	//What profiling has gathered since it was started or last learned from
+	ProfileMap Profiles() const;
+	//Has every profiled pattern learn its evaluation order from what profiling gathered and returns
+	//how many did. If directory is given, the .pattern files in it holding those patterns are
+	//rewritten so they're loaded in that order. Not safe to call while parsing.
+	size_t LearnEvaluationOrder(const std::string &directory = std::string());
 protected:
 	const Size _imageSize;
-	PatternMap *_patterns;
+	//Only read and replaced with std::atomic_load/atomic_store; replaced by _EditPatterns
+	PatternSnapshot _patterns;
+	//Serializes writers. Readers never take it.
+	std::mutex _writeLock;
+	unsigned long long _frame = 0;
+	std::vector<ChangeCallback> _changeListeners;
+	ChangeQueue *_changeQueue = nullptr;
+	ResultCache *_resultCache = nullptr;
+	std::atomic<unsigned long long> _droppedChangeEvents;
+	mutable std::mutex _statsLock;
+	mutable StatsMap _stats;
+	mutable StatsMap _lastFrameStats;
+	std::atomic<bool> _indexColors;
+	std::atomic<bool> _summarizeRows;
+	std::atomic<bool> _classifyPixels;
+	std::atomic<unsigned> _profileEvery;
+	mutable std::mutex _profileLock;
+	mutable ProfileMap _profiles;
+	void _Publish(const ChangeEvent &event);
+	//Adds a frame's costs to the totals
+	void _AddStats(const FrameContext &context) const;
+	//Matches the patterns in ids, or every pattern in snapshot if it's null
+	void _Match(const PatternSnapshot &snapshot, const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> *ids) const;
+	//Samples bmp into _profiles if profiling is on
+	void _Profile(const Bitmap &bmp, const PatternSet &patterns) const;
+	//Copies the current set under _writeLock, lets edit change the copy and publishes it as the next
+	//version. Nothing is published if edit throws.
+	void _EditPatterns(const std::function<void(PatternMap &patterns)> &edit);
+	//Links the pixel matches not yet linked to a predicate in set's table, copying the table first
+	//if that adds predicates
+	static void _LinkPredicates(PatternSet &set);
+	friend class PatternWatcher;
+	//Validates and adds loaded patterns in order. errors[i] names where loaded[i] came from and says
+	//why it failed to load if it's null; it's reused to report why it couldn't be added otherwise.
+	void _AddLoaded(std::vector<std::unique_ptr<PixelPattern>> &loaded, std::vector<LoadError> &errors, LoadReport &report);
 	virtual void _Parse(const Bitmap &bmp, bool reset);
 };
 
+typedef std::function<void(size_t index, const Bitmap &bmp, const FrameResult &result)> BatchCallback;
 struct SingleParser : public Parser {
 	explicit SingleParser(const Size &imageSize);
 	void Parse(const Bitmap &bmp);
+	//Parses independent frames on up to threads workers (0 = one per core) and hands the
+	//results to callback in input order. At most maxInFlight frames (0 = 2 per worker) are
+	//held between being picked up and being delivered.
+	void ParseBatch(const std::vector<const Bitmap*> &frames, const BatchCallback &callback,
+		unsigned threads = 0, size_t maxInFlight = 0) const;
+	//As above, but each bitmap is loaded by the worker that parses it and freed once delivered.
+	void ParseBatch(const std::vector<std::string> &files, const BatchCallback &callback,
+		unsigned threads = 0, size_t maxInFlight = 0) const;
+private:
+	typedef std::function<const Bitmap *(size_t index)> FrameSource;
+	typedef std::function<void(const Bitmap *bmp)> FrameRelease;
+	void _ParseBatch(size_t count, const FrameSource &acquire, const FrameRelease &release,
+		const BatchCallback &callback, unsigned threads, size_t maxInFlight) const;
 };
 
 struct SeriesParser : public Parser {
 	explicit SeriesParser(const Size &imageSize);
 	void Next(const Bitmap &bmp, bool reset = false);
+	//Parses the oldest frame in ring in place and releases its slot. Waits up to timeout ms for one
+	//and returns false if none came.
+	bool Next(FrameRing &ring, unsigned long timeout = INFINITE, bool reset = false);
 };
 
+#pragma region pattern watching
+//Keeps a Parser's patterns in step with the .pattern files in a directory. Each Sync reloads only the
+//files added, rewritten or deleted since the last one and swaps the results into the parser as one
+//version. A reloaded pattern that's Equal to the one it replaces is dropped in favour of the one
+//already in the parser, so its Found/Changed state carries on.
+class PatternWatcher {
+	struct WatchedFile {
+		unsigned long long written;
+		unsigned long long size;
+		//whether the parser's pattern with id was loaded from this file
+		bool owns;
+		PatternId id;
+	};
+	Parser &_parser;
+	const std::string _directory;
+	std::unordered_map<std::string, WatchedFile> _files;
+	std::mutex _syncLock;
+	HANDLE _stop;
+	std::thread _thread;
+	PatternWatcher(const PatternWatcher &rhs);
+	PatternWatcher &operator=(const PatternWatcher &rhs);
+public:
+	typedef std::function<void(const LoadReport &report)> SyncCallback;
+	PatternWatcher(Parser &parser, const std::string &directory);
+	~PatternWatcher();
+	inline const std::string &Directory() const { return _directory; }
+	//Reloads what changed since the last Sync on up to threads workers (0 = one per core); the first
+	//Sync loads every file. A file that fails to load or validate is reported and leaves the pattern
+	//it last loaded in place.
+	LoadReport Sync(unsigned threads = 0);
+	//Syncs, then keeps syncing on a background thread whenever the directory changes, handing each
+	//report to callback on that thread.
+	void Start(const SyncCallback &callback = SyncCallback());
+	void Stop();
+	inline bool Running() const { return _thread.joinable(); }
+};
+#pragma endregion
+
 IMGEXP_NS_END
 
 #endif //_IMGEXP_H_
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "json/json.h"
+#include "imgexp.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+using namespace imgexp;
+
+namespace imgexpscan {
+	const char *USAGE =
+		"usage: imgexp-scan [options] <patterns> <images>...\n"
+		"\n"
+		"Matches every pattern against every image and writes a JSON object per line: an \"image\"\n"
+		"record per image in the order given, an \"error\" record per image that couldn't be\n"
+		"scanned and a \"summary\" record with the throughput of each run.\n"
+		"\n"
+		"  <patterns>        a directory of .pattern files or a pattern bundle\n"
+		"  <images>          .bmp files, directories of them, or @file listing one per line\n"
+		"\n"
+		"  --threads <n>     parse on n workers; 0 (the default) is one per core\n"
+		"  --in-flight <n>   frames held between loading and delivery; 0 (the default) is 2 per worker\n"
+		"  --repeat <n>      scan everything n times, for benchmarking; images are written once\n"
+		"  --summary-only    don't write image records\n"
+		"  --output <file>   write to file rather than standard output\n";
+
+	struct Options {
+		string patterns;
+		vector<string> images;
+		unsigned threads = 0;
+		size_t inFlight = 0;
+		unsigned repeat = 1;
+		bool summaryOnly = false;
+		string output;
+	};
+
+	//An image that can be scanned, and its size from its headers
+	struct Image {
+		string file;
+		Size size;
+	};
+
+	//=========================================================================
+	//== Arguments
+	//=========================================================================
+	bool ParseCount(const string &text, unsigned long long &count)
+	{
+		if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+			return false;
+
+		//all digits can still be past what fits
+		try
+		{
+			count = stoull(text);
+		}
+		catch (const out_of_range &)
+		{
+			return false;
+		}
+		return true;
+	}
+
+	bool ParseOptions(int argc, char *argv[], Options &options, string &error)
+	{
+		vector<string> positional;
+		for (int i = 1; i < argc; ++i)
+		{
+			string arg(argv[i]);
+			if (arg.compare(0, 2, "--") != 0)
+			{
+				positional.push_back(arg);
+				continue;
+			}
+
+			if (arg == "--summary-only")
+			{
+				options.summaryOnly = true;
+				continue;
+			}
+
+			if (i + 1 == argc)
+			{
+				error = arg + " needs a value";
+				return false;
+			}
+
+			string value(argv[++i]);
+			unsigned long long count = 0;
+			if (arg == "--output")
+			{
+				options.output = value;
+				continue;
+			}
+
+			if (!ParseCount(value, count))
+			{
+				error = arg + " needs a number";
+				return false;
+			}
+
+			if (arg == "--threads")
+				options.threads = static_cast<unsigned>(count);
+			else if (arg == "--in-flight")
+				options.inFlight = static_cast<size_t>(count);
+			else if (arg == "--repeat")
+			{
+				if (count == 0)
+				{
+					error = arg + " needs a number > 0";
+					return false;
+				}
+				options.repeat = static_cast<unsigned>(count);
+			}
+			else
+			{
+				error = "unknown option " + arg;
+				return false;
+			}
+		}
+
+		if (positional.size() < 2)
+		{
+			error = "patterns and images are required";
+			return false;
+		}
+
+		options.patterns = positional[0];
+		options.images.assign(positional.begin() + 1, positional.end());
+		return true;
+	}
+
+	//=========================================================================
+	//== Images
+	//=========================================================================
+	//Reads just the headers, so unreadable files and mismatched sizes are reported up front rather
+	//than failing the batch part way through
+	bool ReadImageSize(const string &file, Size &size)
+	{
+		ifstream input(file.c_str(), ios_base::binary);
+		BITMAPFILEHEADER header;
+		BITMAPINFOHEADER info;
+		if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+			!input.read(reinterpret_cast<char*>(&info), sizeof(info)))
+			return false;
+
+		if (header.bfType != 0x4d42 || info.biWidth <= 0 || info.biHeight <= 0 || info.biBitCount != 24)
+			return false;
+
+		size = Size(info.biWidth, info.biHeight);
+		return true;
+	}
+
+	//Expands directories (their .bmp files in name order) and @lists, keeping everything else as given
+	void ExpandImages(const vector<string> &args, vector<string> &files)
+	{
+		for (auto &arg : args)
+		{
+			if (arg.size() > 1 && arg[0] == '@')
+			{
+				ifstream list(arg.substr(1).c_str());
+				if (!list)
+				{
+					//reported as an unreadable image
+					files.push_back(arg);
+					continue;
+				}
+
+				string line;
+				while (getline(list, line))
+				{
+					line.erase(line.find_last_not_of(" \t\r") + 1);
+					if (!line.empty())
+						files.push_back(line);
+				}
+				continue;
+			}
+
+			boost::system::error_code ec;
+			if (!boost::filesystem::is_directory(arg, ec))
+			{
+				files.push_back(arg);
+				continue;
+			}
+
+			vector<string> found;
+			for (boost::filesystem::directory_iterator it(arg, ec), end; !ec && it != end; it.increment(ec))
+			{
+				auto ext = it->path().extension().string();
+				transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+				if (ext == ".bmp" && boost::filesystem::is_regular_file(it->status()))
+					found.push_back(it->path().string());
+			}
+
+			sort(found.begin(), found.end());
+			files.insert(files.end(), found.begin(), found.end());
+		}
+	}
+
+	//=========================================================================
+	//== Output
+	//=========================================================================
+	Json::Value ErrorRecord(const string &file, const string &message)
+	{
+		Json::Value record;
+		record["type"] = "error";
+		record["file"] = file;
+		record["message"] = message;
+		return record;
+	}
+
+	//elapsedMs is since the run started, as frames are parsed in parallel rather than one at a time
+	Json::Value ImageRecord(size_t index, const string &file, double elapsedMs, const FrameResult &result)
+	{
+		Json::Value record;
+		record["type"] = "image";
+		record["index"] = static_cast<Json::UInt64>(index);
+		record["file"] = file;
+		record["elapsedMs"] = elapsedMs;
+
+		//in id order, so runs can be diffed
+		vector<PatternId> ids;
+		for (auto &found : result)
+			ids.push_back(found.first);
+		sort(ids.begin(), ids.end());
+
+		record["found"] = Json::Value(Json::arrayValue);
+		for (auto id : ids)
+		{
+			Json::Value match;
+			match["id"] = static_cast<Json::UInt64>(id);
+			match["x"] = static_cast<Json::Int64>(result.at(id).X());
+			match["y"] = static_cast<Json::Int64>(result.at(id).Y());
+			record["found"].append(match);
+		}
+		return record;
+	}
+
+	double Seconds(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	//=========================================================================
+	//== Scan
+	//=========================================================================
+	int Scan(const Options &options, ostream &output)
+	{
+		Json::FastWriter writer;
+		auto write = [&](const Json::Value &record) { output << writer.write(record); };
+		bool failed = false;
+
+		vector<string> files;
+		ExpandImages(options.images, files);
+
+		vector<Image> images;
+		for (auto &file : files)
+		{
+			Image image;
+			image.file = file;
+			if (!ReadImageSize(file, image.size))
+			{
+				write(ErrorRecord(file, "not a readable 24 bit bitmap"));
+				failed = true;
+			}
+			else if (!images.empty() && image.size != images.front().size)
+			{
+				write(ErrorRecord(file, "not the same size as the first image"));
+				failed = true;
+			}
+			else
+			{
+				images.push_back(image);
+			}
+		}
+
+		if (images.empty())
+		{
+			cerr << "imgexp-scan: no images to scan" << endl;
+			return 2;
+		}
+
+		auto loadStart = chrono::steady_clock::now();
+		SingleParser parser(images.front().size);
+		boost::system::error_code ec;
+		auto report = boost::filesystem::is_directory(options.patterns, ec)
+			? parser.LoadDirectory(options.patterns, options.threads)
+			: parser.LoadBundle(options.patterns, options.threads);
+		auto loadSeconds = Seconds(loadStart);
+
+		for (auto &error : report.errors)
+		{
+			write(ErrorRecord(error.file, error.message));
+			failed = true;
+		}
+
+		if (report.loaded == 0)
+		{
+			cerr << "imgexp-scan: no patterns loaded from " << options.patterns << endl;
+			return 2;
+		}
+
+		vector<string> scanned;
+		for (auto &image : images)
+			scanned.push_back(image.file);
+
+		auto threads = options.threads ? options.threads : max(1u, thread::hardware_concurrency());
+		auto pixels = static_cast<double>(images.front().size.Width()) * images.front().size.Height();
+		for (unsigned run = 0; run < options.repeat; ++run)
+		{
+			bool records = run == 0 && !options.summaryOnly;
+			auto start = chrono::steady_clock::now();
+			size_t found = 0;
+
+			parser.ParseBatch(scanned, [&](size_t index, const Bitmap &, const FrameResult &result)
+			{
+				found += result.size();
+				if (records)
+					write(ImageRecord(index, scanned[index], Seconds(start) * 1000, result));
+			}, options.threads, options.inFlight);
+
+			auto seconds = Seconds(start);
+			Json::Value summary;
+			summary["type"] = "summary";
+			summary["run"] = run + 1;
+			summary["images"] = static_cast<Json::UInt64>(scanned.size());
+			summary["patterns"] = static_cast<Json::UInt64>(report.loaded);
+			summary["found"] = static_cast<Json::UInt64>(found);
+			summary["threads"] = threads;
+			summary["loadSeconds"] = loadSeconds;
+			summary["seconds"] = seconds;
+			summary["imagesPerSecond"] = seconds > 0 ? scanned.size() / seconds : 0.0;
+			summary["megapixelsPerSecond"] = seconds > 0 ? scanned.size() * pixels / seconds / 1e6 : 0.0;
+			write(summary);
+		}
+
+		output.flush();
+		return failed ? 1 : 0;
+	}
+}
+
+//Exits with 0 if everything was scanned, 1 if some images or patterns couldn't be and 2 if nothing was
+int main(int argc, char *argv[])
+{
+	using namespace imgexpscan;
+
+	Options options;
+	string error;
+	if (!ParseOptions(argc, argv, options, error))
+	{
+		cerr << "imgexp-scan: " << error << "\n\n" << USAGE;
+		return 2;
+	}
+
+	try
+	{
+		if (options.output.empty())
+			return Scan(options, cout);
+
+		ofstream output(options.output.c_str(), ios_base::trunc);
+		if (!output)
+		{
+			cerr << "imgexp-scan: can't write " << options.output << endl;
+			return 2;
+		}
+		return Scan(options, output);
+	}
+	catch (const Exception &e)
+	{
+		cerr << "imgexp-scan: " << e.Message() << endl;
+	}
+	catch (const exception &e)
+	{
+		cerr << "imgexp-scan: " << e.what() << endl;
+	}
+	return 2;
+}
@@ -18,6 +18,19 @@ imgexp.cpp - imgexp types
 
 #include "imgexp.h"
 #include <json/json.h>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+#include <sstream>
+#include <iomanip>
+#include <typeinfo>
+#include <emmintrin.h>
 
 using namespace std;
 
@@ -74,6 +87,68 @@ static bool VectorsEqual(const vector<T> &a, const vector<T> &b)
 	}
 	return true;
 }
+static const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static string EncodeBase64(const void *data, size_t size)
+{
+	auto bytes = static_cast<const unsigned char*>(data);
+	string text;
+	text.reserve((size + 2) / 3 * 4);
+
+	for (size_t i = 0; i < size; i += 3)
+	{
+		unsigned group = bytes[i] << 16;
+		if (i + 1 < size)
+			group |= bytes[i + 1] << 8;
+		if (i + 2 < size)
+			group |= bytes[i + 2];
+
+		text += BASE64_DIGITS[(group >> 18) & 63];
+		text += BASE64_DIGITS[(group >> 12) & 63];
+		text += i + 1 < size ? BASE64_DIGITS[(group >> 6) & 63] : '=';
+		text += i + 2 < size ? BASE64_DIGITS[group & 63] : '=';
+	}
+
+	return text;
+}
+static std::vector<unsigned char> DecodeBase64(const string &text)
+{
+	if (text.size() % 4 != 0)
+		ThrowDeserialization("base64 text must be a multiple of 4 characters");
+
+	std::vector<unsigned char> bytes;
+	bytes.reserve(text.size() / 4 * 3);
+
+	for (size_t i = 0; i < text.size(); i += 4)
+	{
+		unsigned group = 0;
+		size_t padding = 0;
+		for (size_t j = 0; j < 4; ++j)
+		{
+			auto c = text[i + j];
+			unsigned digit = 0;
+			if (c == '=' && i + 4 == text.size() && j >= 2)
+				++padding;
+			else if (padding)
+				ThrowDeserialization("base64 padding must end the text");
+			else
+			{
+				auto found = std::strchr(BASE64_DIGITS, c);
+				if (!c || !found)
+					ThrowDeserialization("text isn't base64");
+				digit = static_cast<unsigned>(found - BASE64_DIGITS);
+			}
+			group = (group << 6) | digit;
+		}
+
+		bytes.push_back(static_cast<unsigned char>(group >> 16));
+		if (padding < 2)
+			bytes.push_back(static_cast<unsigned char>(group >> 8));
+		if (padding < 1)
+			bytes.push_back(static_cast<unsigned char>(group));
+	}
+
+	return bytes;
+}
 void WriteJsonToFile(const string &file, const Json::Value &value)
 {
 	Json::StyledWriter writer;
@@ -111,21 +186,31 @@ void RequireTypeName(const Json::Value &value, const std::string &cmpType)
 Operand *CreateOperand(const Json::Value &value, const char *key)
 {
 	auto operandValue = value.get(key, Json::Value::null);
-	if (!operandValue.isNull())
-	{
-		auto type = GetJsonValue(operandValue, "type").asString();
-
-		static std::string ExactPixelMatchStr("ExactPixelMatch");
-		static std::string RangePixelMatchStr("RangePixelMatch");
-		static std::string ExpressionStr("Expression");
-
-		if (type == ExpressionStr)
-			return new Expression(operandValue);
-		else if (type == ExactPixelMatchStr)
-			return new ExactPixelMatch(operandValue);
-		else if (type == RangePixelMatchStr)
-			return new RangePixelMatch(operandValue);
-	}
+	return operandValue.isNull() ? nullptr : CreateOperand(operandValue);
+}
+Operand *CreateOperand(const Json::Value &operandValue)
+{
+	auto type = GetJsonValue(operandValue, "type").asString();
+
+	static std::string ExactPixelMatchStr("ExactPixelMatch");
+	static std::string RangePixelMatchStr("RangePixelMatch");
+	static std::string BitmapPatchMatchStr("BitmapPatchMatch");
+	static std::string FuzzyPatchMatchStr("FuzzyPatchMatch");
+	static std::string ExpressionStr("Expression");
+	static std::string CompoundExpressionStr("CompoundExpression");
+
+	if (type == ExpressionStr)
+		return new Expression(operandValue);
+	else if (type == CompoundExpressionStr)
+		return new CompoundExpression(operandValue);
+	else if (type == ExactPixelMatchStr)
+		return new ExactPixelMatch(operandValue);
+	else if (type == RangePixelMatchStr)
+		return new RangePixelMatch(operandValue);
+	else if (type == BitmapPatchMatchStr)
+		return new BitmapPatchMatch(operandValue);
+	else if (type == FuzzyPatchMatchStr)
+		return new FuzzyPatchMatch(operandValue);
 
 	return nullptr;
 }
@@ -152,6 +237,165 @@ std::string GetAllText(const std::string &fileName)
 	return str;
 }
 
+//Runs task(0) .. task(count - 1) on up to threads workers (0 = one per core). task must not throw.
+static void ParallelFor(size_t count, unsigned threads, const std::function<void(size_t index)> &task)
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t index = next++; index < count; index = next++)
+			task(index);
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; ++i)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			Trace::NameThread("ParallelFor worker");
+			worker();
+			Trace::ReleaseThread();
+		}));
+	}
+
+	//the calling thread pulls its weight too
+	worker();
+
+	for (auto &t : workers)
+		t.join();
+}
+
+//Calls load, filling in error's code and message from any exception it throws
+template <class Load>
+static bool TryLoad(LoadError &error, Load load)
+{
+	try
+	{
+		load();
+		return true;
+	}
+	catch (const Exception &e)
+	{
+		error.code = e.Code();
+		error.message = e.Message();
+	}
+	catch (const std::exception &e)
+	{
+		error.code = ErrorCode::Deserialization;
+		error.message = e.what();
+	}
+	catch (...)
+	{
+		error.code = ErrorCode::Logic;
+		error.message = "unknown error";
+	}
+
+	return false;
+}
+
+//Every .pattern file in directory, in name order
+static std::vector<WIN32_FIND_DATA> FindPatternFiles(const std::string &directory)
+{
+	std::wstring wideExt(PixelPattern::PIXEL_PATTERN_FILE_EXT);
+	std::string ext(wideExt.begin(), wideExt.end());
+
+	std::vector<WIN32_FIND_DATA> files;
+	WIN32_FIND_DATA findData;
+	auto find = FindFirstFile((directory + "\\*" + ext).c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		if (GetLastError() != ERROR_FILE_NOT_FOUND)
+			ThrowFileNotFound(directory);
+
+		return files;
+	}
+
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			files.push_back(findData);
+	} while (FindNextFile(find, &findData));
+	FindClose(find);
+
+	//FindNextFile doesn't promise any order
+	std::sort(files.begin(), files.end(), [](const WIN32_FIND_DATA &lhs, const WIN32_FIND_DATA &rhs)
+	{
+		return strcmp(lhs.cFileName, rhs.cFileName) < 0;
+	});
+	return files;
+}
+
+//xxHash64: four independent lanes over 32 byte stripes, so the loop pipelines well
+static unsigned long long HashBytes(const void *data, size_t size, unsigned long long seed)
+{
+	const unsigned long long P1 = 11400714785074694791ULL;
+	const unsigned long long P2 = 14029467366897019727ULL;
+	const unsigned long long P3 = 1609587929392839161ULL;
+	const unsigned long long P4 = 9650029242287828579ULL;
+	const unsigned long long P5 = 2870177450012600261ULL;
+
+	auto rotl = [](unsigned long long x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto read64 = [](const BYTE *p) { unsigned long long value; memcpy(&value, p, sizeof(value)); return value; };
+	auto mix = [&](unsigned long long acc, unsigned long long input) { return rotl(acc + input * P2, 31) * P1; };
+	auto merge = [&](unsigned long long acc, unsigned long long lane) { return (acc ^ mix(0, lane)) * P1 + P4; };
+
+	auto p = static_cast<const BYTE*>(data);
+	auto end = p + size;
+	unsigned long long hash;
+
+	if (size >= 32)
+	{
+		unsigned long long v1 = seed + P1 + P2;
+		unsigned long long v2 = seed + P2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - P1;
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = mix(v1, read64(p));
+			v2 = mix(v2, read64(p + 8));
+			v3 = mix(v3, read64(p + 16));
+			v4 = mix(v4, read64(p + 24));
+		}
+
+		hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		hash = merge(hash, v1);
+		hash = merge(hash, v2);
+		hash = merge(hash, v3);
+		hash = merge(hash, v4);
+	}
+	else
+	{
+		hash = seed + P5;
+	}
+
+	hash += size;
+	for (; p + 8 <= end; p += 8)
+		hash = rotl(hash ^ mix(0, read64(p)), 27) * P1 + P4;
+
+	if (p + 4 <= end)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		hash = rotl(hash ^ (value * P1), 23) * P2 + P3;
+		p += 4;
+	}
+
+	for (; p < end; ++p)
+		hash = rotl(hash ^ (*p * P5), 11) * P1;
+
+	hash ^= hash >> 33;
+	hash *= P2;
+	hash ^= hash >> 29;
+	hash *= P3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //// Size
 ///////////////////////////////////////////////////////////////////////////////
@@ -462,21 +706,6 @@ Color::operator const Json::Value() const
 	return value;
 }
 
-BYTE Color::Blue() const
-{
-	return _blue;
-}
-
-BYTE Color::Red() const
-{
-	return _red;
-}
-
-BYTE Color::Green() const
-{
-	return _green;
-}
-
 bool Color::operator==(const Color &rhs) const
 {
 	return rhs._blue == _blue && rhs._green == _green && rhs._red == _red;
@@ -512,6 +741,8 @@ bool Color::operator<=(const Color &rhs) const
 ///////////////////////////////////////////////////////////////////////////////
 Bitmap *Bitmap::FromFile(const string &fileName)
 {
+	TraceScope trace("io", "Bitmap::FromFile");
+
 	//open the file
 	auto file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
 		OPEN_EXISTING, 0, 0);
@@ -540,15 +771,18 @@ Bitmap *Bitmap::FromFile(const string &fileName)
 
 	CloseHandle(file);
 
-	return new Bitmap(bmih, colors);
+	auto bitmap = new Bitmap(bmih, colors);
+	bitmap->Hash();
+	return bitmap;
 }
-Bitmap::Bitmap(const BITMAPINFOHEADER &bitmapInfo, const _Color colors[])
-: _colors(colors), _bitmapInfo(bitmapInfo), _width(bitmapInfo.biWidth), _height(bitmapInfo.biHeight)
+Bitmap::Bitmap(const BITMAPINFOHEADER &bitmapInfo, const _Color colors[], bool ownsColors)
+: _colors(colors), _bitmapInfo(bitmapInfo), _width(bitmapInfo.biWidth), _height(bitmapInfo.biHeight),
+_ownsColors(ownsColors), _hash(0)
 {}
 
 Bitmap::~Bitmap()
 {
-	if (_colors)
+	if (_colors && _ownsColors)
 		delete[] _colors;
 }
 
@@ -614,11 +848,316 @@ const _Color & Bitmap::Color(const long x, const long y) const
 	return _colors[(_height - 1 - y)*_width + x];
 }
 
+unsigned long long Bitmap::Hash() const
+{
+	auto hash = _hash.load(std::memory_order_relaxed);
+	if (hash)
+		return hash;
+
+	auto seed = (static_cast<unsigned long long>(_width) << 32) | static_cast<unsigned long>(_height);
+	hash = HashBytes(_colors, _width * _height * sizeof(_Color), seed);
+
+	//0 means not computed yet
+	if (!hash)
+		hash = 1;
+
+	_hash.store(hash, std::memory_order_relaxed);
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// PatternStats
+///////////////////////////////////////////////////////////////////////////////
+PatternStats::PatternStats()
+: frames(0), anchors(0), leafTests(0), foundHits(0), seconds(0)
+{
+	std::fill(depths, depths + DEPTHS, 0ULL);
+}
+PatternStats &PatternStats::operator+=(const PatternStats &rhs)
+{
+	frames += rhs.frames;
+	anchors += rhs.anchors;
+	leafTests += rhs.leafTests;
+	foundHits += rhs.foundHits;
+	for (size_t i = 0; i < DEPTHS; ++i)
+		depths[i] += rhs.depths[i];
+	seconds += rhs.seconds;
+	return *this;
+}
+EvaluationProfile &EvaluationProfile::operator+=(const EvaluationProfile &rhs)
+{
+	if (failures.size() != rhs.failures.size())
+		return *this = rhs;
+
+	anchors += rhs.anchors;
+	for (size_t i = 0; i < failures.size(); ++i)
+		failures[i] += rhs.failures[i];
+	return *this;
+}
+#ifdef IMGEXP_STATS
+#define StatsCountLeaf(context) if (context) (context)->CountLeafTest()
+namespace {
+	//Adds the wall time between construction and destruction to stats, if there are any
+	class StatsTimer {
+		PatternStats *_stats;
+		LARGE_INTEGER _start;
+	public:
+		explicit StatsTimer(PatternStats *stats) : _stats(stats)
+		{
+			if (_stats)
+				QueryPerformanceCounter(&_start);
+		}
+		~StatsTimer()
+		{
+			if (!_stats)
+				return;
+
+			LARGE_INTEGER end, frequency;
+			QueryPerformanceCounter(&end);
+			QueryPerformanceFrequency(&frequency);
+			_stats->seconds += static_cast<double>(end.QuadPart - _start.QuadPart) / frequency.QuadPart;
+		}
+	};
+}
+#else
+#define StatsCountLeaf(context)
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//// ColorIndex
+///////////////////////////////////////////////////////////////////////////////
+ColorIndex::ColorIndex(const Bitmap &frame)
+: _width(frame.Width()), _starts(BUCKETS + 1)
+{
+	TraceScope trace("parse", "ColorIndex::ColorIndex");
+	auto width = frame.Width();
+	auto height = frame.Height();
+	auto pixels = static_cast<size_t>(width) * height;
+
+	//count each bucket's pixels, remembering the buckets so the scatter doesn't rehash
+	std::vector<unsigned short> buckets(pixels);
+	size_t pixel = 0;
+	for (long y = 0; y < height; ++y)
+	{
+		for (long x = 0; x < width; ++x, ++pixel)
+		{
+			auto bucket = Bucket(frame.Color(x, y));
+			buckets[pixel] = static_cast<unsigned short>(bucket);
+			++_starts[bucket + 1];
+		}
+	}
+
+	for (size_t i = 1; i <= BUCKETS; ++i)
+		_starts[i] += _starts[i - 1];
+
+	//in scan order, so each bucket comes out sorted
+	std::vector<unsigned> next(_starts.begin(), _starts.end() - 1);
+	_pixels.resize(pixels);
+	for (pixel = 0; pixel < pixels; ++pixel)
+		_pixels[next[buckets[pixel]]++] = static_cast<unsigned>(pixel);
+}
+size_t ColorIndex::Bucket(const Color &color)
+{
+	unsigned rgb = (color.Red() << 16) | (color.Green() << 8) | color.Blue();
+	//Fibonacci hashing; the top bits are the well mixed ones
+	return static_cast<unsigned>(rgb * 2654435761u) >> 16;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// RowColors
+///////////////////////////////////////////////////////////////////////////////
+RowColors::RowColors(const Bitmap &frame)
+: _rows(frame.Height())
+{
+	TraceScope trace("parse", "RowColors::RowColors");
+	auto width = frame.Width();
+	for (long y = 0; y < frame.Height(); ++y)
+	{
+		auto &row = _rows[y];
+		row = ColorSet();
+		for (long x = 0; x < width; ++x)
+		{
+			auto quantized = Quantize(frame.Color(x, y));
+			row.words[quantized / 64] |= 1ULL << (quantized % 64);
+		}
+	}
+}
+unsigned RowColors::Quantize(const Color &color)
+{
+	return ((color.Red() >> 5) << 5) | ((color.Green() >> 5) << 2) | (color.Blue() >> 6);
+}
+RowColors::ColorSet RowColors::Quantize(const Color &min, const Color &max)
+{
+	ColorSet set = ColorSet();
+	if (min.Red() > max.Red() || min.Green() > max.Green() || min.Blue() > max.Blue())
+		return set;
+
+	for (unsigned red = min.Red() >> 5; red <= static_cast<unsigned>(max.Red() >> 5); ++red)
+	{
+		for (unsigned green = min.Green() >> 5; green <= static_cast<unsigned>(max.Green() >> 5); ++green)
+		{
+			for (unsigned blue = min.Blue() >> 6; blue <= static_cast<unsigned>(max.Blue() >> 6); ++blue)
+			{
+				auto quantized = (red << 5) | (green << 2) | blue;
+				set.words[quantized / 64] |= 1ULL << (quantized % 64);
+			}
+		}
+	}
+	return set;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// FrameContext
+///////////////////////////////////////////////////////////////////////////////
+FrameContext::FrameContext(const Bitmap &frame)
+: _frame(frame), _words((static_cast<size_t>(frame.Width()) * frame.Height() + 63) / 64)
+{}
+bool FrameContext::Recall(unsigned slot, const Point &pt, bool &value) const
+{
+	if (slot >= _memo.size() || _memo[slot].empty())
+		return false;
+
+	auto bit = static_cast<size_t>(pt.Y()) * _frame.Width() + pt.X();
+	auto word = bit / 64;
+	auto mask = 1ULL << (bit % 64);
+	auto &memo = _memo[slot];
+
+	if (!(memo[word] & mask))
+		return false;
+
+	value = (memo[_words + word] & mask) != 0;
+	return true;
+}
+const ColorIndex *FrameContext::Colors()
+{
+	if (!_indexColors)
+		return nullptr;
+
+	if (!_colorIndex)
+		_colorIndex.reset(new ColorIndex(_frame));
+	return _colorIndex.get();
+}
+const RowColors *FrameContext::Rows()
+{
+	if (!_summarizeRows)
+		return nullptr;
+
+	if (!_rowColors)
+		_rowColors.reset(new RowColors(_frame));
+	return _rowColors.get();
+}
+namespace {
+	const unsigned char DE_BRUIJN_BITS[64] = {
+		0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+		62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+		63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+		46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6
+	};
+
+	//The index of the lowest set bit of a nonzero value
+	inline unsigned LowestBit(unsigned long long value)
+	{
+		return DE_BRUIJN_BITS[((value & (~value + 1)) * 0x03f79d71b4cb0a89ULL) >> 58];
+	}
+}
+void FrameContext::ClassifyPixels(const PredicateTable &table)
+{
+	TraceScope trace("parse", "FrameContext::ClassifyPixels");
+	_planes.assign(table.Count(), std::vector<unsigned long long>(_words));
+
+	//a pixel satisfies few predicates, so its bits are scattered one by one rather than transposed
+	size_t bit = 0;
+	for (long y = 0; y < _frame.Height(); ++y)
+	{
+		for (long x = 0; x < _frame.Width(); ++x, ++bit)
+		{
+			auto &color = _frame.Color(x, y);
+			for (size_t word = 0; word < table.Words(); ++word)
+			{
+				for (auto classes = table.Classify(word, color); classes; classes &= classes - 1)
+					_planes[word * ColorClassifier::CAPACITY + LowestBit(classes)][bit / 64] |= 1ULL << (bit % 64);
+			}
+		}
+	}
+}
+void FrameContext::Remember(unsigned slot, const Point &pt, bool value)
+{
+	if (slot >= _memo.size())
+		_memo.resize(slot + 1);
+
+	auto &memo = _memo[slot];
+	if (memo.empty())
+		memo.resize(_words * 2);
+
+	auto bit = static_cast<size_t>(pt.Y()) * _frame.Width() + pt.X();
+	auto word = bit / 64;
+	auto mask = 1ULL << (bit % 64);
+
+	memo[word] |= mask;
+	if (value)
+		memo[_words + word] |= mask;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //// Operand
 ///////////////////////////////////////////////////////////////////////////////
 Operand::Operand()
 {}
+///////////////////////////////////////////////////////////////////////////////
+//// ColorClassifier
+///////////////////////////////////////////////////////////////////////////////
+ColorClassifier::ColorClassifier()
+{
+	std::fill(std::begin(_red), std::end(_red), 0ULL);
+	std::fill(std::begin(_green), std::end(_green), 0ULL);
+	std::fill(std::begin(_blue), std::end(_blue), 0ULL);
+}
+unsigned long long ColorClassifier::Add(const Color &min, const Color &max)
+{
+	auto range = std::make_pair(min, max);
+	for (size_t i = 0; i < _ranges.size(); ++i)
+	{
+		if (_ranges[i] == range)
+			return 1ULL << i;
+	}
+
+	if (_ranges.size() == CAPACITY)
+		return 0;
+
+	auto bit = 1ULL << _ranges.size();
+	_ranges.push_back(range);
+	//empty when min > max, so the range's bit is never set
+	for (unsigned value = min.Red(); value <= max.Red(); ++value)
+		_red[value] |= bit;
+	for (unsigned value = min.Green(); value <= max.Green(); ++value)
+		_green[value] |= bit;
+	for (unsigned value = min.Blue(); value <= max.Blue(); ++value)
+		_blue[value] |= bit;
+	return bit;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// PredicateTable
+///////////////////////////////////////////////////////////////////////////////
+unsigned PredicateTable::Add(const Color &min, const Color &max)
+{
+	auto pack = [](const Color &color) { return (color.Red() << 16) | (color.Green() << 8) | color.Blue(); };
+	auto key = (static_cast<unsigned long long>(pack(min)) << 24) | pack(max);
+
+	auto found = _indexes.find(key);
+	if (found != _indexes.end())
+		return found->second;
+
+	auto index = static_cast<unsigned>(_indexes.size());
+	if (index % ColorClassifier::CAPACITY == 0)
+		_classifiers.push_back(ColorClassifier());
+
+	//a new range in a classifier that isn't full, so it always gets the next bit
+	_classifiers.back().Add(min, max);
+	_indexes[key] = index;
+	return index;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //// PixelMatch
 ///////////////////////////////////////////////////////////////////////////////
@@ -656,9 +1195,26 @@ void PixelMatch::Offset(Point val)
 ExactPixelMatch::ExactPixelMatch(const _Color &color)
 : _color(color)
 {}
-bool ExactPixelMatch::Eval(const Bitmap &ss, const Point &start) const
+bool ExactPixelMatch::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
 {
-	return ss.Color(start + _offset) == _color;
+	StatsCountLeaf(context);
+	auto pt = start + _offset;
+	bool value;
+	if (context && &context->Frame() == &ss && context->Classified(_predicate, pt, value))
+		return value;
+
+	return ss.Color(pt) == _color;
+}
+Operand *ExactPixelMatch::Clone(OperandArena *arena) const
+{
+	auto clone = arena ? arena->New(*this) : new ExactPixelMatch(*this);
+	//the predicate belongs to the Parser this one was linked by
+	clone->Predicate(UNCLASSIFIED);
+	return clone;
+}
+size_t ExactPixelMatch::ArenaSize() const
+{
+	return OperandArena::Align(sizeof(ExactPixelMatch));
 }
 ExactPixelMatch::ExactPixelMatch(const Json::Value &value)
 {
@@ -701,15 +1257,43 @@ void ExactPixelMatch::Color(imgexp::_Color val)
 RangePixelMatch::RangePixelMatch(const Color &min, const Color &max)
 : _min(min), _max(max)
 {}
-bool RangePixelMatch::Eval(const Bitmap &ss, const Point &start) const
+bool RangePixelMatch::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
 {
-	auto color = ss.Color(start + _offset);
+	StatsCountLeaf(context);
+	auto pt = start + _offset;
+	bool value;
+	if (context && &context->Frame() == &ss && context->Classified(_predicate, pt, value))
+		return value;
+
+	auto &color = ss.Color(pt);
+	if (_classifier)
+		return (_classifier->Classify(color) & _class) != 0;
+
 	return color >= _min && color <= _max;
 }
+Operand *RangePixelMatch::Clone(OperandArena *arena) const
+{
+	auto clone = arena ? arena->New(*this) : new RangePixelMatch(*this);
+	//the classifier belongs to the pattern this one was compiled into, the predicate to the Parser
+	//this one was linked by
+	clone->Classify(nullptr);
+	clone->Predicate(UNCLASSIFIED);
+	return clone;
+}
+void RangePixelMatch::Classify(ColorClassifier *classifier)
+{
+	_class = classifier ? classifier->Add(_min, _max) : 0;
+	_classifier = _class ? classifier : nullptr;
+}
+size_t RangePixelMatch::ArenaSize() const
+{
+	return OperandArena::Align(sizeof(RangePixelMatch));
+}
 RangePixelMatch::RangePixelMatch(const Json::Value &value)
 {
 	RequireTypeName(value, "RangePixelMatch");
 
+	_offset = Point(GetJsonValue(value, "offset"));
 	_min = Color(GetJsonValue(value, "min"));
 	_max = Color(GetJsonValue(value, "max"));
 }
@@ -733,362 +1317,3908 @@ bool RangePixelMatch::Equals(const Operand &rhs) const
 		return false;
 }
 
-const Color & RangePixelMatch::Min()
+const Color & RangePixelMatch::Min() const
 {
 	return _min;
 }
 
-const Color & RangePixelMatch::Max()
+const Color & RangePixelMatch::Max() const
 {
 	return _max;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//// Expression
+//// BitmapPatchMatch
 ///////////////////////////////////////////////////////////////////////////////
-Expression::Expression(Operand *left, ::imgexp::Operator op, Operand *right)
-: _left(left), _operator(op), _right(right)
+BitmapPatchMatch::BitmapPatchMatch(long width, long height, const _Color pixels[], const BYTE mask[])
 {
-	if (!_left)
-		ThrowArgument("left is required");
-
-	if (_operator == ::imgexp::Operator::NONE && _right)
-		ThrowArgument("right cannot exist with NONE operator");
-
-	if (_operator != ::imgexp::Operator::NONE && !_right)
-		ThrowArgument("right must exist if operator is not NONE");
+	_Init(width, height, pixels, mask);
 }
-bool Expression::Eval(const Bitmap &ss, const Point &start) const
+BitmapPatchMatch::BitmapPatchMatch(const Bitmap &bitmap, const Area &area)
 {
-	switch (_operator)
+	Area image(0, 0, bitmap.Width() - 1, bitmap.Height() - 1);
+	if (!image.Contains(area))
+		ThrowArgument("area is outside the bitmap");
+
+	std::vector<_Color> pixels;
+	pixels.reserve(area.Width() * area.Height());
+	for (long y = area.Top(); y <= area.Bottom(); ++y)
 	{
-	case ::imgexp::Operator::OR:
-		return _left->Eval(ss, start) || _right->Eval(ss, start);
-		break;
-	case ::imgexp::Operator::XOR:
-		return _left->Eval(ss, start) ^ _right->Eval(ss, start);
-		break;
-	case ::imgexp::Operator::AND:
-		return _left->Eval(ss, start) && _right->Eval(ss, start);
-		break;
-	default:
-	case ::imgexp::Operator::NONE:
-		return _left->Eval(ss, start);
-		break;
+		for (long x = area.Left(); x <= area.Right(); ++x)
+			pixels.push_back(bitmap.Color(x, y));
 	}
+
+	_Init(area.Width(), area.Height(), pixels.data(), nullptr);
 }
-Expression::~Expression()
+BitmapPatchMatch::BitmapPatchMatch(const BitmapPatchMatch &rhs)
+: _offset(rhs._offset), _width(rhs._width), _height(rhs._height), _spanCount(rhs._spanCount)
+{
+	std::unique_ptr<_Color[]> pixels(new _Color[_width * _height]);
+	std::copy(rhs._pixels, rhs._pixels + _width * _height, pixels.get());
+	_spans = new Span[_spanCount];
+	std::copy(rhs._spans, rhs._spans + _spanCount, _spans);
+	_pixels = pixels.release();
+}
+BitmapPatchMatch::BitmapPatchMatch(const BitmapPatchMatch &rhs, OperandArena &arena)
+: _offset(rhs._offset), _width(rhs._width), _height(rhs._height), _spanCount(rhs._spanCount), _ownsPixels(false)
+{
+	_pixels = static_cast<_Color*>(arena.Allocate(_width * _height * sizeof(_Color)));
+	std::copy(rhs._pixels, rhs._pixels + _width * _height, _pixels);
+	_spans = static_cast<Span*>(arena.Allocate(_spanCount * sizeof(Span)));
+	std::copy(rhs._spans, rhs._spans + _spanCount, _spans);
+}
+BitmapPatchMatch::~BitmapPatchMatch()
 {
-	delete _left;
+	if (!_ownsPixels)
+		return;
 
-	if (_right)
-		delete _right;
+	delete[] _pixels;
+	delete[] _spans;
 }
-Expression::Expression(const Json::Value &value)
+void BitmapPatchMatch::_Init(long width, long height, const _Color pixels[], const BYTE mask[])
 {
-	RequireTypeName(value, "Expression");
+	if (width <= 0 || height <= 0)
+		ThrowArgument("width and height must be > 0");
 
-	_left = CreateOperand(value, "left");
-	if (!_left)
-		ThrowDeserialization("left operand was missing");
+	if (!pixels)
+		ThrowArgument("pixels are required");
 
-	auto opNode = value["operator"];
-	_operator = opNode.isNull() ? ::imgexp::Operator::NONE : StringToOperator(opNode.asString());
-	_right = CreateOperand(value, "right");
+	std::vector<Span> spans;
+	for (long y = 0; y < height; ++y)
+	{
+		for (long x = 0; x < width;)
+		{
+			if (mask && !mask[y * width + x])
+			{
+				++x;
+				continue;
+			}
 
-	if (_operator == ::imgexp::Operator::NONE && _right)
-		ThrowDeserialization("right cannot exist with NONE operator");
+			Span span = { y, x, 0 };
+			while (x < width && (!mask || mask[y * width + x]))
+			{
+				++span.count;
+				++x;
+			}
+			spans.push_back(span);
+		}
+	}
 
-	if (_operator != ::imgexp::Operator::NONE && !_right)
-		ThrowDeserialization("right must exist if operator is not NONE");
+	std::unique_ptr<_Color[]> copy(new _Color[width * height]);
+	std::copy(pixels, pixels + width * height, copy.get());
+	_spans = new Span[spans.size()];
+	std::copy(spans.begin(), spans.end(), _spans);
+	_pixels = copy.release();
+	_spanCount = spans.size();
+	_width = width;
+	_height = height;
 }
-Expression::operator const Json::Value() const
+Point BitmapPatchMatch::Offset() const
 {
-	Json::Value value;
-	value["left"] = *_left;
-	value["operator"] = OperatorToString(_operator);
-	if (_right)
-		value["right"] = *_right;
-	value["type"] = "Expression";
-	return value;
-}
-bool Expression::Equals(const Operand &rhs) const
-{
-	if (auto p = dynamic_cast<Expression const*>(&rhs))
-	{
-		bool left = (*_left) == (*p->_left);
-		bool right = (_right && p->_right) ? (*_right) == (*p->_right) : _right == p->_right;
-		bool op = _operator == p->_operator;
-		return left && right && op;
-	}
-	else
-		return false;
+	return _offset;
 }
-Operand * Expression::Left() const
+void BitmapPatchMatch::Offset(Point val)
 {
-	return _left;
+	_offset = val;
 }
-imgexp::Operator Expression::Operator() const
+bool BitmapPatchMatch::Masked(long x, long y) const
 {
-	return _operator;
+	for (size_t i = 0; i < _spanCount; ++i)
+	{
+		auto &span = _spans[i];
+		if (span.y == y && x >= span.x && x < span.x + span.count)
+			return true;
+	}
+	return false;
 }
-Operand * Expression::Right() const
+bool BitmapPatchMatch::Place(const Bitmap &ss, const Point &start, long &left, long &top) const
 {
-	return _right;
+	left = start.X() + _offset.X();
+	top = start.Y() + _offset.Y();
+	return left >= 0 && top >= 0 && left + _width <= ss.Width() && top + _height <= ss.Height();
 }
-void Expression::SetRight(imgexp::Operator op, Operand *right)
+bool BitmapPatchMatch::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
 {
-	if (op == ::imgexp::Operator::NONE && right)
-		ThrowArgument("right cannot exist with NONE operator");
+	StatsCountLeaf(context);
+	long left, top;
+	if (!Place(ss, start, left, top))
+		return false;
 
-	if (op != ::imgexp::Operator::NONE && !right)
-		ThrowArgument("right must exist if operator is not NONE");
+	//the frame's rows are contiguous left to right, like the patch's
+	for (size_t i = 0; i < _spanCount; ++i)
+	{
+		auto &span = _spans[i];
+		if (std::memcmp(&ss.Color(left + span.x, top + span.y), &_pixels[span.y * _width + span.x], span.count * sizeof(_Color)) != 0)
+			return false;
+	}
 
-	_operator = op;
-	_right = right;
+	return true;
 }
-
-///////////////////////////////////////////////////////////////////////////////
-//// PixelPattern
-///////////////////////////////////////////////////////////////////////////////
-const wchar_t* PixelPattern::PIXEL_PATTERN_FILE_EXT = L".pattern";
-void PixelPattern::Reset()
+Operand *BitmapPatchMatch::Clone(OperandArena *arena) const
 {
-	if (_found)
+	if (arena)
 	{
-		delete _found;
-		_found = nullptr;
+		//this node, then its pixels and spans
+		auto storage = arena->Allocate(sizeof(BitmapPatchMatch));
+		return arena->Track(new (storage) BitmapPatchMatch(*this, *arena));
 	}
 
-	_changed = false;
+	return new BitmapPatchMatch(*this);
 }
-void PixelPattern::Update(const Bitmap &ss)
+size_t BitmapPatchMatch::ArenaSize() const
 {
-	auto sz = ss.Size();
-
-	if (sz != _imageSize)
-		ThrowLogic(format("invalid image size %1%/%2%", % sz.Width() % sz.Height()));
-
-	_changed = false;
-	bool wasFound = _found != nullptr;
-
-	if (_found)
+	return OperandArena::Align(sizeof(BitmapPatchMatch)) + _DataArenaSize();
+}
+size_t BitmapPatchMatch::_DataArenaSize() const
+{
+	return OperandArena::Align(_width * _height * sizeof(_Color)) + OperandArena::Align(_spanCount * sizeof(Span));
+}
+BitmapPatchMatch::BitmapPatchMatch()
+{}
+BitmapPatchMatch::BitmapPatchMatch(const Json::Value &value)
+{
+	RequireTypeName(value, "BitmapPatchMatch");
+	_Load(value);
+}
+void BitmapPatchMatch::_Load(const Json::Value &value)
+{
+	auto width = GetJsonValue(value, "width").asInt();
+	auto height = GetJsonValue(value, "height").asInt();
+	if (width <= 0 || height <= 0)
+		ThrowDeserialization("width and height must be > 0");
+
+	auto pixels = DecodeBase64(GetJsonValue(value, "pixels").asString());
+	if (pixels.size() != static_cast<size_t>(width) * height * sizeof(_Color))
+		ThrowDeserialization("pixels must hold width * height pixels");
+
+	std::vector<BYTE> mask;
+	auto maskValue = GetJsonValue(value, "mask", false);
+	if (!maskValue.isNull())
 	{
-		//found in the same place as last time, hasn't changed
-		if (_root->Eval(ss, *_found))
-			return;
+		auto bits = DecodeBase64(maskValue.asString());
+		if (bits.size() != (static_cast<size_t>(width) * height + 7) / 8)
+			ThrowDeserialization("mask must hold a bit per pixel");
 
-		//clear it out
-		delete _found;
-		_found = nullptr;
+		for (size_t i = 0; i < static_cast<size_t>(width) * height; ++i)
+			mask.push_back((bits[i / 8] >> (i % 8)) & 1);
 	}
 
-	long height = ss.Height();
-	long width = ss.Width();
+	_offset = Point(GetJsonValue(value, "offset"));
+	_Init(width, height, reinterpret_cast<const _Color*>(pixels.data()), mask.empty() ? nullptr : mask.data());
+}
+BitmapPatchMatch::operator const Json::Value() const
+{
+	Json::Value value;
+	value["height"] = static_cast<Json::Int>(_height);
+	value["offset"] = _offset;
+	//blue, green, red per pixel, rows top down
+	value["pixels"] = EncodeBase64(_pixels, _width * _height * sizeof(_Color));
+	value["type"] = "BitmapPatchMatch";
+	value["width"] = static_cast<Json::Int>(_width);
 
-	if (_flagMatrix)
-	{
-		auto &fm = *_flagMatrix;
+	//a bit per pixel, lowest first, only if some aren't compared
+	size_t compared = 0;
+	for (size_t i = 0; i < _spanCount; ++i)
+		compared += _spans[i].count;
 
-		for (long y = 0; y < height; ++y)
-		{
-			for (long x = 0; x < width; ++x)
-			{
-				if (fm[x][y])
-				{
-					Point pt(x, y);
-					if (_root->Eval(ss, pt))
-					{
-						_found = new Point(pt);
-						_changed = true;
-						return;
-					}
-				}
-			}
-		}
-	}
-	else
+	if (compared != static_cast<size_t>(_width) * _height)
 	{
-		for (long y = 0; y < height; ++y)
+		std::vector<unsigned char> bits((static_cast<size_t>(_width) * _height + 7) / 8);
+		for (size_t i = 0; i < _spanCount; ++i)
 		{
-			for (long x = 0; x < width; ++x)
+			auto &span = _spans[i];
+			for (long x = span.x; x < span.x + span.count; ++x)
 			{
-				Point pt(x, y);
-				if (_root->Eval(ss, pt))
-				{
-					_found = new Point(pt);
-					_changed = true;
-					return;
-				}
+				auto bit = static_cast<size_t>(span.y) * _width + x;
+				bits[bit / 8] |= 1 << (bit % 8);
 			}
 		}
+		value["mask"] = EncodeBase64(bits.data(), bits.size());
 	}
 
-	if (wasFound)
-		_changed = true;
+	return value;
 }
-FlagMatrix *PixelPattern::CreateFlagMatrix(const Size &imageSize, const std::vector<Area> &searchAreas)
+bool BitmapPatchMatch::Equals(const Operand &rhs) const
 {
-	auto flagMatrix = new std::vector<std::vector<bool>>(imageSize.Width());
-	for (auto &dim : *flagMatrix)
-		dim.resize(imageSize.Height());
+	auto p = dynamic_cast<BitmapPatchMatch const*>(&rhs);
+	if (!p || typeid(*p) != typeid(*this))
+		return false;
 
-	auto &fm = *flagMatrix;
+	if (_offset != p->_offset || _width != p->_width || _height != p->_height || _spanCount != p->_spanCount)
+		return false;
 
-	for (auto &area : searchAreas)
+	for (size_t i = 0; i < _spanCount; ++i)
 	{
-		for (long y = area.Top(); y != area.Bottom() + 1; ++y)
-		{
-			for (long x = area.Left(); x != area.Right() + 1; ++x)
-			{
-				if (!fm[x][y])
-					fm[x][y] = true;
-			}
-		}
+		if (_spans[i].y != p->_spans[i].y || _spans[i].x != p->_spans[i].x || _spans[i].count != p->_spans[i].count)
+			return false;
 	}
 
-	return flagMatrix;
+	return std::equal(_pixels, _pixels + _width * _height, p->_pixels);
 }
-PixelPattern::PixelPattern(Size imageSize, PatternId id, Expression *root, std::vector<Area> *searchAreas)
-:_imageSize(imageSize), _id(id), _root(root),
-_flagMatrix(searchAreas ? CreateFlagMatrix(imageSize, *searchAreas) : nullptr),
-_searchAreas(searchAreas)
-{}
-PixelPattern::~PixelPattern()
-{
-	if (_root)
-		delete _root;
-
-	if (_flagMatrix)
-		delete _flagMatrix;
-
-	if (_searchAreas)
-		delete _searchAreas;
 
-	if (_found)
-		delete _found;
-}
-PixelPattern *PixelPattern::FromFile(const string &file)
-{
-	return new PixelPattern(ParseJsonFromFile(file));
-}
-PixelPattern::PixelPattern(const Json::Value &value)
-{
-	RequireTypeName(value, "PixelPattern");
+///////////////////////////////////////////////////////////////////////////////
+//// FuzzyPatchMatch
+///////////////////////////////////////////////////////////////////////////////
+namespace {
+	const std::string SadStr("SAD");
+	const std::string SsdStr("SSD");
 
-	_id = static_cast<PatternId>(GetJsonValue(value, "id").asUInt64());
-	_root = dynamic_cast<Expression*>(CreateOperand(value, "root"));
-	if (!_root)
-		ThrowDeserialization("root is missing");
+	inline unsigned long long SumAbsoluteDifferences(const BYTE *a, const BYTE *b, size_t size)
+	{
+		__m128i sums = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16)
+		{
+			auto lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+			auto rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+			sums = _mm_add_epi64(sums, _mm_sad_epu8(lhs, rhs));
+		}
 
-	_imageSize = Size(GetJsonValue(value, "imageSize"));
+		unsigned long long halves[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(halves), sums);
+		auto sum = halves[0] + halves[1];
+		for (; i < size; ++i)
+			sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+		return sum;
+	}
 
-	auto searchAreasNode = GetJsonValue(value, "searchAreas", false);
-	if (!searchAreasNode.isNull())
+	//Each 32 bit lane takes at most 4 * 255^2 per 16 bytes, so a run has to be over 250KB to overflow one
+	inline unsigned long long SumSquaredDifferences(const BYTE *a, const BYTE *b, size_t size)
 	{
-		auto searchAreas = new std::vector<Area>;
-		try
+		auto zero = _mm_setzero_si128();
+		auto sums = zero;
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16)
 		{
-			for (unsigned i = 0; i < searchAreasNode.size(); ++i)
-				searchAreas->push_back(Area(searchAreasNode[i]));
+			auto lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+			auto rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+			auto low = _mm_sub_epi16(_mm_unpacklo_epi8(lhs, zero), _mm_unpacklo_epi8(rhs, zero));
+			auto high = _mm_sub_epi16(_mm_unpackhi_epi8(lhs, zero), _mm_unpackhi_epi8(rhs, zero));
+			sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
 		}
-		catch (...)
+
+		unsigned lanes[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sums);
+		unsigned long long sum = static_cast<unsigned long long>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+		for (; i < size; ++i)
 		{
-			delete searchAreas;
-			throw;
+			int difference = a[i] - b[i];
+			sum += difference * difference;
 		}
-
-		_flagMatrix = searchAreas ? CreateFlagMatrix(_imageSize, *searchAreas) : nullptr;
-		_searchAreas = searchAreas;
+		return sum;
 	}
 }
-PixelPattern::operator const Json::Value() const
+FuzzyPatchMatch::FuzzyPatchMatch(const BitmapPatchMatch &patch, unsigned long long maxDistance, PatchDistance distance)
+: BitmapPatchMatch(patch), _maxDistance(maxDistance), _distance(distance)
+{}
+FuzzyPatchMatch::FuzzyPatchMatch(const FuzzyPatchMatch &rhs)
+: BitmapPatchMatch(rhs), _maxDistance(rhs._maxDistance), _distance(rhs._distance)
+{}
+FuzzyPatchMatch::FuzzyPatchMatch(const FuzzyPatchMatch &rhs, OperandArena &arena)
+: BitmapPatchMatch(rhs, arena), _maxDistance(rhs._maxDistance), _distance(rhs._distance)
+{}
+unsigned long long FuzzyPatchMatch::DistanceAt(const Bitmap &ss, const Point &start, unsigned long long limit) const
 {
-	Json::Value value;
-	value["type"] = "PixelPattern";
-	//JsonCpp doesn't have an unsigned long type so I've got to convert to a unsigned long long
-	value["id"] = static_cast<unsigned long long>(_id);
-	value["root"] = *_root;
-	value["imageSize"] = _imageSize;
-	if (_searchAreas)
+	long left, top;
+	if (!Place(ss, start, left, top))
+		return ~0ULL;
+
+	unsigned long long distance = 0;
+	for (size_t i = 0; i < _spanCount && distance <= limit; ++i)
 	{
-		auto &searchAreas = *_searchAreas;
-		for (unsigned i = 0; i < searchAreas.size(); ++i)
-			value["searchAreas"][i] = searchAreas[i];
+		auto &span = _spans[i];
+		auto frame = reinterpret_cast<const BYTE*>(&ss.Color(left + span.x, top + span.y));
+		auto patch = reinterpret_cast<const BYTE*>(&_pixels[span.y * _width + span.x]);
+		auto size = span.count * sizeof(_Color);
+		distance += _distance == PatchDistance::SSD ? SumSquaredDifferences(frame, patch, size) : SumAbsoluteDifferences(frame, patch, size);
 	}
-	//searchPoints isn't serialized as it can be recreated from searchAreas
-	return value;
-}
 
-bool PixelPattern::operator==(const PixelPattern &rhs) const
+	return distance;
+}
+bool FuzzyPatchMatch::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
 {
-	bool equal = _id == rhs._id &&
-		_imageSize == rhs._imageSize &&
-		*_root == *rhs._root &&
-		((!_searchAreas && !_searchAreas) ||
-		(_searchAreas && rhs._searchAreas && VectorsEqual(*_searchAreas, *rhs._searchAreas)));
-
-	return equal;
+	StatsCountLeaf(context);
+	long left, top;
+	return Place(ss, start, left, top) && DistanceAt(ss, start, _maxDistance) <= _maxDistance;
 }
+Operand *FuzzyPatchMatch::Clone(OperandArena *arena) const
+{
+	if (arena)
+	{
+		//this node, then its pixels and spans
+		auto storage = arena->Allocate(sizeof(FuzzyPatchMatch));
+		return arena->Track(new (storage) FuzzyPatchMatch(*this, *arena));
+	}
 
-bool PixelPattern::operator!=(const PixelPattern &rhs) const
+	return new FuzzyPatchMatch(*this);
+}
+size_t FuzzyPatchMatch::ArenaSize() const
 {
-	return !operator==(rhs);
+	return OperandArena::Align(sizeof(FuzzyPatchMatch)) + _DataArenaSize();
+}
+FuzzyPatchMatch::FuzzyPatchMatch(const Json::Value &value)
+{
+	RequireTypeName(value, "FuzzyPatchMatch");
+	_Load(value);
+
+	_maxDistance = GetJsonValue(value, "maxDistance").asUInt64();
+	auto distance = GetJsonValue(value, "distance").asString();
+	if (distance == SadStr)
+		_distance = PatchDistance::SAD;
+	else if (distance == SsdStr)
+		_distance = PatchDistance::SSD;
+	else
+		ThrowDeserialization(format("unknown patch distance %1%", % distance));
+}
+FuzzyPatchMatch::operator const Json::Value() const
+{
+	auto value = BitmapPatchMatch::operator const Json::Value();
+	value["distance"] = _distance == PatchDistance::SSD ? SsdStr : SadStr;
+	value["maxDistance"] = static_cast<Json::UInt64>(_maxDistance);
+	value["type"] = "FuzzyPatchMatch";
+	return value;
+}
+bool FuzzyPatchMatch::Equals(const Operand &rhs) const
+{
+	if (!BitmapPatchMatch::Equals(rhs))
+		return false;
+
+	auto &p = static_cast<const FuzzyPatchMatch&>(rhs);
+	return _maxDistance == p._maxDistance && _distance == p._distance;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//// Parser
+//// Expression
 ///////////////////////////////////////////////////////////////////////////////
-Parser::Parser(const Size &imageSize)
-: _imageSize(imageSize)
+namespace {
+	//What root and everything under it take in an arena. Expressions are walked with a stack of their
+	//own, as trees built a leaf at a time nest as deep as they're long.
+	size_t TreeArenaSize(const Operand &root)
+	{
+		size_t size = 0;
+		std::vector<const Operand*> pending(1, &root);
+		while (!pending.empty())
+		{
+			auto operand = pending.back();
+			pending.pop_back();
+
+			if (auto exp = dynamic_cast<const Expression*>(operand))
+			{
+				size += OperandArena::Align(sizeof(Expression));
+				pending.push_back(exp->Left());
+				if (exp->Right())
+					pending.push_back(exp->Right());
+			}
+			else if (auto compound = dynamic_cast<const CompoundExpression*>(operand))
+			{
+				size += OperandArena::Align(sizeof(CompoundExpression)) + OperandArena::Align(compound->Count() * sizeof(Operand*));
+				for (size_t i = 0; i < compound->Count(); ++i)
+					pending.push_back(compound->Get(i));
+			}
+			else
+			{
+				size += operand->ArenaSize();
+			}
+		}
+
+		return size;
+	}
+
+	//Clones root into arena, each expression reserved ahead of its operands so the graph is laid out
+	//in evaluation order, walking expressions with a stack of their own as TreeArenaSize does
+	Operand *CloneTree(const Operand &root, OperandArena &arena)
+	{
+		//an expression is visited with no storage, then placed once its operands' clones are in cloned
+		struct Step {
+			const Operand *operand;
+			void *storage;
+			Operand **operands;
+		};
+		std::vector<Step> pending(1, Step{ &root, nullptr, nullptr });
+		std::vector<Operand*> cloned;
+
+		while (!pending.empty())
+		{
+			auto step = pending.back();
+			pending.pop_back();
+
+			auto exp = dynamic_cast<const Expression*>(step.operand);
+			auto compound = exp ? nullptr : dynamic_cast<const CompoundExpression*>(step.operand);
+			if (step.storage && exp)
+			{
+				auto right = exp->Right() ? cloned.back() : nullptr;
+				if (right)
+					cloned.pop_back();
+				auto left = cloned.back();
+				cloned.back() = Expression::Place(arena, step.storage, left, exp->Operator(), right);
+			}
+			else if (step.storage)
+			{
+				auto count = compound->Count();
+				std::copy(cloned.end() - count, cloned.end(), step.operands);
+				cloned.resize(cloned.size() - count);
+				cloned.push_back(CompoundExpression::Place(arena, step.storage, compound->Operator(), step.operands, count));
+			}
+			else if (exp)
+			{
+				pending.push_back(Step{ exp, arena.Allocate(sizeof(Expression)), nullptr });
+				if (exp->Right())
+					pending.push_back(Step{ exp->Right(), nullptr, nullptr });
+				pending.push_back(Step{ exp->Left(), nullptr, nullptr });
+			}
+			else if (compound)
+			{
+				auto storage = arena.Allocate(sizeof(CompoundExpression));
+				auto operands = static_cast<Operand**>(arena.Allocate(compound->Count() * sizeof(Operand*)));
+				pending.push_back(Step{ compound, storage, operands });
+				for (auto i = compound->Count(); i > 0; --i)
+					pending.push_back(Step{ compound->Get(i - 1), nullptr, nullptr });
+			}
+			else
+			{
+				cloned.push_back(step.operand->Clone(&arena));
+			}
+		}
+
+		return cloned.back();
+	}
+}
+Expression::Expression(Operand *left, ::imgexp::Operator op, Operand *right)
+: _left(left), _operator(op), _right(right)
 {
-	if (imageSize.Width() <= 0)
-		ThrowArgument("imageSize.Width must be > 0");
+	if (!_left)
+		ThrowArgument("left is required");
 
-	if (imageSize.Height() <= 0)
-		ThrowArgument("imageSize.Height must be > 0");
+	if (_operator == ::imgexp::Operator::NONE && _right)
+		ThrowArgument("right cannot exist with NONE operator");
+
+	if (_operator != ::imgexp::Operator::NONE && !_right)
+		ThrowArgument("right must exist if operator is not NONE");
+
+	_rightExpression = dynamic_cast<const Expression*>(_right);
 }
-Parser::~Parser()
+bool Expression::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
 {
-	if (_patterns)
+	//once the left doesn't decide an OR or AND the right does, so a chain is walked down in a loop
+	//rather than recursed into, as trees built a leaf at a time nest as deep as they're long
+	auto exp = this;
+	for (;;)
 	{
-		for (auto it : *_patterns)
+		switch (exp->_operator)
 		{
-			if (it.second)
-				delete it.second;
+		case ::imgexp::Operator::OR:
+			if (exp->_left->Eval(ss, start, context))
+				return true;
+			break;
+		case ::imgexp::Operator::XOR:
+			return exp->_left->Eval(ss, start, context) ^ exp->_right->Eval(ss, start, context);
+		case ::imgexp::Operator::AND:
+			if (!exp->_left->Eval(ss, start, context))
+				return false;
+			break;
+		default:
+		case ::imgexp::Operator::NONE:
+			return exp->_left->Eval(ss, start, context);
 		}
 
-		delete _patterns;
+		if (!exp->_rightExpression)
+			return exp->_right->Eval(ss, start, context);
+		exp = exp->_rightExpression;
 	}
 }
-void Parser::AddPattern(const PixelPattern &pattern)
+Operand *Expression::Clone(OperandArena *arena) const
 {
-	if (_patterns->count(pattern.Id()) > 0)
-		ThrowDuplicateKey(std::to_string(pattern.Id()));
+	if (arena)
+		return CloneTree(*this, *arena);
 
-	_patterns->operator[](pattern.Id()) = new PixelPattern(pattern);
+	auto left = _left->Clone();
+	Operand *right = nullptr;
+	try
+	{
+		right = _right ? _right->Clone() : nullptr;
+		return new Expression(left, _operator, right);
+	}
+	catch (...)
+	{
+		delete left;
+		delete right;
+		throw;
+	}
 }
-void Parser::RemovePattern(PatternId id)
+Expression *Expression::Place(OperandArena &arena, void *storage, Operand *left, ::imgexp::Operator op, Operand *right)
 {
-	_patterns->erase(id);
+	auto exp = arena.Track(new (storage) Expression(left, op, right));
+	exp->_ownsOperands = false;
+	return exp;
 }
-const PixelPattern *Parser::GetPattern(PatternId id) const
+size_t Expression::ArenaSize() const
 {
-	PatternMap::const_iterator found = _patterns->find(id);
-	if (found != _patterns->end())
-		return found->second;
-	else
-		return nullptr;
+	return TreeArenaSize(*this);
 }
-void Parser::_Parse(const Bitmap &bmp, bool reset)
+Expression::~Expression()
 {
-	for (auto &pattern : *_patterns)
+	if (!_ownsOperands)
+		return;
+
+	//deleting recursively would overflow the stack on long chains, so unlink each
+	//owned expression's operands before deleting it
+	std::vector<Operand*> pending;
+	pending.push_back(_left);
+	pending.push_back(_right);
+
+	while (!pending.empty())
 	{
-		if (reset)
-			pattern.second->Reset();
+		auto op = pending.back();
+		pending.pop_back();
 
-		pattern.second->Update(bmp);
+		if (!op)
+			continue;
+
+		auto exp = dynamic_cast<Expression*>(op);
+		if (exp && exp->_ownsOperands)
+		{
+			pending.push_back(exp->_left);
+			pending.push_back(exp->_right);
+			exp->_left = exp->_right = nullptr;
+		}
+
+		delete op;
+	}
+}
+Expression::Expression(const Json::Value &value)
+{
+	RequireTypeName(value, "Expression");
+
+	_left = CreateOperand(value, "left");
+	if (!_left)
+		ThrowDeserialization("left operand was missing");
+
+	auto opNode = value["operator"];
+	_operator = opNode.isNull() ? ::imgexp::Operator::NONE : StringToOperator(opNode.asString());
+	_right = CreateOperand(value, "right");
+
+	if (_operator == ::imgexp::Operator::NONE && _right)
+		ThrowDeserialization("right cannot exist with NONE operator");
+
+	if (_operator != ::imgexp::Operator::NONE && !_right)
+		ThrowDeserialization("right must exist if operator is not NONE");
+
+	_rightExpression = dynamic_cast<const Expression*>(_right);
+}
+Expression::operator const Json::Value() const
+{
+	Json::Value value;
+	value["left"] = *_left;
+	value["operator"] = OperatorToString(_operator);
+	if (_right)
+		value["right"] = *_right;
+	value["type"] = "Expression";
+	return value;
+}
+bool Expression::Equals(const Operand &rhs) const
+{
+	if (auto p = dynamic_cast<Expression const*>(&rhs))
+	{
+		bool left = (*_left) == (*p->_left);
+		bool right = (_right && p->_right) ? (*_right) == (*p->_right) : _right == p->_right;
+		bool op = _operator == p->_operator;
+		return left && right && op;
+	}
+	else
+		return false;
+}
+Operand * Expression::Left() const
+{
+	return _left;
+}
+imgexp::Operator Expression::Operator() const
+{
+	return _operator;
+}
+Operand * Expression::Right() const
+{
+	return _right;
+}
+void Expression::SetRight(imgexp::Operator op, Operand *right)
+{
+	if (op == ::imgexp::Operator::NONE && right)
+		ThrowArgument("right cannot exist with NONE operator");
+
+	if (op != ::imgexp::Operator::NONE && !right)
+		ThrowArgument("right must exist if operator is not NONE");
+
+	_operator = op;
+	_right = right;
+	_rightExpression = dynamic_cast<const Expression*>(_right);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// CompoundExpression
+///////////////////////////////////////////////////////////////////////////////
+CompoundExpression::CompoundExpression(::imgexp::Operator op, Operand **operands, size_t count)
+: _operands(operands), _count(count), _operator(op), _ownsOperands(false)
+{}
+CompoundExpression::CompoundExpression(::imgexp::Operator op, const std::vector<Operand*> &operands)
+: _operator(op)
+{
+	if (op != ::imgexp::Operator::AND && op != ::imgexp::Operator::OR)
+		ThrowArgument("operator must be AND or OR");
+
+	if (operands.empty())
+		ThrowArgument("operands are required");
+
+	for (auto operand : operands)
+	{
+		if (!operand)
+			ThrowArgument("operands cannot be null");
+	}
+
+	_operands = new Operand*[operands.size()];
+	_count = operands.size();
+	std::copy(operands.begin(), operands.end(), _operands);
+}
+CompoundExpression::~CompoundExpression()
+{
+	if (!_ownsOperands)
+		return;
+
+	for (size_t i = 0; i < _count; ++i)
+		delete _operands[i];
+
+	delete[] _operands;
+}
+CompoundExpression::CompoundExpression(const Json::Value &value)
+{
+	RequireTypeName(value, "CompoundExpression");
+
+	_operator = StringToOperator(GetJsonValue(value, "operator").asString());
+	if (_operator != ::imgexp::Operator::AND && _operator != ::imgexp::Operator::OR)
+		ThrowDeserialization("operator must be AND or OR");
+
+	auto operandsNode = GetJsonValue(value, "operands");
+	if (operandsNode.size() == 0)
+		ThrowDeserialization("operands are missing");
+
+	std::vector<std::unique_ptr<Operand>> operands;
+	for (unsigned i = 0; i < operandsNode.size(); ++i)
+	{
+		operands.push_back(std::unique_ptr<Operand>(CreateOperand(operandsNode[i])));
+		if (!operands.back())
+			ThrowDeserialization("operand was missing");
+	}
+
+	_operands = new Operand*[operands.size()];
+	_count = operands.size();
+	for (size_t i = 0; i < _count; ++i)
+		_operands[i] = operands[i].release();
+}
+CompoundExpression::operator const Json::Value() const
+{
+	Json::Value value;
+	value["operator"] = OperatorToString(_operator);
+	for (size_t i = 0; i < _count; ++i)
+		value["operands"][static_cast<Json::ArrayIndex>(i)] = *_operands[i];
+	value["type"] = "CompoundExpression";
+	return value;
+}
+imgexp::Operator CompoundExpression::Operator() const
+{
+	return _operator;
+}
+bool CompoundExpression::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
+{
+	if (_operator == ::imgexp::Operator::AND)
+	{
+		for (size_t i = 0; i < _count; ++i)
+		{
+			if (!_operands[i]->Eval(ss, start, context))
+				return false;
+		}
+
+		return true;
+	}
+
+	for (size_t i = 0; i < _count; ++i)
+	{
+		if (_operands[i]->Eval(ss, start, context))
+			return true;
+	}
+
+	return false;
+}
+Operand *CompoundExpression::Clone(OperandArena *arena) const
+{
+	//this node, then its operand array, then the operands in evaluation order
+	if (arena)
+		return CloneTree(*this, *arena);
+
+	std::vector<std::unique_ptr<Operand>> copies;
+	for (size_t i = 0; i < _count; ++i)
+		copies.push_back(std::unique_ptr<Operand>(_operands[i]->Clone()));
+
+	std::vector<Operand*> operands;
+	for (auto &copy : copies)
+		operands.push_back(copy.get());
+
+	auto compound = new CompoundExpression(_operator, operands);
+	for (auto &copy : copies)
+		copy.release();
+
+	return compound;
+}
+size_t CompoundExpression::ArenaSize() const
+{
+	return TreeArenaSize(*this);
+}
+CompoundExpression *CompoundExpression::Place(OperandArena &arena, void *storage, ::imgexp::Operator op, Operand **operands, size_t count)
+{
+	return arena.Track(new (storage) CompoundExpression(op, operands, count));
+}
+bool CompoundExpression::Equals(const Operand &rhs) const
+{
+	if (auto p = dynamic_cast<CompoundExpression const*>(&rhs))
+	{
+		if (_operator != p->_operator || _count != p->_count)
+			return false;
+
+		for (size_t i = 0; i < _count; ++i)
+		{
+			if (*_operands[i] != *p->_operands[i])
+				return false;
+		}
+
+		return true;
+	}
+	else
+		return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// Optimizer
+///////////////////////////////////////////////////////////////////////////////
+namespace {
+	size_t CountNodes(const Operand &shared)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+			return 1 + CountNodes(*exp->Left()) + (exp->Right() ? CountNodes(*exp->Right()) : 0);
+
+		if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+		{
+			size_t count = 1;
+			for (size_t i = 0; i < compound->Count(); ++i)
+				count += CountNodes(*compound->Get(i));
+			return count;
+		}
+
+		return 1;
+	}
+
+	//The colors a pixel match accepts, as a per channel range
+	struct ColorRange {
+		BYTE min[3];
+		BYTE max[3];
+
+		explicit ColorRange(const PixelMatch &match)
+		{
+			if (auto exact = dynamic_cast<const ExactPixelMatch*>(&match))
+				Set(exact->Color(), exact->Color());
+			else
+			{
+				auto &range = static_cast<const RangePixelMatch&>(match);
+				Set(range.Min(), range.Max());
+			}
+		}
+		void Set(const Color &mn, const Color &mx)
+		{
+			min[0] = mn.Red(); min[1] = mn.Green(); min[2] = mn.Blue();
+			max[0] = mx.Red(); max[1] = mx.Green(); max[2] = mx.Blue();
+		}
+		bool Empty() const
+		{
+			return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+		}
+		bool Covers(const ColorRange &rhs) const
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				if (rhs.min[c] < min[c] || rhs.max[c] > max[c])
+					return false;
+			}
+			return true;
+		}
+		void Intersect(const ColorRange &rhs)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				min[c] = std::max(min[c], rhs.min[c]);
+				max[c] = std::min(max[c], rhs.max[c]);
+			}
+		}
+		PixelMatch *ToMatch(const Point &offset) const
+		{
+			PixelMatch *match;
+			if (Empty())
+				match = new RangePixelMatch(Color(0xff, 0xff, 0xff), Color(0, 0, 0));
+			else if (min[0] == max[0] && min[1] == max[1] && min[2] == max[2])
+				match = new ExactPixelMatch(Color(min[0], min[1], min[2]));
+			else
+				match = new RangePixelMatch(Color(min[0], min[1], min[2]), Color(max[0], max[1], max[2]));
+
+			match->Offset(offset);
+			return match;
+		}
+	};
+
+	typedef std::vector<std::unique_ptr<Operand>> OperandList;
+
+	Operand *OptimizeOperand(const Operand &shared, OptimizeReport &report);
+
+	//Collects the optimized operands of a chain of op, flattening nested ANDs or ORs and NONEs into it
+	void Gather(const Operand &shared, imgexp::Operator op, OperandList &operands, OptimizeReport &report)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			if (exp->Operator() == op)
+			{
+				Gather(*exp->Left(), op, operands, report);
+				Gather(*exp->Right(), op, operands, report);
+				return;
+			}
+
+			if (exp->Operator() == imgexp::Operator::NONE)
+			{
+				Gather(*exp->Left(), op, operands, report);
+				return;
+			}
+		}
+		else if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+		{
+			if (compound->Operator() == op)
+			{
+				for (size_t i = 0; i < compound->Count(); ++i)
+					Gather(*compound->Get(i), op, operands, report);
+				return;
+			}
+		}
+
+		operands.push_back(std::unique_ptr<Operand>(OptimizeOperand(operand, report)));
+	}
+
+	bool ContainsEqual(const OperandList &operands, const Operand &operand)
+	{
+		for (auto &existing : operands)
+		{
+			if (*existing == operand)
+				return true;
+		}
+		return false;
+	}
+
+	//Intersects every AND'ed test on the same pixel, keeping the first one's place. Returns false if
+	//they can't all pass, leaving the offending test as the only operand.
+	bool MergeAnd(OperandList &operands, OptimizeReport &report)
+	{
+		OperandList merged;
+		std::map<Point, size_t> byOffset;
+
+		for (auto &operand : operands)
+		{
+			auto match = dynamic_cast<PixelMatch*>(operand.get());
+			if (!match)
+			{
+				if (ContainsEqual(merged, *operand))
+					++report.merged;
+				else
+					merged.push_back(std::move(operand));
+				continue;
+			}
+
+			auto found = byOffset.find(match->Offset());
+			if (found == byOffset.end())
+			{
+				byOffset[match->Offset()] = merged.size();
+				merged.push_back(std::move(operand));
+				continue;
+			}
+
+			auto &existing = merged[found->second];
+			ColorRange range(static_cast<PixelMatch&>(*existing));
+			range.Intersect(ColorRange(*match));
+			existing.reset(range.ToMatch(match->Offset()));
+			++report.merged;
+		}
+
+		for (auto &operand : merged)
+		{
+			auto match = dynamic_cast<PixelMatch*>(operand.get());
+			if (match && ColorRange(*match).Empty())
+			{
+				++report.contradictions;
+				report.merged += merged.size() - 1;
+
+				OperandList never;
+				never.push_back(std::move(operand));
+				operands.swap(never);
+				return false;
+			}
+		}
+
+		operands.swap(merged);
+		return true;
+	}
+
+	//Drops OR'ed tests that can never pass or that another test on the same pixel covers
+	void MergeOr(OperandList &operands, OptimizeReport &report)
+	{
+		OperandList merged;
+
+		for (size_t i = 0; i < operands.size(); ++i)
+		{
+			auto match = dynamic_cast<PixelMatch*>(operands[i].get());
+			bool redundant = false;
+
+			if (!match)
+				redundant = ContainsEqual(merged, *operands[i]);
+			else
+			{
+				ColorRange range(*match);
+				redundant = range.Empty();
+
+				for (size_t j = 0; !redundant && j < operands.size(); ++j)
+				{
+					auto other = dynamic_cast<PixelMatch*>(operands[j].get());
+					if (j == i || !other || other->Offset() != match->Offset())
+						continue;
+
+					//of two tests that cover each other, keep the first
+					ColorRange otherRange(*other);
+					redundant = otherRange.Covers(range) && (!range.Covers(otherRange) || j < i);
+				}
+			}
+
+			if (redundant)
+				++report.merged;
+			else
+				merged.push_back(std::move(operands[i]));
+		}
+
+		//everything could never pass; keep one test to say so
+		if (merged.empty())
+		{
+			merged.push_back(std::move(operands.front()));
+			--report.merged;
+		}
+
+		operands.swap(merged);
+	}
+
+	Operand *MakeCompound(imgexp::Operator op, OperandList &operands)
+	{
+		if (operands.size() == 1)
+			return operands.front().release();
+
+		std::vector<Operand*> raw;
+		for (auto &operand : operands)
+			raw.push_back(operand.get());
+
+		auto compound = new CompoundExpression(op, raw);
+		for (auto &operand : operands)
+			operand.release();
+
+		return compound;
+	}
+
+	Operand *OptimizeOperand(const Operand &shared, OptimizeReport &report)
+	{
+		auto &operand = shared.Resolve();
+
+		auto exp = dynamic_cast<const Expression*>(&operand);
+		auto compound = dynamic_cast<const CompoundExpression*>(&operand);
+
+		if (exp && exp->Operator() == imgexp::Operator::NONE)
+			return OptimizeOperand(*exp->Left(), report);
+
+		if (exp && exp->Operator() == imgexp::Operator::XOR)
+		{
+			std::unique_ptr<Operand> left(OptimizeOperand(*exp->Left(), report));
+			std::unique_ptr<Operand> right(OptimizeOperand(*exp->Right(), report));
+			auto optimized = new Expression(left.get(), imgexp::Operator::XOR, right.get());
+			left.release();
+			right.release();
+			return optimized;
+		}
+
+		if (exp || compound)
+		{
+			auto op = exp ? exp->Operator() : compound->Operator();
+
+			OperandList operands;
+			Gather(operand, op, operands, report);
+
+			if (op == imgexp::Operator::AND)
+				MergeAnd(operands, report);
+			else
+				MergeOr(operands, report);
+
+			return MakeCompound(op, operands);
+		}
+
+		return operand.Clone();
+	}
+}
+Operand *Optimize(const Operand &root, OptimizeReport &report)
+{
+	report.nodesBefore = CountNodes(root);
+	auto optimized = OptimizeOperand(root, report);
+	report.nodesAfter = CountNodes(*optimized);
+	return optimized;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// SharedOperand
+///////////////////////////////////////////////////////////////////////////////
+SharedOperand::SharedOperand(const Operand *target, unsigned slot)
+: _target(target), _slot(slot)
+{
+	if (!_target)
+		ThrowArgument("target is required");
+}
+SharedOperand::operator const Json::Value() const
+{
+	return *_target;
+}
+bool SharedOperand::Eval(const Bitmap &ss, const Point &start, FrameContext *context) const
+{
+	if (!context || &context->Frame() != &ss)
+		return _target->Eval(ss, start, context);
+
+	bool value;
+	if (!context->Recall(_slot, start, value))
+	{
+		value = _target->Eval(ss, start, context);
+		context->Remember(_slot, start, value);
+	}
+
+	return value;
+}
+Operand *SharedOperand::Clone(OperandArena *arena) const
+{
+	return arena ? arena->New(*this) : new SharedOperand(*this);
+}
+size_t SharedOperand::ArenaSize() const
+{
+	return OperandArena::Align(sizeof(SharedOperand));
+}
+const Operand &SharedOperand::Resolve() const
+{
+	return _target->Resolve();
+}
+bool SharedOperand::Equals(const Operand &rhs) const
+{
+	return Resolve() == rhs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// OperandArena
+///////////////////////////////////////////////////////////////////////////////
+OperandArena::OperandArena(size_t blockSize)
+: _blockSize(Align(blockSize ? blockSize : ALIGNMENT))
+{}
+OperandArena::~OperandArena()
+{
+	for (auto op : _operands)
+		op->~Operand();
+
+	for (auto block : _blocks)
+		delete[] block;
+}
+void *OperandArena::Allocate(size_t size)
+{
+	size = Align(size);
+
+	if (size > _left)
+	{
+		auto blockSize = std::max(size, _blockSize);
+		//new[] of char is aligned for any fundamental type, which covers ALIGNMENT
+		_next = new char[blockSize];
+		_left = blockSize;
+		_blocks.push_back(_next);
+	}
+
+	auto storage = _next;
+	_next += size;
+	_left -= size;
+	_used += size;
+	return storage;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// PixelPattern
+///////////////////////////////////////////////////////////////////////////////
+namespace {
+	//Collects the operands of a chain of ANDs, flattening nested ANDs and NONEs into it, in order.
+	//Walks the chain with a stack of its own, as trees built a leaf at a time nest as deep as they're long.
+	void CollectConjuncts(const Operand &shared, std::vector<const Operand*> &conjuncts)
+	{
+		std::vector<const Operand*> pending(1, &shared);
+		while (!pending.empty())
+		{
+			auto &operand = pending.back()->Resolve();
+			pending.pop_back();
+
+			if (auto exp = dynamic_cast<const Expression*>(&operand))
+			{
+				if (exp->Operator() == imgexp::Operator::AND)
+				{
+					pending.push_back(exp->Right());
+					pending.push_back(exp->Left());
+					continue;
+				}
+
+				if (exp->Operator() == imgexp::Operator::NONE)
+				{
+					pending.push_back(exp->Left());
+					continue;
+				}
+			}
+			else if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+			{
+				if (compound->Operator() == imgexp::Operator::AND)
+				{
+					for (auto i = compound->Count(); i > 0; --i)
+						pending.push_back(compound->Get(i - 1));
+					continue;
+				}
+			}
+
+			conjuncts.push_back(&operand);
+		}
+	}
+
+	//Calls f with every Leaf under operand in order, other than those in shared subexpressions,
+	//walking expressions with a stack of its own as CollectConjuncts does
+	template <class Leaf, class F>
+	void ForEachOwnedLeaf(Operand &operand, F f)
+	{
+		std::vector<Operand*> pending(1, &operand);
+		while (!pending.empty())
+		{
+			auto current = pending.back();
+			pending.pop_back();
+
+			if (auto leaf = dynamic_cast<Leaf*>(current))
+			{
+				f(*leaf);
+			}
+			else if (auto exp = dynamic_cast<Expression*>(current))
+			{
+				if (exp->Right())
+					pending.push_back(exp->Right());
+				pending.push_back(exp->Left());
+			}
+			else if (auto compound = dynamic_cast<CompoundExpression*>(current))
+			{
+				for (auto i = compound->Count(); i > 0; --i)
+					pending.push_back(compound->Get(i - 1));
+			}
+		}
+	}
+
+	//A flat AND over copies of conjuncts, taken in order if it's given
+	CompoundExpression *AndOf(const std::vector<const Operand*> &conjuncts, const std::vector<unsigned> &order)
+	{
+		std::vector<std::unique_ptr<Operand>> copies;
+		for (size_t i = 0; i < conjuncts.size(); ++i)
+			copies.push_back(std::unique_ptr<Operand>(conjuncts[order.empty() ? i : order[i]]->Clone()));
+
+		std::vector<Operand*> operands;
+		for (auto &copy : copies)
+			operands.push_back(copy.get());
+
+		auto compound = new CompoundExpression(Operator::AND, operands);
+		for (auto &copy : copies)
+			copy.release();
+
+		return compound;
+	}
+
+	const char *TRANSFORM_NAMES[] = { "NONE", "MIRROR_X", "MIRROR_Y", "ROTATE_90", "ROTATE_180", "ROTATE_270" };
+
+	Transform StringToTransform(const std::string &str)
+	{
+		for (size_t i = 0; i < sizeof(TRANSFORM_NAMES) / sizeof(TRANSFORM_NAMES[0]); ++i)
+		{
+			if (str == TRANSFORM_NAMES[i])
+				return static_cast<Transform>(i);
+		}
+		ThrowDeserialization(format("unknown transform %1%", % str));
+	}
+
+	//transforms without NONE or repeats, in order
+	std::vector<Transform> DistinctTransforms(const std::vector<Transform> &transforms)
+	{
+		std::vector<Transform> distinct;
+		for (auto transform : transforms)
+		{
+			if (transform != Transform::NONE && std::find(distinct.begin(), distinct.end(), transform) == distinct.end())
+				distinct.push_back(transform);
+		}
+		return distinct;
+	}
+
+	//Adds the pixels operand tests at to corners: each pixel match's and each patch's corners
+	void CollectCorners(const Operand &shared, std::vector<Point> &corners)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			CollectCorners(*exp->Left(), corners);
+			if (exp->Right())
+				CollectCorners(*exp->Right(), corners);
+		}
+		else if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+		{
+			for (size_t i = 0; i < compound->Count(); ++i)
+				CollectCorners(*compound->Get(i), corners);
+		}
+		else if (auto patch = dynamic_cast<const BitmapPatchMatch*>(&operand))
+		{
+			corners.push_back(patch->Offset());
+			corners.push_back(patch->Offset() + Point(patch->Width() - 1, patch->Height() - 1));
+		}
+		else if (auto match = dynamic_cast<const PixelMatch*>(&operand))
+		{
+			corners.push_back(match->Offset());
+		}
+	}
+
+	//Where transform takes pt in bounds, with the transformed bounds' top left kept where bounds' is
+	Point TransformPoint(const Point &pt, Transform transform, const Area &bounds)
+	{
+		auto x = pt.X() - bounds.Left();
+		auto y = pt.Y() - bounds.Top();
+		auto right = bounds.Right() - bounds.Left();
+		auto bottom = bounds.Bottom() - bounds.Top();
+
+		switch (transform)
+		{
+		case Transform::MIRROR_X:
+			x = right - x;
+			break;
+		case Transform::MIRROR_Y:
+			y = bottom - y;
+			break;
+		case Transform::ROTATE_90:
+			std::swap(x, y);
+			x = bottom - x;
+			break;
+		case Transform::ROTATE_180:
+			x = right - x;
+			y = bottom - y;
+			break;
+		case Transform::ROTATE_270:
+			std::swap(x, y);
+			y = right - y;
+			break;
+		default:
+			break;
+		}
+
+		return Point(bounds.Left() + x, bounds.Top() + y);
+	}
+
+	//A copy of operand with every pixel it tests moved by transform, shared subexpressions inlined
+	Operand *TransformOperand(const Operand &shared, Transform transform, const Area &bounds)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			std::unique_ptr<Operand> left(TransformOperand(*exp->Left(), transform, bounds));
+			std::unique_ptr<Operand> right(exp->Right() ? TransformOperand(*exp->Right(), transform, bounds) : nullptr);
+			auto transformed = new Expression(left.get(), exp->Operator(), right.get());
+			left.release();
+			right.release();
+			return transformed;
+		}
+
+		if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+		{
+			std::vector<std::unique_ptr<Operand>> copies;
+			for (size_t i = 0; i < compound->Count(); ++i)
+				copies.push_back(std::unique_ptr<Operand>(TransformOperand(*compound->Get(i), transform, bounds)));
+
+			std::vector<Operand*> operands;
+			for (auto &copy : copies)
+				operands.push_back(copy.get());
+
+			auto transformed = new CompoundExpression(compound->Operator(), operands);
+			for (auto &copy : copies)
+				copy.release();
+
+			return transformed;
+		}
+
+		if (auto patch = dynamic_cast<const BitmapPatchMatch*>(&operand))
+		{
+			//the pixels move with their places, so the patch's top left is the least of its corners'
+			auto first = TransformPoint(patch->Offset(), transform, bounds);
+			auto last = TransformPoint(patch->Offset() + Point(patch->Width() - 1, patch->Height() - 1), transform, bounds);
+			Point offset(std::min(first.X(), last.X()), std::min(first.Y(), last.Y()));
+
+			bool turned = transform == Transform::ROTATE_90 || transform == Transform::ROTATE_270;
+			auto width = turned ? patch->Height() : patch->Width();
+			auto height = turned ? patch->Width() : patch->Height();
+			std::vector<Color> pixels(width * height);
+			std::vector<BYTE> mask(width * height);
+			for (long y = 0; y < patch->Height(); ++y)
+			{
+				for (long x = 0; x < patch->Width(); ++x)
+				{
+					auto to = TransformPoint(patch->Offset() + Point(x, y), transform, bounds) - offset;
+					pixels[to.Y() * width + to.X()] = patch->Pixel(x, y);
+					mask[to.Y() * width + to.X()] = patch->Masked(x, y) ? 1 : 0;
+				}
+			}
+
+			std::unique_ptr<BitmapPatchMatch> transformed(new BitmapPatchMatch(width, height, pixels.data(), mask.data()));
+			transformed->Offset(offset);
+			if (auto fuzzy = dynamic_cast<const FuzzyPatchMatch*>(patch))
+				return new FuzzyPatchMatch(*transformed, fuzzy->MaxDistance(), fuzzy->Distance());
+
+			return transformed.release();
+		}
+
+		auto match = dynamic_cast<const PixelMatch*>(&operand);
+		if (!match)
+			ThrowLogic("only expressions, pixel matches and patches can be transformed");
+
+		auto transformed = static_cast<PixelMatch*>(match->Clone());
+		transformed->Offset(TransformPoint(match->Offset(), transform, bounds));
+		return transformed;
+	}
+
+	//Whether order is a permutation of count indexes
+	bool IsOrder(const std::vector<unsigned> &order, size_t count)
+	{
+		if (order.size() != count)
+			return false;
+
+		std::vector<bool> seen(count);
+		for (auto index : order)
+		{
+			if (index >= count || seen[index])
+				return false;
+			seen[index] = true;
+		}
+		return true;
+	}
+}
+
+const wchar_t* PixelPattern::PIXEL_PATTERN_FILE_EXT = L".pattern";
+void PixelPattern::Reset()
+{
+	if (_found)
+	{
+		delete _found;
+		_found = nullptr;
+	}
+
+	_changed = false;
+	_foundVariant = Transform::NONE;
+}
+void PixelPattern::_Restore(const Bitmap &ss, const Point *found)
+{
+	Reset();
+	if (found)
+	{
+		_found = new Point(*found);
+		_changed = true;
+
+		//only where is cached; a scan would have found the first of the variants to match there
+		if (!_variants.empty() && !_root->Eval(ss, *found))
+		{
+			for (auto &variant : _variants)
+			{
+				if (variant.root->Eval(ss, *found))
+				{
+					_foundVariant = variant.transform;
+					break;
+				}
+			}
+		}
+	}
+}
+void PixelPattern::Update(const Bitmap &ss, FrameContext *context)
+{
+	auto sz = ss.Size();
+
+	if (sz != _imageSize)
+		ThrowLogic(format("invalid image size %1%/%2%", % sz.Width() % sz.Height()));
+
+	TraceScope trace("pattern", "PixelPattern::Update", _id);
+#ifdef IMGEXP_STATS
+	PatternStats *stats = context ? &context->Charge(_id) : nullptr;
+	StatsTimer timer(stats);
+#endif
+
+	_changed = false;
+	bool wasFound = _found != nullptr;
+
+	if (_found)
+	{
+		auto root = _root;
+		for (auto &variant : _variants)
+		{
+			if (variant.transform == _foundVariant)
+				root = variant.root;
+		}
+
+		//found in the same place as last time, hasn't changed
+		if (root->Eval(ss, *_found, context))
+		{
+#ifdef IMGEXP_STATS
+			if (stats)
+				++stats->foundHits;
+#endif
+			return;
+		}
+
+		//clear it out
+		delete _found;
+		_found = nullptr;
+	}
+
+	Point pt;
+	Transform variant;
+	if (_Find(ss, pt, variant, context))
+	{
+		_found = new Point(pt);
+		_foundVariant = variant;
+		_changed = true;
+		return;
+	}
+
+	_foundVariant = Transform::NONE;
+
+	if (wasFound)
+		_changed = true;
+}
+bool PixelPattern::Find(const Bitmap &ss, Point &found, FrameContext *context) const
+{
+	Transform variant;
+	return Find(ss, found, variant, context);
+}
+bool PixelPattern::Find(const Bitmap &ss, Point &found, Transform &variant, FrameContext *context) const
+{
+	TraceScope trace("pattern", "PixelPattern::Find", _id);
+#ifdef IMGEXP_STATS
+	StatsTimer timer(context ? &context->Charge(_id) : nullptr);
+#endif
+	return _Find(ss, found, variant, context);
+}
+bool PixelPattern::_Find(const Bitmap &ss, Point &found, Transform &variant, FrameContext *context) const
+{
+	long height = ss.Height();
+	long width = ss.Width();
+	variant = Transform::NONE;
+
+#ifdef IMGEXP_STATS
+	PatternStats *stats = context ? &context->Charge(_id) : nullptr;
+	//tallies the pixel matches each anchor took to decide
+	auto eval = [&](const Operand &root, const Point &pt)
+	{
+		auto before = stats ? stats->leafTests : 0;
+		bool result = root.Eval(ss, pt, context);
+		if (stats)
+		{
+			++stats->anchors;
+			++stats->depths[std::min<unsigned long long>(stats->leafTests - before, PatternStats::DEPTHS - 1)];
+		}
+		return result;
+	};
+#else
+	auto eval = [&](const Operand &root, const Point &pt) { return root.Eval(ss, pt, context); };
+#endif
+
+	//the declared root, then each variant's
+	auto roots = 1 + _variants.size();
+	auto rootAt = [&](size_t i) -> const Operand & { return i ? *_variants[i - 1].root : *_root; };
+
+	auto colors = context && !_exactLeaves.empty() ? context->Colors() : nullptr;
+	if (colors)
+	{
+		//every match has each exact leaf's color at anchor + offset, so the rarest one's pixels are
+		//the only anchors worth evaluating. They come in scan order, so the first match is still the
+		//first a scan would find. Variants have the same leaves at other offsets, so they share the
+		//bucket, each keeping to the anchors before the first match so far.
+		size_t leaf = 0;
+		for (size_t i = 1; i < _exactLeaves.size(); ++i)
+		{
+			if (colors->Count(_exactLeaves[i].second) < colors->Count(_exactLeaves[leaf].second))
+				leaf = i;
+		}
+
+		auto &color = _exactLeaves[leaf].second;
+		bool any = false;
+		for (size_t i = 0; i < roots; ++i)
+		{
+			auto &offset = i ? _variants[i - 1].exactLeaves[leaf].first : _exactLeaves[leaf].first;
+			for (auto pixel = colors->Begin(color), end = colors->End(color); pixel != end; ++pixel)
+			{
+				auto at = colors->PixelAt(*pixel);
+				Point pt(at.X() - offset.X(), at.Y() - offset.Y());
+				if (pt.X() < 0 || pt.X() >= width || pt.Y() < 0 || pt.Y() >= height)
+					continue;
+
+				if (any && (pt.Y() > found.Y() || (pt.Y() == found.Y() && pt.X() >= found.X())))
+					break;
+
+				//the bucket is shared with other colors
+				if (ss.Color(at) != color)
+					continue;
+
+				if (_flagMatrix && !(*_flagMatrix)[pt.X()][pt.Y()])
+					continue;
+
+				if (eval(rootAt(i), pt))
+				{
+					found = pt;
+					variant = i ? _variants[i - 1].transform : Transform::NONE;
+					any = true;
+					break;
+				}
+			}
+		}
+
+		return any;
+	}
+
+	//a bit per root that can match on the row
+	const unsigned every = (1u << roots) - 1;
+	auto rows = context && !_rowLeaves.empty() ? context->Rows() : nullptr;
+	for (long y = 0; y < height; ++y)
+	{
+		auto live = every;
+		if (rows)
+		{
+			live = _RowMayMatch(_rowLeaves, *rows, y, height) ? 1 : 0;
+			for (size_t i = 1; i < roots; ++i)
+			{
+				if (_RowMayMatch(_variants[i - 1].rowLeaves, *rows, y, height))
+					live |= 1u << i;
+			}
+
+			if (!live)
+				continue;
+		}
+
+		for (long x = 0; x < width; ++x)
+		{
+			if (_flagMatrix && !(*_flagMatrix)[x][y])
+				continue;
+
+			Point pt(x, y);
+			for (size_t i = 0; i < roots; ++i)
+			{
+				if ((live >> i) & 1 && eval(rootAt(i), pt))
+				{
+					found = pt;
+					variant = i ? _variants[i - 1].transform : Transform::NONE;
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+bool PixelPattern::_RowMayMatch(const RowLeaves &rowLeaves, const RowColors &rows, long y, long height)
+{
+	for (auto &leaf : rowLeaves)
+	{
+		//rows off the frame aren't summarized, so anchors reaching them are left to Eval as ever
+		auto row = y + leaf.first;
+		if (row >= 0 && row < height && !rows.Intersects(row, leaf.second))
+			return false;
+	}
+	return true;
+}
+namespace {
+	//A bit per anchor of a frame, rows padded to whole words so shifting by an offset stays in its row
+	struct AnchorBits {
+		long width;
+		long height;
+		size_t rowWords;
+		std::vector<unsigned long long> words;
+		AnchorBits(long width, long height)
+		: width(width), height(height), rowWords((width + 63) / 64), words(rowWords * height)
+		{}
+		inline unsigned long long *Row(long y) { return &words[y * rowWords]; }
+		inline void Set(long x, long y) { Row(y)[x / 64] |= 1ULL << (x % 64); }
+		bool Any() const
+		{
+			for (auto word : words)
+			{
+				if (word)
+					return true;
+			}
+			return false;
+		}
+	};
+
+	//The 64 bits of plane from bit on, zero past its end
+	inline unsigned long long PlaneBits(const unsigned long long *plane, size_t planeWords, size_t bit)
+	{
+		auto word = bit / 64;
+		auto shift = bit % 64;
+		auto bits = plane[word] >> shift;
+		if (shift && word + 1 < planeWords)
+			bits |= plane[word + 1] << (64 - shift);
+		return bits;
+	}
+
+	void EvalAllLeaf(const PixelMatch &leaf, const Bitmap &ss, FrameContext *context, AnchorBits &out)
+	{
+		std::fill(out.words.begin(), out.words.end(), 0ULL);
+		auto offset = leaf.Offset();
+		auto width = out.width;
+		auto height = out.height;
+
+		//the anchors whose pixel is on the frame
+		auto left = std::max(0L, -offset.X());
+		auto right = std::min(width, width - offset.X());
+		auto top = std::max(0L, -offset.Y());
+		auto bottom = std::min(height, height - offset.Y());
+
+		auto plane = context ? context->Plane(leaf.Predicate()) : nullptr;
+		auto planeWords = (static_cast<size_t>(width) * height + 63) / 64;
+		for (long y = top; y < bottom; ++y)
+		{
+			auto row = out.Row(y);
+			if (plane)
+			{
+				//the plane's bits are laid out like the row's, offset by the pixel's
+				auto base = static_cast<size_t>(y + offset.Y()) * width + offset.X();
+				for (long x = left; x < right;)
+				{
+					auto count = std::min(64 - x % 64, right - x);
+					auto mask = count == 64 ? ~0ULL : (1ULL << count) - 1;
+					row[x / 64] |= (PlaneBits(plane, planeWords, base + x) & mask) << (x % 64);
+					x += count;
+				}
+			}
+			else
+			{
+				for (long x = left; x < right; ++x)
+				{
+					if (leaf.Eval(ss, Point(x, y), context))
+						row[x / 64] |= 1ULL << (x % 64);
+				}
+			}
+		}
+	}
+
+	//Combines rhs into out with op
+	void Combine(imgexp::Operator op, const AnchorBits &rhs, AnchorBits &out)
+	{
+		for (size_t i = 0; i < out.words.size(); ++i)
+		{
+			switch (op)
+			{
+			case imgexp::Operator::AND:
+				out.words[i] &= rhs.words[i];
+				break;
+			case imgexp::Operator::OR:
+				out.words[i] |= rhs.words[i];
+				break;
+			case imgexp::Operator::XOR:
+				out.words[i] ^= rhs.words[i];
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	//Collects the operands of a chain of op, flattening nested ops and NONEs into it, in order. Walks
+	//the chain with a stack of its own, as trees built a leaf at a time nest as deep as they're long.
+	void CollectChain(const Operand &shared, imgexp::Operator op, std::vector<const Operand*> &operands)
+	{
+		std::vector<const Operand*> pending(1, &shared);
+		while (!pending.empty())
+		{
+			auto &operand = pending.back()->Resolve();
+			pending.pop_back();
+
+			if (auto exp = dynamic_cast<const Expression*>(&operand))
+			{
+				if (exp->Operator() == op)
+				{
+					if (exp->Right())
+						pending.push_back(exp->Right());
+					pending.push_back(exp->Left());
+					continue;
+				}
+
+				if (exp->Operator() == imgexp::Operator::NONE)
+				{
+					pending.push_back(exp->Left());
+					continue;
+				}
+			}
+			else if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+			{
+				if (compound->Operator() == op)
+				{
+					for (auto i = compound->Count(); i > 0; --i)
+						pending.push_back(compound->Get(i - 1));
+					continue;
+				}
+			}
+
+			operands.push_back(&operand);
+		}
+	}
+
+	//Evaluates operand at every anchor of ss into out. A chain of ANDs or ORs is folded into out an
+	//operand at a time through one scratch buffer, and an AND stops once nothing's left in out.
+	void EvalAll(const Operand &shared, const Bitmap &ss, FrameContext *context, AnchorBits &out)
+	{
+		auto &operand = shared.Resolve();
+
+		auto exp = dynamic_cast<const Expression*>(&operand);
+		auto compound = dynamic_cast<const CompoundExpression*>(&operand);
+		auto op = exp ? exp->Operator() : compound ? compound->Operator() : imgexp::Operator::NONE;
+
+		if (auto leaf = dynamic_cast<const PixelMatch*>(&operand))
+		{
+			EvalAllLeaf(*leaf, ss, context, out);
+		}
+		else if ((exp || compound) && (op == imgexp::Operator::AND || op == imgexp::Operator::OR))
+		{
+			std::vector<const Operand*> operands;
+			CollectChain(operand, op, operands);
+
+			EvalAll(*operands.front(), ss, context, out);
+			if (operands.size() == 1)
+				return;
+
+			AnchorBits scratch(out.width, out.height);
+			for (size_t i = 1; i < operands.size(); ++i)
+			{
+				if (op == imgexp::Operator::AND && !out.Any())
+					return;
+
+				EvalAll(*operands[i], ss, context, scratch);
+				Combine(op, scratch, out);
+			}
+		}
+		else if (exp)
+		{
+			EvalAll(*exp->Left(), ss, context, out);
+			if (op == imgexp::Operator::XOR && exp->Right())
+			{
+				AnchorBits scratch(out.width, out.height);
+				EvalAll(*exp->Right(), ss, context, scratch);
+				Combine(op, scratch, out);
+			}
+		}
+		else
+		{
+			std::fill(out.words.begin(), out.words.end(), 0ULL);
+			for (long y = 0; y < out.height; ++y)
+			{
+				for (long x = 0; x < out.width; ++x)
+				{
+					if (operand.Eval(ss, Point(x, y), context))
+						out.Set(x, y);
+				}
+			}
+		}
+	}
+}
+void PixelPattern::FindAll(const Bitmap &ss, std::vector<Point> &found, FrameContext *context) const
+{
+	TraceScope trace("parse", "PixelPattern::FindAll", _id);
+	found.clear();
+
+	//the planes are only the frame's
+	if (context && &context->Frame() != &ss)
+		context = nullptr;
+
+	AnchorBits anchors(ss.Width(), ss.Height());
+	EvalAll(*_root, ss, context, anchors);
+	if (!_variants.empty())
+	{
+		AnchorBits variantAnchors(ss.Width(), ss.Height());
+		for (auto &variant : _variants)
+		{
+			EvalAll(*variant.root, ss, context, variantAnchors);
+			Combine(imgexp::Operator::OR, variantAnchors, anchors);
+		}
+	}
+
+	for (long y = 0; y < anchors.height; ++y)
+	{
+		auto row = anchors.Row(y);
+		for (size_t word = 0; word < anchors.rowWords; ++word)
+		{
+			for (auto bits = row[word]; bits; bits &= bits - 1)
+			{
+				long x = static_cast<long>(word * 64 + LowestBit(bits));
+				if (!_flagMatrix || (*_flagMatrix)[x][y])
+					found.push_back(Point(x, y));
+			}
+		}
+	}
+}
+OptimizeReport PixelPattern::Optimize()
+{
+	OptimizeReport report;
+	std::unique_ptr<Operand> root(imgexp::Optimize(*_root, report));
+
+	auto oldArena = _arena;
+	Compile(*root);
+	delete oldArena;
+
+	_sharedOperands.clear();
+	_evaluationOrder.clear();
+	delete _declaredRoot;
+	_declaredRoot = nullptr;
+	_profile = EvaluationProfile();
+	return report;
+}
+void PixelPattern::Sample(const Bitmap &ss, EvaluationProfile &profile, unsigned sampleEvery) const
+{
+	auto conjuncts = DeclaredConjuncts();
+	if (profile.failures.size() != conjuncts.size())
+		profile = EvaluationProfile();
+	profile.failures.resize(conjuncts.size());
+
+	if (sampleEvery == 0)
+		sampleEvery = 1;
+
+	unsigned long long anchor = 0;
+	for (long y = 0; y < ss.Height(); ++y)
+	{
+		for (long x = 0; x < ss.Width(); ++x)
+		{
+			if (_flagMatrix && !(*_flagMatrix)[x][y])
+				continue;
+
+			if (anchor++ % sampleEvery != 0)
+				continue;
+
+			Point pt(x, y);
+			++profile.anchors;
+			for (size_t i = 0; i < conjuncts.size(); ++i)
+			{
+				if (!conjuncts[i]->Eval(ss, pt))
+					++profile.failures[i];
+			}
+		}
+	}
+}
+void PixelPattern::LearnEvaluationOrder(const EvaluationProfile &profile)
+{
+	auto conjuncts = DeclaredConjuncts();
+	if (profile.failures.size() != conjuncts.size())
+		ThrowArgument(format("profile has %1% conjuncts, pattern %2% has %3%", % profile.failures.size() % _id % conjuncts.size()));
+
+	_profile += profile;
+	if (conjuncts.size() < 2 || _profile.anchors == 0)
+		return;
+
+	//For independent tests an AND costs least on average taken in ascending order of cost over the
+	//chance of failing. The chance is smoothed so tests that never failed still sort by cost.
+	std::vector<double> rank(conjuncts.size());
+	for (size_t i = 0; i < conjuncts.size(); ++i)
+	{
+		double failureRate = (_profile.failures[i] + 1.0) / (_profile.anchors + 2.0);
+		rank[i] = CountNodes(*conjuncts[i]) / failureRate;
+	}
+
+	std::vector<unsigned> order(conjuncts.size());
+	for (unsigned i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](unsigned lhs, unsigned rhs) { return rank[lhs] < rank[rhs]; });
+
+	if (!_declaredRoot)
+		_declaredRoot = new Json::Value(*_root);
+
+	//conjuncts point into the arena being replaced
+	std::unique_ptr<Operand> declared(AndOf(conjuncts, std::vector<unsigned>()));
+	auto oldArena = _arena;
+	CompileInOrder(*declared, order);
+	delete oldArena;
+
+	_evaluationOrder = order;
+}
+FlagMatrix *PixelPattern::CreateFlagMatrix(const Size &imageSize, const std::vector<Area> &searchAreas)
+{
+	auto flagMatrix = new std::vector<std::vector<bool>>(imageSize.Width());
+	for (auto &dim : *flagMatrix)
+		dim.resize(imageSize.Height());
+
+	auto &fm = *flagMatrix;
+
+	Area image(0, 0, imageSize.Width() - 1, imageSize.Height() - 1);
+	for (auto &area : searchAreas)
+	{
+		if (!image.Contains(area))
+		{
+			delete flagMatrix;
+			ThrowArgument("search area is outside the image");
+		}
+
+		for (long y = area.Top(); y != area.Bottom() + 1; ++y)
+		{
+			for (long x = area.Left(); x != area.Right() + 1; ++x)
+			{
+				if (!fm[x][y])
+					fm[x][y] = true;
+			}
+		}
+	}
+
+	return flagMatrix;
+}
+void PixelPattern::Compile(const Operand &root)
+{
+	auto arena = new OperandArena(root.ArenaSize());
+	try
+	{
+		_root = root.Clone(arena);
+	}
+	catch (...)
+	{
+		delete arena;
+		throw;
+	}
+
+	_arena = arena;
+	_FindLeaves(*_root, _exactLeaves, _rowLeaves);
+	_CompileVariants();
+	_Classify();
+}
+void PixelPattern::_FindLeaves(const Operand &root, ExactLeaves &exactLeaves, RowLeaves &rowLeaves)
+{
+	exactLeaves.clear();
+	rowLeaves.clear();
+
+	std::vector<const Operand*> conjuncts;
+	CollectConjuncts(root, conjuncts);
+	for (auto conjunct : conjuncts)
+	{
+		if (auto exact = dynamic_cast<const ExactPixelMatch*>(conjunct))
+		{
+			exactLeaves.push_back(std::make_pair(exact->Offset(), exact->Color()));
+			rowLeaves.push_back(std::make_pair(exact->Offset().Y(), RowColors::Quantize(exact->Color(), exact->Color())));
+		}
+		else if (auto range = dynamic_cast<const RangePixelMatch*>(conjunct))
+		{
+			rowLeaves.push_back(std::make_pair(range->Offset().Y(), RowColors::Quantize(range->Min(), range->Max())));
+		}
+	}
+}
+void PixelPattern::_CompileVariants()
+{
+	_DeleteVariants();
+	if (_transforms.empty())
+		return;
+
+	std::vector<Point> corners;
+	CollectCorners(*_root, corners);
+	if (corners.empty())
+		return;
+
+	auto left = corners.front().X(), top = corners.front().Y(), right = left, bottom = top;
+	for (auto &corner : corners)
+	{
+		left = std::min(left, corner.X());
+		top = std::min(top, corner.Y());
+		right = std::max(right, corner.X());
+		bottom = std::max(bottom, corner.Y());
+	}
+	Area bounds(left, top, right, bottom);
+
+	for (auto transform : _transforms)
+	{
+		std::unique_ptr<Operand> transformed(TransformOperand(*_root, transform, bounds));
+
+		Variant variant;
+		variant.transform = transform;
+		variant.arena = new OperandArena(transformed->ArenaSize());
+		try
+		{
+			variant.root = transformed->Clone(variant.arena);
+		}
+		catch (...)
+		{
+			delete variant.arena;
+			throw;
+		}
+
+		_FindLeaves(*variant.root, variant.exactLeaves, variant.rowLeaves);
+		_variants.push_back(std::move(variant));
+	}
+}
+void PixelPattern::_DeleteVariants()
+{
+	//takes each variant's root and everything under it with it
+	for (auto &variant : _variants)
+		delete variant.arena;
+
+	_variants.clear();
+}
+void PixelPattern::Transforms(const std::vector<Transform> &transforms)
+{
+	_transforms = DistinctTransforms(transforms);
+	_CompileVariants();
+	_Classify();
+
+	//what was found may have been a variant that's gone
+	Reset();
+}
+void PixelPattern::_Classify()
+{
+	auto classifier = new ColorClassifier();
+	ForEachOwnedLeaf<RangePixelMatch>(*_root, [&](RangePixelMatch &range) { range.Classify(classifier); });
+	//the variants' ranges are _root's, so they share its classes
+	for (auto &variant : _variants)
+		ForEachOwnedLeaf<RangePixelMatch>(*variant.root, [&](RangePixelMatch &range) { range.Classify(classifier); });
+
+	if (_classifier)
+		delete _classifier;
+
+	if (classifier->Count() == 0)
+	{
+		delete classifier;
+		classifier = nullptr;
+	}
+	_classifier = classifier;
+}
+void PixelPattern::CompileInOrder(const Operand &root, const std::vector<unsigned> &order)
+{
+	if (order.empty())
+	{
+		Compile(root);
+		return;
+	}
+
+	std::vector<const Operand*> conjuncts;
+	CollectConjuncts(root, conjuncts);
+	std::unique_ptr<Operand> ordered(AndOf(conjuncts, order));
+	Compile(*ordered);
+}
+std::vector<const Operand*> PixelPattern::DeclaredConjuncts() const
+{
+	std::vector<const Operand*> compiled;
+	CollectConjuncts(*_root, compiled);
+	if (_evaluationOrder.empty())
+		return compiled;
+
+	std::vector<const Operand*> declared(compiled.size());
+	for (size_t i = 0; i < compiled.size(); ++i)
+		declared[_evaluationOrder[i]] = compiled[i];
+	return declared;
+}
+PixelPattern::PixelPattern(Size imageSize, PatternId id, Expression *root, std::vector<Area> *searchAreas)
+:_imageSize(imageSize), _id(id)
+{
+	//owned here until nothing else can throw, since a throwing constructor doesn't destruct
+	std::unique_ptr<Expression> heapRoot(root);
+	std::unique_ptr<std::vector<Area>> heapAreas(searchAreas);
+	if (!root)
+		ThrowArgument("root is required");
+
+	std::unique_ptr<FlagMatrix> flagMatrix(searchAreas ? CreateFlagMatrix(imageSize, *searchAreas) : nullptr);
+	Compile(*heapRoot);
+	_flagMatrix = flagMatrix.release();
+	_searchAreas = heapAreas.release();
+}
+PixelPattern::PixelPattern(Size imageSize, PatternId id, OperandArena *arena, Operand *root, std::vector<Area> *searchAreas)
+:_imageSize(imageSize), _id(id)
+{
+	std::unique_ptr<OperandArena> heapArena(arena);
+	std::unique_ptr<std::vector<Area>> heapAreas(searchAreas);
+	std::unique_ptr<FlagMatrix> flagMatrix(searchAreas ? CreateFlagMatrix(imageSize, *searchAreas) : nullptr);
+	_arena = heapArena.release();
+	_root = root;
+	_flagMatrix = flagMatrix.release();
+	_searchAreas = heapAreas.release();
+
+	_FindLeaves(*_root, _exactLeaves, _rowLeaves);
+	_Classify();
+}
+PixelPattern::PixelPattern(const PixelPattern &rhs)
+: _changed(rhs._changed), _id(rhs._id), _imageSize(rhs._imageSize), _sharedOperands(rhs._sharedOperands),
+_evaluationOrder(rhs._evaluationOrder), _profile(rhs._profile), _transforms(rhs._transforms),
+_foundVariant(rhs._foundVariant)
+{
+	Compile(*rhs._root);
+	_flagMatrix = rhs._flagMatrix ? new FlagMatrix(*rhs._flagMatrix) : nullptr;
+	_searchAreas = rhs._searchAreas ? new std::vector<Area>(*rhs._searchAreas) : nullptr;
+	_found = rhs._found ? new Point(*rhs._found) : nullptr;
+	_declaredRoot = rhs._declaredRoot ? new Json::Value(*rhs._declaredRoot) : nullptr;
+}
+PixelPattern::PixelPattern(PixelPattern &&rhs)
+: _changed(rhs._changed), _id(rhs._id), _arena(rhs._arena), _root(rhs._root),
+_flagMatrix(rhs._flagMatrix), _searchAreas(rhs._searchAreas), _imageSize(rhs._imageSize),
+_sharedOperands(std::move(rhs._sharedOperands)), _found(rhs._found),
+_evaluationOrder(std::move(rhs._evaluationOrder)), _declaredRoot(rhs._declaredRoot), _profile(std::move(rhs._profile)),
+_exactLeaves(std::move(rhs._exactLeaves)), _rowLeaves(std::move(rhs._rowLeaves)), _classifier(rhs._classifier),
+_transforms(std::move(rhs._transforms)), _variants(std::move(rhs._variants)), _foundVariant(rhs._foundVariant)
+{
+	rhs._variants.clear();
+	rhs._classifier = nullptr;
+	rhs._arena = nullptr;
+	rhs._root = nullptr;
+	rhs._flagMatrix = nullptr;
+	rhs._searchAreas = nullptr;
+	rhs._found = nullptr;
+	rhs._declaredRoot = nullptr;
+}
+PixelPattern::~PixelPattern()
+{
+	//takes _root and everything under it with it
+	if (_arena)
+		delete _arena;
+
+	_DeleteVariants();
+
+	if (_classifier)
+		delete _classifier;
+
+	if (_flagMatrix)
+		delete _flagMatrix;
+
+	if (_searchAreas)
+		delete _searchAreas;
+
+	if (_found)
+		delete _found;
+
+	if (_declaredRoot)
+		delete _declaredRoot;
+}
+PixelPattern *PixelPattern::FromFile(const string &file)
+{
+	TraceScope trace("load", "PixelPattern::FromFile");
+	return new PixelPattern(ParseJsonFromFile(file));
+}
+PixelPattern::PixelPattern(const Json::Value &value)
+{
+	RequireTypeName(value, "PixelPattern");
+
+	_id = static_cast<PatternId>(GetJsonValue(value, "id").asUInt64());
+	std::unique_ptr<Operand> root(CreateOperand(value, "root"));
+	if (!root)
+		ThrowDeserialization("root is missing");
+
+	_imageSize = Size(GetJsonValue(value, "imageSize"));
+
+	//both are only handed to the members once nothing else can throw
+	std::unique_ptr<std::vector<Area>> searchAreas;
+	std::unique_ptr<FlagMatrix> flagMatrix;
+	auto searchAreasNode = GetJsonValue(value, "searchAreas", false);
+	if (!searchAreasNode.isNull())
+	{
+		searchAreas.reset(new std::vector<Area>);
+		for (unsigned i = 0; i < searchAreasNode.size(); ++i)
+			searchAreas->push_back(Area(searchAreasNode[i]));
+
+		flagMatrix.reset(CreateFlagMatrix(_imageSize, *searchAreas));
+	}
+
+	//a learned order that no longer fits the conjuncts (the file was edited since) is ignored
+	std::vector<unsigned> order;
+	std::unique_ptr<Json::Value> declaredRoot;
+	auto evaluationNode = GetJsonValue(value, "evaluation", false);
+	if (!evaluationNode.isNull())
+	{
+		std::vector<const Operand*> conjuncts;
+		CollectConjuncts(*root, conjuncts);
+
+		EvaluationProfile profile;
+		profile.anchors = GetJsonValue(evaluationNode, "anchors").asUInt64();
+		auto failuresNode = GetJsonValue(evaluationNode, "failures");
+		for (unsigned i = 0; i < failuresNode.size(); ++i)
+			profile.failures.push_back(failuresNode[i].asUInt64());
+
+		auto orderNode = GetJsonValue(evaluationNode, "order");
+		for (unsigned i = 0; i < orderNode.size(); ++i)
+			order.push_back(orderNode[i].asUInt());
+
+		if (profile.failures.size() == conjuncts.size() && IsOrder(order, conjuncts.size()))
+		{
+			_profile = profile;
+			declaredRoot.reset(new Json::Value(GetJsonValue(value, "root")));
+		}
+		else
+			order.clear();
+	}
+
+	auto transformsNode = GetJsonValue(value, "transforms", false);
+	for (unsigned i = 0; i < transformsNode.size(); ++i)
+		_transforms.push_back(StringToTransform(transformsNode[i].asString()));
+	_transforms = DistinctTransforms(_transforms);
+
+	//last, so nothing after it can throw and leak the arena
+	CompileInOrder(*root, order);
+	_evaluationOrder.swap(order);
+	_declaredRoot = declaredRoot.release();
+	_flagMatrix = flagMatrix.release();
+	_searchAreas = searchAreas.release();
+}
+PixelPattern::operator const Json::Value() const
+{
+	Json::Value value;
+	value["type"] = "PixelPattern";
+	//JsonCpp doesn't have an unsigned long type so I've got to convert to a unsigned long long
+	value["id"] = static_cast<unsigned long long>(_id);
+	if (_evaluationOrder.empty())
+	{
+		value["root"] = *_root;
+	}
+	else
+	{
+		//the root is saved as declared, with the order it's evaluated in alongside
+		value["root"] = *_declaredRoot;
+
+		auto &evaluation = value["evaluation"];
+		for (unsigned i = 0; i < _evaluationOrder.size(); ++i)
+			evaluation["order"][i] = _evaluationOrder[i];
+		evaluation["anchors"] = static_cast<Json::UInt64>(_profile.anchors);
+		for (unsigned i = 0; i < _profile.failures.size(); ++i)
+			evaluation["failures"][i] = static_cast<Json::UInt64>(_profile.failures[i]);
+	}
+	value["imageSize"] = _imageSize;
+	for (unsigned i = 0; i < _transforms.size(); ++i)
+		value["transforms"][i] = TRANSFORM_NAMES[static_cast<size_t>(_transforms[i])];
+	if (_searchAreas)
+	{
+		auto &searchAreas = *_searchAreas;
+		for (unsigned i = 0; i < searchAreas.size(); ++i)
+			value["searchAreas"][i] = searchAreas[i];
+	}
+	//searchPoints isn't serialized as it can be recreated from searchAreas
+	return value;
+}
+
+bool PixelPattern::operator==(const PixelPattern &rhs) const
+{
+	bool equal = _id == rhs._id &&
+		_imageSize == rhs._imageSize &&
+		*_root == *rhs._root &&
+		_transforms == rhs._transforms &&
+		((!_searchAreas && !_searchAreas) ||
+		(_searchAreas && rhs._searchAreas && VectorsEqual(*_searchAreas, *rhs._searchAreas)));
+
+	return equal;
+}
+
+bool PixelPattern::operator!=(const PixelPattern &rhs) const
+{
+	return !operator==(rhs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// FrameRing
+///////////////////////////////////////////////////////////////////////////////
+struct FrameRing::Header {
+	//READY once the creating end has filled in the rest
+	std::atomic<unsigned> ready;
+	unsigned long width;
+	unsigned long height;
+	unsigned slots;
+	//the next slot each end takes; each is only written by its own end
+	unsigned writeIndex;
+	unsigned readIndex;
+	std::atomic<unsigned long long> committed;
+};
+namespace {
+	const unsigned READY = 0x474e4952;
+	//the slots start on a cache line of their own
+	const size_t RING_HEADER_SIZE = 64;
+	//how long an opening end waits for the creating end to finish
+	const std::chrono::milliseconds RING_READY_TIMEOUT(1000);
+
+	//false if timeout ms passed first
+	bool WaitFor(HANDLE handle, unsigned long timeout)
+	{
+		switch (WaitForSingleObject(handle, timeout))
+		{
+		case WAIT_OBJECT_0:
+			return true;
+		case WAIT_TIMEOUT:
+			return false;
+		default:
+			ThrowLogic(format("WaitForSingleObject failed with %1%", % GetLastError()));
+		}
+	}
+}
+FrameRing::FrameRing(const std::string &name, const Size &frameSize, unsigned slots)
+: _frameSize(frameSize), _slotCount(slots)
+{
+	if (name.empty())
+		ThrowArgument("name is required");
+
+	if (frameSize.Width() <= 0 || frameSize.Height() <= 0)
+		ThrowArgument("frameSize must be > 0");
+
+	if (slots == 0)
+		ThrowArgument("slots must be > 0");
+
+	static_assert(sizeof(Header) <= RING_HEADER_SIZE, "the ring header outgrew its space");
+	auto slotSize = static_cast<unsigned long long>(frameSize.Width()) * frameSize.Height() * sizeof(Color);
+	auto size = RING_HEADER_SIZE + slots * slotSize;
+
+	_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), name.c_str());
+	if (!_mapping)
+		ThrowLogic(format("CreateFileMapping failed with %1%", % GetLastError()));
+	bool created = GetLastError() != ERROR_ALREADY_EXISTS;
+
+	try
+	{
+		//the whole mapping, which is the creator's size if it was already there
+		auto view = static_cast<BYTE*>(MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+		if (!view)
+			ThrowLogic(format("MapViewOfFile failed with %1%", % GetLastError()));
+
+		_header = reinterpret_cast<Header*>(view);
+		_slots = reinterpret_cast<Color*>(view + RING_HEADER_SIZE);
+
+		if (created)
+		{
+			_header->width = frameSize.Width();
+			_header->height = frameSize.Height();
+			_header->slots = slots;
+			_header->writeIndex = 0;
+			_header->readIndex = 0;
+			_header->committed.store(0);
+		}
+		else
+		{
+			auto deadline = std::chrono::steady_clock::now() + RING_READY_TIMEOUT;
+			while (_header->ready.load() != READY)
+			{
+				if (std::chrono::steady_clock::now() >= deadline)
+					ThrowLogic(format("ring %1% wasn't ready within %2%ms", % name % RING_READY_TIMEOUT.count()));
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+
+			if (_header->width != frameSize.Width() || _header->height != frameSize.Height() || _header->slots != slots)
+				ThrowArgument(format("ring %1% holds %2% %3%x%4% frames", % name % _header->slots % _header->width % _header->height));
+		}
+
+		_free = CreateSemaphore(nullptr, slots, slots, (name + ".free").c_str());
+		_filled = CreateSemaphore(nullptr, 0, slots, (name + ".filled").c_str());
+		if (!_free || !_filled)
+			ThrowLogic(format("CreateSemaphore failed with %1%", % GetLastError()));
+
+		if (created)
+			_header->ready.store(READY);
+	}
+	catch (...)
+	{
+		Close();
+		throw;
+	}
+}
+FrameRing::~FrameRing()
+{
+	Close();
+}
+void FrameRing::Close()
+{
+	if (_frame)
+		delete _frame;
+	_frame = nullptr;
+
+	if (_header)
+		UnmapViewOfFile(_header);
+	_header = nullptr;
+
+	if (_free)
+		CloseHandle(_free);
+
+	if (_filled)
+		CloseHandle(_filled);
+
+	if (_mapping)
+		CloseHandle(_mapping);
+	_free = _filled = _mapping = nullptr;
+}
+unsigned long long FrameRing::Committed() const
+{
+	return _header->committed.load();
+}
+_Color *FrameRing::Acquire(unsigned long timeout)
+{
+	if (_writing != -1)
+		ThrowLogic("the slot last acquired hasn't been committed");
+
+	TraceScope trace("wait", "FrameRing::Acquire");
+	if (!WaitFor(_free, timeout))
+		return nullptr;
+
+	_writing = _header->writeIndex;
+	_header->writeIndex = (_header->writeIndex + 1) % _slotCount;
+	return _slots + _writing * _frameSize.Width() * _frameSize.Height();
+}
+void FrameRing::Commit()
+{
+	if (_writing == -1)
+		ThrowLogic("no slot was acquired");
+
+	_writing = -1;
+	_header->committed.fetch_add(1);
+	ReleaseSemaphore(_filled, 1, nullptr);
+}
+const Bitmap *FrameRing::Read(unsigned long timeout)
+{
+	if (_reading != -1)
+		ThrowLogic("the frame last read hasn't been released");
+
+	TraceScope trace("wait", "FrameRing::Read");
+	if (!WaitFor(_filled, timeout))
+		return nullptr;
+
+	BITMAPINFOHEADER info = {};
+	info.biSize = sizeof(BITMAPINFOHEADER);
+	info.biWidth = _frameSize.Width();
+	info.biHeight = _frameSize.Height();
+	info.biPlanes = 1;
+	info.biBitCount = 24;
+	info.biSizeImage = static_cast<DWORD>(info.biWidth * info.biHeight * sizeof(_Color));
+
+	_reading = _header->readIndex;
+	_header->readIndex = (_header->readIndex + 1) % _slotCount;
+	_frame = new Bitmap(info, _slots + _reading * info.biWidth * info.biHeight, false);
+	return _frame;
+}
+void FrameRing::Release()
+{
+	if (_reading == -1)
+		ThrowLogic("no frame was read");
+
+	delete _frame;
+	_frame = nullptr;
+	_reading = -1;
+	ReleaseSemaphore(_free, 1, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// Trace
+///////////////////////////////////////////////////////////////////////////////
+namespace {
+	typedef SpscQueue<TraceEvent> TraceRing;
+	struct TraceRegistry {
+		std::mutex lock;
+		//every ring handed out, including those of threads that have since exited
+		std::vector<std::unique_ptr<TraceRing>> rings;
+		std::vector<TraceRing*> released;
+		std::map<unsigned, const char*> threadNames;
+		size_t capacity;
+		unsigned threads;
+		long long origin;
+		//only one Flush pops the rings at a time
+		std::mutex flushLock;
+		std::atomic<unsigned long long> dropped;
+		TraceRegistry() : capacity(1 << 16), threads(0), origin(0), dropped(0) {}
+	};
+	TraceRegistry traceRegistry;
+	IMGEXP_THREAD_LOCAL TraceRing *threadRing = nullptr;
+	IMGEXP_THREAD_LOCAL unsigned threadId = 0;
+
+	TraceRing *ThreadRing()
+	{
+		if (!threadRing)
+		{
+			std::lock_guard<std::mutex> guard(traceRegistry.lock);
+			if (!traceRegistry.released.empty())
+			{
+				threadRing = traceRegistry.released.back();
+				traceRegistry.released.pop_back();
+			}
+			else
+			{
+				traceRegistry.rings.push_back(std::unique_ptr<TraceRing>(new TraceRing(traceRegistry.capacity)));
+				threadRing = traceRegistry.rings.back().get();
+			}
+
+			threadId = ++traceRegistry.threads;
+		}
+
+		return threadRing;
+	}
+}
+std::atomic<bool> Trace::_enabled(false);
+
+void Trace::Start(size_t capacity)
+{
+	if (capacity == 0)
+		ThrowArgument("capacity must be > 0");
+
+	std::lock_guard<std::mutex> guard(traceRegistry.lock);
+	traceRegistry.capacity = capacity;
+	if (!traceRegistry.origin)
+		traceRegistry.origin = Now();
+
+	_enabled.store(true, std::memory_order_relaxed);
+}
+void Trace::Stop()
+{
+	_enabled.store(false, std::memory_order_relaxed);
+}
+size_t Trace::Flush(const std::string &fileName)
+{
+	std::lock_guard<std::mutex> flushGuard(traceRegistry.flushLock);
+
+	std::vector<TraceRing*> rings;
+	std::map<unsigned, const char*> threadNames;
+	long long origin;
+	{
+		std::lock_guard<std::mutex> guard(traceRegistry.lock);
+		for (auto &ring : traceRegistry.rings)
+			rings.push_back(ring.get());
+
+		threadNames = traceRegistry.threadNames;
+		origin = traceRegistry.origin;
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	auto micros = [&](long long ticks) { return static_cast<double>(ticks) * 1000000 / frequency.QuadPart; };
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3) << "[";
+
+	bool first = true;
+	for (auto &name : threadNames)
+	{
+		out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << name.first
+			<< ",\"args\":{\"name\":\"" << name.second << "\"}}";
+		first = false;
+	}
+
+	size_t count = 0;
+	TraceEvent event;
+	for (auto ring : rings)
+	{
+		while (ring->Pop(event))
+		{
+			out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+				<< "\",\"ph\":\"X\",\"ts\":" << micros(event.start - origin) << ",\"dur\":" << micros(event.end - event.start)
+				<< ",\"pid\":1,\"tid\":" << event.thread;
+			if (event.arg != -1)
+				out << ",\"args\":{\"id\":" << event.arg << "}";
+			out << "}";
+
+			first = false;
+			++count;
+		}
+	}
+
+	out << "\n]\n";
+	WriteAllText(fileName, out.str());
+	return count;
+}
+unsigned long long Trace::Dropped()
+{
+	return traceRegistry.dropped.load(std::memory_order_relaxed);
+}
+void Trace::NameThread(const char *name)
+{
+	if (!Enabled())
+		return;
+
+	ThreadRing();
+	std::lock_guard<std::mutex> guard(traceRegistry.lock);
+	traceRegistry.threadNames[threadId] = name;
+}
+void Trace::ReleaseThread()
+{
+	if (!threadRing)
+		return;
+
+	std::lock_guard<std::mutex> guard(traceRegistry.lock);
+	traceRegistry.released.push_back(threadRing);
+	threadRing = nullptr;
+}
+long long Trace::Now()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+void Trace::Record(const char *category, const char *name, long long start, long long arg)
+{
+	TraceEvent event;
+	event.name = name;
+	event.category = category;
+	event.start = start;
+	event.end = Now();
+	event.arg = arg;
+
+	auto ring = ThreadRing();
+	event.thread = threadId;
+	if (!ring->Push(event))
+		traceRegistry.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// PatternBundle
+///////////////////////////////////////////////////////////////////////////////
+//On disk a bundle is a BundleHeader followed by one record per pattern. A record is a BundleRecord,
+//its searchAreaCount BundleAreas and its nodeCount BundleNodes, padded to 8 bytes. Nodes are stored
+//in evaluation order: an expression is followed by its left operand, then its right operand, and a
+//compound expression by each of its operands.
+//Version 2 added compound expressions.
+namespace {
+	const char BUNDLE_MAGIC[8] = { 'I', 'M', 'G', 'E', 'X', 'P', 'B', 0 };
+
+	enum class BundleNodeKind : uint8_t {
+		Expression,
+		ExactPixelMatch,
+		RangePixelMatch,
+		CompoundExpression,
+	};
+
+	struct BundleHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t patternCount;
+	};
+	struct BundleRecord {
+		uint64_t id;
+		uint32_t width;
+		uint32_t height;
+		uint32_t searchAreaCount;
+		uint32_t nodeCount;
+	};
+	struct BundleArea {
+		int32_t left;
+		int32_t top;
+		int32_t right;
+		int32_t bottom;
+	};
+	struct BundleNode {
+		BundleNodeKind kind;
+		//Operator for expressions
+		uint8_t op;
+		uint16_t reserved;
+		//offset for pixel matches; x is the operand count for compound expressions
+		int32_t x;
+		int32_t y;
+		//red, green, blue of the color (exact) or min then max (range)
+		uint8_t colors[6];
+		uint16_t reserved2;
+	};
+
+	//whether the record's areas and nodes fit in the available bytes after it, checked by count so a
+	//corrupt count can't overflow the size
+	bool RecordFits(const BundleRecord &record, size_t available)
+	{
+		if (record.searchAreaCount > available / sizeof(BundleArea))
+			return false;
+
+		available -= record.searchAreaCount * sizeof(BundleArea);
+		return record.nodeCount <= available / sizeof(BundleNode);
+	}
+
+	size_t RecordSize(const BundleRecord &record)
+	{
+		auto size = sizeof(BundleRecord) + record.searchAreaCount * sizeof(BundleArea) + record.nodeCount * sizeof(BundleNode);
+		return (size + 7) & ~static_cast<size_t>(7);
+	}
+
+	void EncodeColor(const Color &color, uint8_t *rgb)
+	{
+		rgb[0] = color.Red();
+		rgb[1] = color.Green();
+		rgb[2] = color.Blue();
+	}
+
+	//Appends root's nodes in evaluation order. Walks the tree with a stack of its own, as trees built a
+	//leaf at a time nest as deep as they're long.
+	void EncodeOperand(const Operand &root, std::vector<BundleNode> &nodes)
+	{
+		std::vector<const Operand*> pending(1, &root);
+		while (!pending.empty())
+		{
+			//shared subexpressions are stored inline; sharing is redone after loading
+			auto &operand = pending.back()->Resolve();
+			pending.pop_back();
+			BundleNode node = {};
+
+			if (auto exp = dynamic_cast<const Expression*>(&operand))
+			{
+				node.kind = BundleNodeKind::Expression;
+				node.op = static_cast<uint8_t>(exp->Operator());
+				nodes.push_back(node);
+
+				if (exp->Right())
+					pending.push_back(exp->Right());
+				pending.push_back(exp->Left());
+				continue;
+			}
+
+			if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+			{
+				node.kind = BundleNodeKind::CompoundExpression;
+				node.op = static_cast<uint8_t>(compound->Operator());
+				node.x = static_cast<int32_t>(compound->Count());
+				nodes.push_back(node);
+
+				for (auto i = compound->Count(); i > 0; --i)
+					pending.push_back(compound->Get(i - 1));
+				continue;
+			}
+
+			auto match = dynamic_cast<const PixelMatch*>(&operand);
+			if (!match)
+				ThrowSerialization("only expressions and pixel matches can be bundled");
+
+			node.x = match->Offset().X();
+			node.y = match->Offset().Y();
+
+			if (auto exact = dynamic_cast<const ExactPixelMatch*>(match))
+			{
+				node.kind = BundleNodeKind::ExactPixelMatch;
+				EncodeColor(exact->Color(), node.colors);
+			}
+			else if (auto range = dynamic_cast<const RangePixelMatch*>(match))
+			{
+				node.kind = BundleNodeKind::RangePixelMatch;
+				EncodeColor(range->Min(), node.colors);
+				EncodeColor(range->Max(), node.colors + 3);
+			}
+			else
+				ThrowSerialization("unsupported pixel match type");
+
+			nodes.push_back(node);
+		}
+	}
+
+	size_t NodeArenaSize(const BundleNode &node, size_t nodeCount)
+	{
+		switch (node.kind)
+		{
+		case BundleNodeKind::Expression:
+			return OperandArena::Align(sizeof(Expression));
+		case BundleNodeKind::CompoundExpression:
+			if (node.x <= 0 || static_cast<size_t>(node.x) >= nodeCount)
+				ThrowDeserialization("compound expression operand count is out of range");
+			return OperandArena::Align(sizeof(CompoundExpression)) + OperandArena::Align(node.x * sizeof(Operand*));
+		case BundleNodeKind::ExactPixelMatch:
+			return OperandArena::Align(sizeof(ExactPixelMatch));
+		case BundleNodeKind::RangePixelMatch:
+			return OperandArena::Align(sizeof(RangePixelMatch));
+		default:
+			ThrowDeserialization("unknown bundle node kind");
+		}
+	}
+
+	//Decodes the operand starting at node, leaving node after it. Expressions wait on a stack of their
+	//own for the operands that follow them, as EncodeOperand walks them.
+	Operand *DecodeOperand(const BundleNode *&node, const BundleNode *end, OperandArena &arena)
+	{
+		//an expression reserved ahead of its operands, placed once count of them are decoded
+		struct Open {
+			BundleNodeKind kind;
+			imgexp::Operator op;
+			void *storage;
+			Operand **operands;
+			Operand *pair[2];
+			size_t count;
+			size_t decoded;
+		};
+		std::vector<Open> open;
+
+		for (;;)
+		{
+			if (node == end)
+				ThrowDeserialization("bundle record is missing operands");
+
+			auto &current = *node++;
+			auto rgb = current.colors;
+			Operand *decoded = nullptr;
+
+			switch (current.kind)
+			{
+			case BundleNodeKind::Expression:
+			{
+				if (current.op > static_cast<uint8_t>(imgexp::Operator::AND))
+					ThrowDeserialization("unknown expression operator");
+
+				Open exp = {};
+				exp.kind = current.kind;
+				exp.op = static_cast<imgexp::Operator>(current.op);
+				exp.storage = arena.Allocate(sizeof(Expression));
+				exp.count = exp.op != imgexp::Operator::NONE ? 2 : 1;
+				open.push_back(exp);
+				continue;
+			}
+			case BundleNodeKind::CompoundExpression:
+			{
+				Open compound = {};
+				compound.kind = current.kind;
+				compound.op = static_cast<imgexp::Operator>(current.op);
+				if (compound.op != imgexp::Operator::AND && compound.op != imgexp::Operator::OR)
+					ThrowDeserialization("compound expression operator must be AND or OR");
+
+				compound.count = static_cast<size_t>(current.x);
+				compound.storage = arena.Allocate(sizeof(CompoundExpression));
+				compound.operands = static_cast<Operand**>(arena.Allocate(compound.count * sizeof(Operand*)));
+				open.push_back(compound);
+				continue;
+			}
+			case BundleNodeKind::ExactPixelMatch:
+			{
+				ExactPixelMatch match(Color(rgb[0], rgb[1], rgb[2]));
+				match.Offset(Point(current.x, current.y));
+				decoded = arena.New(match);
+				break;
+			}
+			case BundleNodeKind::RangePixelMatch:
+			{
+				RangePixelMatch match(Color(rgb[0], rgb[1], rgb[2]), Color(rgb[3], rgb[4], rgb[5]));
+				match.Offset(Point(current.x, current.y));
+				decoded = arena.New(match);
+				break;
+			}
+			default:
+				ThrowDeserialization("unknown bundle node kind");
+			}
+
+			//hand the operand to the expression waiting on it, placing each one it completes
+			while (!open.empty())
+			{
+				auto &parent = open.back();
+				(parent.operands ? parent.operands : parent.pair)[parent.decoded++] = decoded;
+				if (parent.decoded < parent.count)
+					break;
+
+				if (parent.kind == BundleNodeKind::Expression)
+					decoded = Expression::Place(arena, parent.storage, parent.pair[0], parent.op, parent.pair[1]);
+				else
+					decoded = CompoundExpression::Place(arena, parent.storage, parent.op, parent.operands, parent.count);
+				open.pop_back();
+			}
+
+			if (open.empty())
+				return decoded;
+		}
+	}
+}
+const wchar_t* PatternBundle::PATTERN_BUNDLE_FILE_EXT = L".patterns";
+const unsigned PatternBundle::VERSION = 2;
+PatternBundle::PatternBundle(const std::string &fileName)
+{
+	_file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, 0);
+	if (_file == INVALID_HANDLE_VALUE)
+		ThrowFileNotFound(fileName);
+
+	try
+	{
+		DWORD sizeHigh = 0;
+		auto sizeLow = GetFileSize(_file, &sizeHigh);
+		if (sizeLow == INVALID_FILE_SIZE || sizeHigh)
+			ThrowIORead(format("unable to size pattern bundle %1%", % fileName));
+
+		_size = sizeLow;
+		if (_size < sizeof(BundleHeader))
+			ThrowDeserialization(format("%1% is too small to be a pattern bundle", % fileName));
+
+		_mapping = CreateFileMapping(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!_mapping)
+			ThrowIORead(format("unable to map pattern bundle %1%", % fileName));
+
+		_view = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!_view)
+			ThrowIORead(format("unable to map a view of pattern bundle %1%", % fileName));
+
+		auto &header = *reinterpret_cast<const BundleHeader*>(_view);
+		if (memcmp(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0)
+			ThrowDeserialization(format("%1% is not a pattern bundle", % fileName));
+
+		//every earlier version is a subset of this one
+		if (header.version < 1 || header.version > VERSION)
+			ThrowDeserialization(format("%1% is bundle version %2%, expected 1 to %3%", % fileName % header.version % VERSION));
+
+		//index the records, checking that each one fits in the file
+		size_t offset = sizeof(BundleHeader);
+		_offsets.reserve(header.patternCount);
+		for (uint32_t i = 0; i < header.patternCount; ++i)
+		{
+			if (_size - offset < sizeof(BundleRecord))
+				ThrowDeserialization(format("%1% is truncated", % fileName));
+
+			auto &record = *reinterpret_cast<const BundleRecord*>(_view + offset);
+			if (!RecordFits(record, _size - offset - sizeof(BundleRecord)) || _size - offset < RecordSize(record))
+				ThrowDeserialization(format("%1% is truncated", % fileName));
+
+			_offsets.push_back(offset);
+			offset += RecordSize(record);
+		}
+	}
+	catch (...)
+	{
+		Close();
+		throw;
+	}
+}
+PatternBundle::~PatternBundle()
+{
+	Close();
+}
+void PatternBundle::Close()
+{
+	if (_view)
+	{
+		UnmapViewOfFile(_view);
+		_view = nullptr;
+	}
+
+	if (_mapping)
+	{
+		CloseHandle(_mapping);
+		_mapping = nullptr;
+	}
+
+	if (_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+	}
+}
+PatternId PatternBundle::Id(size_t index) const
+{
+	if (index >= _offsets.size())
+		ThrowArgument("index is out of range");
+
+	return static_cast<PatternId>(reinterpret_cast<const BundleRecord*>(_view + _offsets[index])->id);
+}
+PixelPattern *PatternBundle::Load(size_t index) const
+{
+	TraceScope trace("load", "PatternBundle::Load", index);
+
+	if (index >= _offsets.size())
+		ThrowArgument("index is out of range");
+
+	auto record = reinterpret_cast<const BundleRecord*>(_view + _offsets[index]);
+	auto areas = reinterpret_cast<const BundleArea*>(record + 1);
+	auto nodes = reinterpret_cast<const BundleNode*>(areas + record->searchAreaCount);
+	auto end = nodes + record->nodeCount;
+
+	Size imageSize(record->width, record->height);
+
+	std::unique_ptr<std::vector<Area>> searchAreas;
+	if (record->searchAreaCount)
+	{
+		searchAreas.reset(new std::vector<Area>);
+		searchAreas->reserve(record->searchAreaCount);
+		for (auto area = areas; area != areas + record->searchAreaCount; ++area)
+			searchAreas->push_back(Area(area->left, area->top, area->right, area->bottom));
+	}
+
+	size_t arenaSize = 0;
+	for (auto node = nodes; node != end; ++node)
+		arenaSize += NodeArenaSize(*node, record->nodeCount);
+
+	std::unique_ptr<OperandArena> arena(new OperandArena(arenaSize));
+	auto node = nodes;
+	auto root = DecodeOperand(node, end, *arena);
+	if (node != end)
+		ThrowDeserialization(format("bundle record for pattern %1% is malformed", % record->id));
+
+	auto pattern = new PixelPattern(imageSize, static_cast<PatternId>(record->id), arena.get(), root, searchAreas.get());
+	arena.release();
+	searchAreas.release();
+	return pattern;
+}
+void PatternBundle::Write(const std::string &fileName, const std::vector<const PixelPattern*> &patterns)
+{
+	//every record is encoded before the file is opened, so a pattern that can't be bundled leaves
+	//whatever was there as it was
+	struct EncodedRecord {
+		BundleRecord record;
+		std::vector<BundleArea> areas;
+		std::vector<BundleNode> nodes;
+	};
+	std::vector<EncodedRecord> records(patterns.size());
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		auto pattern = patterns[i];
+		if (!pattern->_transforms.empty())
+			ThrowSerialization("patterns with transforms can't be bundled");
+
+		auto &encoded = records[i];
+		if (pattern->_searchAreas)
+		{
+			for (auto &area : *pattern->_searchAreas)
+			{
+				BundleArea bundleArea = { static_cast<int32_t>(area.Left()), static_cast<int32_t>(area.Top()),
+					static_cast<int32_t>(area.Right()), static_cast<int32_t>(area.Bottom()) };
+				encoded.areas.push_back(bundleArea);
+			}
+		}
+
+		EncodeOperand(*pattern->_root, encoded.nodes);
+
+		encoded.record = BundleRecord();
+		encoded.record.id = pattern->_id;
+		encoded.record.width = pattern->_imageSize.Width();
+		encoded.record.height = pattern->_imageSize.Height();
+		encoded.record.searchAreaCount = static_cast<uint32_t>(encoded.areas.size());
+		encoded.record.nodeCount = static_cast<uint32_t>(encoded.nodes.size());
+	}
+
+	std::ofstream output(fileName, ios_base::binary | ios_base::trunc);
+	if (!output)
+		ThrowIOWrite(format("unable to create pattern bundle %1%", % fileName));
+
+	BundleHeader header = {};
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+	header.version = VERSION;
+	header.patternCount = static_cast<uint32_t>(patterns.size());
+	output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		auto &encoded = records[i];
+		auto &record = encoded.record;
+		output.write(reinterpret_cast<const char*>(&record), sizeof(record));
+		output.write(reinterpret_cast<const char*>(encoded.areas.data()), encoded.areas.size() * sizeof(BundleArea));
+		output.write(reinterpret_cast<const char*>(encoded.nodes.data()), encoded.nodes.size() * sizeof(BundleNode));
+
+		static const char padding[8] = {};
+		auto written = sizeof(record) + encoded.areas.size() * sizeof(BundleArea) + encoded.nodes.size() * sizeof(BundleNode);
+		output.write(padding, RecordSize(record) - written);
+	}
+
+	output.close();
+	if (!output)
+		ThrowIOWrite(format("unable to write pattern bundle %1%", % fileName));
+}
+void PatternBundle::Convert(const std::vector<std::string> &patternFiles, const std::string &bundleFile)
+{
+	std::vector<std::unique_ptr<PixelPattern>> owned;
+	std::vector<const PixelPattern*> patterns;
+
+	for (auto &file : patternFiles)
+	{
+		owned.push_back(std::unique_ptr<PixelPattern>(PixelPattern::FromFile(file)));
+		patterns.push_back(owned.back().get());
+	}
+
+	Write(bundleFile, patterns);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// ResultCache
+///////////////////////////////////////////////////////////////////////////////
+ResultCache::ResultCache(size_t capacity)
+: _capacity(capacity)
+{
+	if (capacity == 0)
+		ThrowArgument("capacity must be > 0");
+}
+size_t ResultCache::Size() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _entries.size();
+}
+bool ResultCache::Find(unsigned long long frameHash, unsigned long long version, FrameResult &result)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	auto found = _index.find(Key(frameHash, version));
+	if (found == _index.end())
+	{
+		++_misses;
+		return false;
+	}
+
+	++_hits;
+	_entries.splice(_entries.begin(), _entries, found->second);
+	result = found->second->second;
+	return true;
+}
+void ResultCache::Add(unsigned long long frameHash, unsigned long long version, const FrameResult &result)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	Key key(frameHash, version);
+	auto found = _index.find(key);
+	if (found != _index.end())
+	{
+		found->second->second = result;
+		_entries.splice(_entries.begin(), _entries, found->second);
+		return;
+	}
+
+	if (_entries.size() == _capacity)
+	{
+		_index.erase(_entries.back().first);
+		_entries.pop_back();
+	}
+
+	_entries.push_front(std::make_pair(key, result));
+	_index[key] = _entries.begin();
+}
+void ResultCache::Clear()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_entries.clear();
+	_index.clear();
+	_hits = 0;
+	_misses = 0;
+}
+unsigned long long ResultCache::Hits() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _hits;
+}
+unsigned long long ResultCache::Misses() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _misses;
+}
+double ResultCache::HitRate() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	auto lookups = _hits + _misses;
+	return lookups ? static_cast<double>(_hits) / lookups : 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// Parser
+///////////////////////////////////////////////////////////////////////////////
+Parser::Parser(const Size &imageSize)
+: _imageSize(imageSize), _patterns(std::make_shared<PatternSet>()), _droppedChangeEvents(0), _indexColors(false), _summarizeRows(false), _classifyPixels(false), _profileEvery(0)
+{
+	if (imageSize.Width() <= 0)
+		ThrowArgument("imageSize.Width must be > 0");
+
+	if (imageSize.Height() <= 0)
+		ThrowArgument("imageSize.Height must be > 0");
+}
+Parser::~Parser()
+{
+	if (_changeQueue)
+		delete _changeQueue;
+
+	if (_resultCache)
+		delete _resultCache;
+}
+void Parser::AddPattern(const PixelPattern &pattern)
+{
+	std::shared_ptr<PixelPattern> copy(new PixelPattern(pattern));
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		if (!patterns.insert(std::make_pair(copy->Id(), copy)).second)
+			ThrowDuplicateKey(std::to_string(copy->Id()));
+	});
+}
+void Parser::AddPattern(PixelPattern &&pattern)
+{
+	//checked first so a duplicate leaves pattern untouched
+	if (GetPattern(pattern.Id()))
+		ThrowDuplicateKey(std::to_string(pattern.Id()));
+
+	std::shared_ptr<PixelPattern> moved(new PixelPattern(std::move(pattern)));
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		if (!patterns.insert(std::make_pair(moved->Id(), moved)).second)
+			ThrowDuplicateKey(std::to_string(moved->Id()));
+	});
+}
+LoadReport Parser::LoadDirectory(const std::string &directory, unsigned threads)
+{
+	TraceScope trace("load", "Parser::LoadDirectory");
+
+	//duplicate ids are resolved by name order
+	std::vector<std::string> files;
+	for (auto &findData : FindPatternFiles(directory))
+		files.push_back(directory + "\\" + findData.cFileName);
+
+	LoadReport report;
+	std::vector<std::unique_ptr<PixelPattern>> loaded(files.size());
+	std::vector<LoadError> errors(files.size());
+
+	ParallelFor(files.size(), threads, [&](size_t index)
+	{
+		errors[index].file = files[index];
+		TryLoad(errors[index], [&] { loaded[index].reset(PixelPattern::FromFile(files[index])); });
+	});
+
+	_AddLoaded(loaded, errors, report);
+	return report;
+}
+LoadReport Parser::LoadBundle(const std::string &fileName, unsigned threads)
+{
+	TraceScope trace("load", "Parser::LoadBundle");
+
+	PatternBundle bundle(fileName);
+
+	LoadReport report;
+	std::vector<std::unique_ptr<PixelPattern>> loaded(bundle.Count());
+	std::vector<LoadError> errors(bundle.Count());
+
+	ParallelFor(bundle.Count(), threads, [&](size_t index)
+	{
+		errors[index].file = format("%1%#%2%", % fileName % index);
+		TryLoad(errors[index], [&] { loaded[index].reset(bundle.Load(index)); });
+	});
+
+	_AddLoaded(loaded, errors, report);
+	return report;
+}
+namespace {
+	//Equal subexpressions found by Parser::ShareSubexpressions
+	struct SubexpressionClass {
+		const Operand *representative;
+		size_t occurrences;
+		std::shared_ptr<const Operand> shared;
+		unsigned slot;
+	};
+
+	struct SharingState {
+		size_t minLeaves;
+		unsigned slots;
+		size_t shared;
+		std::vector<SubexpressionClass> classes;
+		std::unordered_multimap<size_t, size_t> classesByHash;
+		std::unordered_map<const Operand*, size_t> classOf;
+	};
+
+	inline size_t HashCombine(size_t seed, size_t value)
+	{
+		return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+	}
+
+	size_t HashColor(const Color &color)
+	{
+		return (static_cast<size_t>(color.Red()) << 16) | (static_cast<size_t>(color.Green()) << 8) | color.Blue();
+	}
+
+	//Puts an expression of at least state.minLeaves pixel matches in its class
+	void Register(const Operand &operand, size_t hash, size_t leaves, SharingState &state)
+	{
+		if (leaves < state.minLeaves)
+			return;
+
+		size_t found = state.classes.size();
+		auto range = state.classesByHash.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (*state.classes[it->second].representative == operand)
+			{
+				found = it->second;
+				break;
+			}
+		}
+
+		if (found == state.classes.size())
+		{
+			SubexpressionClass cls = { &operand, 0, nullptr, 0 };
+			state.classes.push_back(cls);
+			state.classesByHash.insert(std::make_pair(hash, found));
+		}
+
+		++state.classes[found].occurrences;
+		state.classOf[&operand] = found;
+	}
+
+	//Hashes operand the way Operand::Equals compares it, classifying every expression under it
+	//along the way. Returns the hash; leaves gets the pixel match count.
+	size_t Classify(const Operand &shared, SharingState &state, size_t &leaves)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			size_t leftLeaves = 0, rightLeaves = 0;
+			auto hash = HashCombine(1, static_cast<size_t>(exp->Operator()));
+			hash = HashCombine(hash, Classify(*exp->Left(), state, leftLeaves));
+			if (exp->Right())
+				hash = HashCombine(hash, Classify(*exp->Right(), state, rightLeaves));
+
+			leaves = leftLeaves + rightLeaves;
+			Register(operand, hash, leaves, state);
+			return hash;
+		}
+
+		if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+		{
+			auto hash = HashCombine(4, static_cast<size_t>(compound->Operator()));
+			leaves = 0;
+			for (size_t i = 0; i < compound->Count(); ++i)
+			{
+				size_t operandLeaves = 0;
+				hash = HashCombine(hash, Classify(*compound->Get(i), state, operandLeaves));
+				leaves += operandLeaves;
+			}
+
+			Register(operand, hash, leaves, state);
+			return hash;
+		}
+
+		leaves = 1;
+		auto match = dynamic_cast<const PixelMatch*>(&operand);
+		if (!match)
+			return 0;
+
+		auto hash = HashCombine(static_cast<size_t>(match->Offset().X()), static_cast<size_t>(match->Offset().Y()));
+		if (auto exact = dynamic_cast<const ExactPixelMatch*>(match))
+			return HashCombine(HashCombine(hash, 2), HashColor(exact->Color()));
+
+		if (auto range = dynamic_cast<const RangePixelMatch*>(match))
+			return HashCombine(HashCombine(HashCombine(hash, 3), HashColor(range->Min())), HashColor(range->Max()));
+
+		return hash;
+	}
+
+	//Heap copy of compound with clone applied to each of its operands
+	template <class CloneOperand>
+	Operand *CloneCompound(const CompoundExpression &compound, CloneOperand clone)
+	{
+		std::vector<std::unique_ptr<Operand>> copies;
+		for (size_t i = 0; i < compound.Count(); ++i)
+			copies.push_back(std::unique_ptr<Operand>(clone(*compound.Get(i))));
+
+		std::vector<Operand*> operands;
+		for (auto &copy : copies)
+			operands.push_back(copy.get());
+
+		auto copy = new CompoundExpression(compound.Operator(), operands);
+		for (auto &operand : copies)
+			operand.release();
+
+		return copy;
+	}
+
+	//Deep heap copy with any SharedOperands replaced by what they stand in for
+	Operand *CloneResolved(const Operand &shared)
+	{
+		auto &operand = shared.Resolve();
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			std::unique_ptr<Operand> left(CloneResolved(*exp->Left()));
+			std::unique_ptr<Operand> right(exp->Right() ? CloneResolved(*exp->Right()) : nullptr);
+			auto copy = new Expression(left.get(), exp->Operator(), right.get());
+			left.release();
+			right.release();
+			return copy;
+		}
+
+		if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+			return CloneCompound(*compound, [](const Operand &op) { return CloneResolved(op); });
+
+		return operand.Clone();
+	}
+
+	//Heap copy of operand with every shared class replaced by a SharedOperand. The root of a
+	//pattern is never replaced so the pattern keeps an Expression root.
+	Operand *CloneSharing(const Operand &shared, SharingState &state, bool isRoot,
+		std::vector<std::shared_ptr<const Operand>> &used, size_t &replaced)
+	{
+		auto &operand = shared.Resolve();
+
+		auto cls = state.classOf.find(&operand);
+		if (!isRoot && cls != state.classOf.end() && state.classes[cls->second].occurrences > 1)
+		{
+			//only classes that end up replacing something are copied, so nested ones that are
+			//always inside a bigger shared subexpression aren't
+			auto &sharedClass = state.classes[cls->second];
+			if (!sharedClass.shared)
+			{
+				sharedClass.shared.reset(CloneResolved(*sharedClass.representative));
+				sharedClass.slot = state.slots++;
+				++state.shared;
+			}
+
+			if (std::find(used.begin(), used.end(), sharedClass.shared) == used.end())
+				used.push_back(sharedClass.shared);
+
+			++replaced;
+			return new SharedOperand(sharedClass.shared.get(), sharedClass.slot);
+		}
+
+		if (auto exp = dynamic_cast<const Expression*>(&operand))
+		{
+			std::unique_ptr<Operand> left(CloneSharing(*exp->Left(), state, false, used, replaced));
+			std::unique_ptr<Operand> right(exp->Right() ? CloneSharing(*exp->Right(), state, false, used, replaced) : nullptr);
+			auto copy = new Expression(left.get(), exp->Operator(), right.get());
+			left.release();
+			right.release();
+			return copy;
+		}
+
+		if (auto compound = dynamic_cast<const CompoundExpression*>(&operand))
+			return CloneCompound(*compound, [&](const Operand &op) { return CloneSharing(op, state, false, used, replaced); });
+
+		return operand.Clone();
+	}
+}
+SharingReport Parser::ShareSubexpressions(size_t minLeaves)
+{
+	if (minLeaves < 2)
+		ThrowArgument("minLeaves must be >= 2");
+
+	SharingReport report;
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		SharingState state;
+		state.minLeaves = minLeaves;
+		state.slots = 0;
+		state.shared = 0;
+
+		for (auto &pattern : patterns)
+		{
+			size_t leaves;
+			Classify(*pattern.second->_root, state, leaves);
+		}
+
+		//every pattern is rebuilt as a copy, since frames may still be matching the set before, which
+		//also drops sharing that no longer applies. The old patterns are kept until the end because
+		//the classes' representatives live in them.
+		std::vector<std::shared_ptr<PixelPattern>> oldPatterns;
+
+		for (auto &pattern : patterns)
+		{
+			std::vector<std::shared_ptr<const Operand>> used;
+			std::unique_ptr<Operand> root(CloneSharing(*pattern.second->_root, state, true, used, report.replaced));
+
+			std::shared_ptr<PixelPattern> copy(new PixelPattern(*pattern.second));
+			std::unique_ptr<OperandArena> oldArena(copy->_arena);
+			copy->Compile(*root);
+			copy->_sharedOperands.swap(used);
+
+			oldPatterns.push_back(pattern.second);
+			pattern.second = copy;
+		}
+
+		report.shared = state.shared;
+	});
+
+	return report;
+}
+OptimizeReport Parser::Optimize()
+{
+	OptimizeReport total;
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		//optimized as copies, like LearnEvaluationOrder, since frames may still be matching the set before
+		for (auto &pattern : patterns)
+		{
+			std::shared_ptr<PixelPattern> copy(new PixelPattern(*pattern.second));
+			auto report = copy->Optimize();
+			pattern.second = copy;
+
+			total.nodesBefore += report.nodesBefore;
+			total.nodesAfter += report.nodesAfter;
+			total.merged += report.merged;
+			total.contradictions += report.contradictions;
+		}
+	});
+
+	return total;
+}
+void Parser::_AddLoaded(std::vector<std::unique_ptr<PixelPattern>> &loaded, std::vector<LoadError> &errors, LoadReport &report)
+{
+	//the whole load is published as one version
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		for (size_t i = 0; i < loaded.size(); ++i)
+		{
+			auto &pattern = loaded[i];
+			auto &error = errors[i];
+
+			if (!pattern)
+			{
+				report.errors.push_back(error);
+				continue;
+			}
+
+			if (pattern->ImageSize() != _imageSize)
+			{
+				error.code = ErrorCode::Argument;
+				error.message = format("pattern %1% is for %2%x%3% images", % pattern->Id() % pattern->ImageSize().Width() % pattern->ImageSize().Height());
+				report.errors.push_back(error);
+			}
+			else if (patterns.count(pattern->Id()) > 0)
+			{
+				error.code = ErrorCode::DuplicateKey;
+				error.message = format("pattern id %1% was already added", % pattern->Id());
+				report.errors.push_back(error);
+			}
+			else
+			{
+				auto id = pattern->Id();
+				patterns[id] = std::shared_ptr<PixelPattern>(pattern.release());
+				++report.loaded;
+			}
+		}
+	});
+}
+void Parser::RemovePattern(PatternId id)
+{
+	//the pattern is freed with the last snapshot still holding it
+	_EditPatterns([&](PatternMap &patterns) { patterns.erase(id); });
+}
+std::shared_ptr<const PixelPattern> Parser::GetPattern(PatternId id) const
+{
+	auto snapshot = Patterns();
+	PatternMap::const_iterator found = snapshot->patterns.find(id);
+	if (found != snapshot->patterns.end())
+		return found->second;
+	else
+		return nullptr;
+}
+PatternSnapshot Parser::Patterns() const
+{
+	return std::atomic_load(&_patterns);
+}
+void Parser::_EditPatterns(const std::function<void(PatternMap &patterns)> &edit)
+{
+	std::lock_guard<std::mutex> guard(_writeLock);
+
+	auto current = std::atomic_load(&_patterns);
+	std::shared_ptr<PatternSet> next(new PatternSet(*current));
+	edit(next->patterns);
+	_LinkPredicates(*next);
+	next->version = current->version + 1;
+
+	std::atomic_store(&_patterns, PatternSnapshot(next));
+}
+void Parser::_LinkPredicates(PatternSet &set)
+{
+	std::shared_ptr<PredicateTable> table;
+	auto link = [&](Operand &root)
+	{
+		ForEachOwnedLeaf<PixelMatch>(root, [&](PixelMatch &leaf)
+		{
+			if (leaf.Predicate() != PixelMatch::UNCLASSIFIED)
+				return;
+
+			//the published table may be in use, so predicates are added to a copy
+			if (!table)
+				table = set.predicates ? std::make_shared<PredicateTable>(*set.predicates) : std::make_shared<PredicateTable>();
+
+			if (auto exact = dynamic_cast<const ExactPixelMatch*>(&leaf))
+				leaf.Predicate(table->Add(exact->Color(), exact->Color()));
+			else if (auto range = dynamic_cast<const RangePixelMatch*>(&leaf))
+				leaf.Predicate(table->Add(range->Min(), range->Max()));
+		});
+	};
+
+	for (auto &pattern : set.patterns)
+	{
+		link(*pattern.second->_root);
+		for (auto &variant : pattern.second->_variants)
+			link(*variant.root);
+	}
+
+	if (table)
+		set.predicates = table;
+}
+void Parser::Match(const Bitmap &bmp, FrameResult &result) const
+{
+	_Match(Patterns(), bmp, result, nullptr);
+}
+void Parser::Match(const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> &ids) const
+{
+	_Match(Patterns(), bmp, result, &ids);
+}
+void Parser::Match(const PatternSnapshot &patterns, const Bitmap &bmp, FrameResult &result) const
+{
+	_Match(patterns, bmp, result, nullptr);
+}
+void Parser::Match(const PatternSnapshot &patterns, const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> &ids) const
+{
+	_Match(patterns, bmp, result, &ids);
+}
+void Parser::_Match(const PatternSnapshot &snapshot, const Bitmap &bmp, FrameResult &result, const std::vector<PatternId> *ids) const
+{
+	if (!snapshot)
+		ThrowArgument("patterns are required");
+
+	auto sz = bmp.Size();
+	if (sz != _imageSize)
+		ThrowLogic(format("invalid image size %1%/%2%", % sz.Width() % sz.Height()));
+
+	TraceScope trace("parse", "Parser::Match");
+	result.clear();
+
+	//only whole frames are cached; a subset's result is a different answer for the same key
+	bool cache = _resultCache && !ids;
+	if (cache && _resultCache->Find(bmp.Hash(), snapshot->version, result))
+		return;
+
+	FrameContext context(bmp);
+	if (_indexColors.load(std::memory_order_relaxed))
+		context.IndexColors();
+	if (_summarizeRows.load(std::memory_order_relaxed))
+		context.SummarizeRows();
+	if (_classifyPixels.load(std::memory_order_relaxed) && snapshot->predicates)
+		context.ClassifyPixels(*snapshot->predicates);
+
+	Point pt;
+	if (ids)
+	{
+		for (auto id : *ids)
+		{
+			auto pattern = snapshot->patterns.find(id);
+			if (pattern != snapshot->patterns.end() && pattern->second->Find(bmp, pt, &context))
+				result[id] = pt;
+		}
+	}
+	else
+	{
+		for (auto &pattern : snapshot->patterns)
+		{
+			if (pattern.second->Find(bmp, pt, &context))
+				result[pattern.first] = pt;
+		}
+	}
+
+	if (cache)
+		_resultCache->Add(bmp.Hash(), snapshot->version, result);
+
+	_AddStats(context);
+	_Profile(bmp, *snapshot);
+}
+void Parser::AddChangeListener(const ChangeCallback &callback)
+{
+	if (!callback)
+		ThrowArgument("callback is required");
+
+	_changeListeners.push_back(callback);
+}
+ChangeQueue &Parser::EnableChangeQueue(size_t capacity)
+{
+	if (capacity == 0)
+		ThrowArgument("capacity must be > 0");
+
+	if (_changeQueue)
+		delete _changeQueue;
+
+	_changeQueue = new ChangeQueue(capacity);
+	return *_changeQueue;
+}
+ResultCache &Parser::EnableResultCache(size_t capacity)
+{
+	auto cache = new ResultCache(capacity);
+	if (_resultCache)
+		delete _resultCache;
+
+	_resultCache = cache;
+	return *_resultCache;
+}
+void Parser::_Publish(const ChangeEvent &event)
+{
+	for (auto &listener : _changeListeners)
+		listener(event);
+
+	if (_changeQueue && !_changeQueue->Push(event))
+		_droppedChangeEvents.fetch_add(1, std::memory_order_relaxed);
+}
+void Parser::_Parse(const Bitmap &bmp, bool reset)
+{
+	++_frame;
+	TraceScope trace("parse", "Parser::Parse", _frame);
+	bool publish = _changeQueue || !_changeListeners.empty();
+	auto snapshot = Patterns();
+
+	//only reset frames are cached, as they don't depend on the frames before
+	bool cache = reset && _resultCache;
+	FrameResult cached;
+	bool hit = cache && _resultCache->Find(bmp.Hash(), snapshot->version, cached);
+
+	FrameContext context(bmp);
+	if (!hit)
+	{
+		if (_indexColors.load(std::memory_order_relaxed))
+			context.IndexColors();
+		if (_summarizeRows.load(std::memory_order_relaxed))
+			context.SummarizeRows();
+		if (_classifyPixels.load(std::memory_order_relaxed) && snapshot->predicates)
+			context.ClassifyPixels(*snapshot->predicates);
+	}
+
+	for (auto &pattern : snapshot->patterns)
+	{
+		auto &pp = pattern.second;
+
+		ChangeEvent event;
+		if (publish)
+		{
+			event.wasFound = pp->Found() != nullptr;
+			if (event.wasFound)
+				event.oldLocation = *pp->Found();
+		}
+
+		if (hit)
+		{
+			auto found = cached.find(pattern.first);
+			pp->_Restore(bmp, found != cached.end() ? &found->second : nullptr);
+		}
+		else
+		{
+			if (reset)
+				pp->Reset();
+
+			pp->Update(bmp, &context);
+		}
+
+		//compared with what was captured rather than Changed, which a Reset before Update makes
+		//compare with nothing
+		if (publish)
+		{
+			event.found = pp->Found() != nullptr;
+			if (event.found)
+				event.newLocation = *pp->Found();
+
+			if (event.found != event.wasFound || (event.found && event.newLocation != event.oldLocation))
+			{
+				event.id = pattern.first;
+				event.frame = _frame;
+				_Publish(event);
+			}
+		}
+	}
+
+	//a hit evaluated nothing, so like Match it's neither counted nor profiled
+	if (hit)
+		return;
+
+	if (cache)
+	{
+		for (auto &pattern : snapshot->patterns)
+		{
+			if (pattern.second->Found())
+				cached[pattern.first] = *pattern.second->Found();
+		}
+		_resultCache->Add(bmp.Hash(), snapshot->version, cached);
+	}
+
+	_AddStats(context);
+	_Profile(bmp, *snapshot);
+}
+StatsMap Parser::Stats() const
+{
+	std::lock_guard<std::mutex> guard(_statsLock);
+	return _stats;
+}
+StatsMap Parser::LastFrameStats() const
+{
+	std::lock_guard<std::mutex> guard(_statsLock);
+	return _lastFrameStats;
+}
+void Parser::ResetStats()
+{
+	std::lock_guard<std::mutex> guard(_statsLock);
+	_stats.clear();
+	_lastFrameStats.clear();
+}
+void Parser::_AddStats(const FrameContext &context) const
+{
+#ifdef IMGEXP_STATS
+	std::lock_guard<std::mutex> guard(_statsLock);
+	_lastFrameStats = context.Stats();
+	for (auto &pattern : _lastFrameStats)
+	{
+		pattern.second.frames = 1;
+		_stats[pattern.first] += pattern.second;
+	}
+#endif
+}
+void Parser::Profile(unsigned sampleEvery)
+{
+	_profileEvery.store(sampleEvery, std::memory_order_relaxed);
+}
+ProfileMap Parser::Profiles() const
+{
+	std::lock_guard<std::mutex> guard(_profileLock);
+	return _profiles;
+}
+void Parser::_Profile(const Bitmap &bmp, const PatternSet &patterns) const
+{
+	auto sampleEvery = _profileEvery.load(std::memory_order_relaxed);
+	if (sampleEvery == 0)
+		return;
+
+	TraceScope trace("parse", "Parser::Profile", _frame);
+	for (auto &pattern : patterns.patterns)
+	{
+		EvaluationProfile profile;
+		pattern.second->Sample(bmp, profile, sampleEvery);
+
+		std::lock_guard<std::mutex> guard(_profileLock);
+		_profiles[pattern.first] += profile;
+	}
+}
+size_t Parser::LearnEvaluationOrder(const std::string &directory)
+{
+	ProfileMap profiles;
+	{
+		std::lock_guard<std::mutex> guard(_profileLock);
+		profiles.swap(_profiles);
+	}
+
+	auto before = Patterns();
+	size_t learned = 0;
+	_EditPatterns([&](PatternMap &patterns)
+	{
+		for (auto &profile : profiles)
+		{
+			auto found = patterns.find(profile.first);
+			if (found == patterns.end())
+				continue;
+
+			//learns on a copy so frames still using the set before keep theirs
+			std::shared_ptr<PixelPattern> pattern(new PixelPattern(*found->second));
+			pattern->LearnEvaluationOrder(profile.second);
+			found->second = pattern;
+			++learned;
+		}
+	});
+
+	if (directory.empty())
+		return learned;
+
+	auto after = Patterns();
+	for (auto &findData : FindPatternFiles(directory))
+	{
+		auto file = directory + "\\" + findData.cFileName;
+
+		//only files still holding the pattern as it was before learning are rewritten
+		std::unique_ptr<PixelPattern> saved;
+		LoadError error;
+		if (!TryLoad(error, [&] { saved.reset(PixelPattern::FromFile(file)); }))
+			continue;
+
+		auto id = saved->Id();
+		if (!profiles.count(id) || !before->patterns.count(id) || !after->patterns.count(id))
+			continue;
+
+		if (*saved == *before->patterns.at(id))
+			WriteJsonToFile(file, *after->patterns.at(id));
 	}
+
+	return learned;
 }
 ///////////////////////////////////////////////////////////////////////////////
 //// SingleParser
@@ -1100,6 +5230,138 @@ void SingleParser::Parse(const Bitmap &bmp)
 {
 	Parser::_Parse(bmp, true);
 }
+void SingleParser::ParseBatch(const std::vector<const Bitmap*> &frames, const BatchCallback &callback,
+	unsigned threads, size_t maxInFlight) const
+{
+	_ParseBatch(frames.size(),
+		[&](size_t index) { return frames[index]; },
+		[](const Bitmap *) {},
+		callback, threads, maxInFlight);
+}
+void SingleParser::ParseBatch(const std::vector<std::string> &files, const BatchCallback &callback,
+	unsigned threads, size_t maxInFlight) const
+{
+	_ParseBatch(files.size(),
+		[&](size_t index) { return Bitmap::FromFile(files[index]); },
+		[](const Bitmap *bmp) { delete bmp; },
+		callback, threads, maxInFlight);
+}
+void SingleParser::_ParseBatch(size_t count, const FrameSource &acquire, const FrameRelease &release,
+	const BatchCallback &callback, unsigned threads, size_t maxInFlight) const
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	if (!maxInFlight)
+		maxInFlight = threads * 2;
+
+	//frames are claimed in order by whichever worker is free, but only delivered once every
+	//earlier frame has been. A frame counts as in flight from being claimed until delivered.
+	std::mutex lock;
+	std::condition_variable slotFree;
+	size_t nextFrame = 0;
+	size_t nextDelivery = 0;
+	bool delivering = false;
+	std::exception_ptr error;
+	std::map<size_t, std::pair<const Bitmap*, FrameResult>> parsed;
+
+	auto worker = [&]()
+	{
+		for (;;)
+		{
+			size_t index;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				{
+					TraceScope trace("wait", "ParseBatch::WaitForSlot");
+					slotFree.wait(guard, [&] { return error || nextFrame >= count || nextFrame < nextDelivery + maxInFlight; });
+				}
+
+				if (error || nextFrame >= count)
+					return;
+
+				index = nextFrame++;
+			}
+
+			const Bitmap *bmp = nullptr;
+			try
+			{
+				bmp = acquire(index);
+
+				FrameResult result;
+				Match(*bmp, result);
+
+				std::unique_lock<std::mutex> guard(lock);
+				parsed[index] = std::make_pair(bmp, std::move(result));
+				bmp = nullptr;
+
+				//another worker is already handing out results; it'll pick this one up
+				if (delivering)
+					continue;
+
+				delivering = true;
+				while (!error && !parsed.empty() && parsed.begin()->first == nextDelivery)
+				{
+					auto ready = parsed.begin();
+					auto delivered = ready->first;
+					auto frame = std::move(ready->second);
+					parsed.erase(ready);
+
+					guard.unlock();
+					try
+					{
+						TraceScope trace("parse", "ParseBatch::Deliver", delivered);
+						callback(delivered, *frame.first, frame.second);
+					}
+					catch (...)
+					{
+						release(frame.first);
+						throw;
+					}
+					release(frame.first);
+					guard.lock();
+
+					++nextDelivery;
+					slotFree.notify_all();
+				}
+				delivering = false;
+			}
+			catch (...)
+			{
+				if (bmp)
+					release(bmp);
+
+				std::lock_guard<std::mutex> guard(lock);
+				if (!error)
+					error = std::current_exception();
+
+				slotFree.notify_all();
+				return;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			Trace::NameThread("ParseBatch worker");
+			worker();
+			Trace::ReleaseThread();
+		}));
+	}
+
+	for (auto &t : workers)
+		t.join();
+
+	//only left over when a frame failed
+	for (auto &frame : parsed)
+		release(frame.second.first);
+
+	if (error)
+		std::rethrow_exception(error);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //// SeriesParser
@@ -1110,6 +5372,215 @@ void SeriesParser::Next(const Bitmap &bmp, bool reset)
 {
 	Parser::_Parse(bmp, reset);
 }
+bool SeriesParser::Next(FrameRing &ring, unsigned long timeout, bool reset)
+{
+	if (ring.FrameSize() != _imageSize)
+		ThrowArgument(format("the ring holds %1%x%2% frames", % ring.FrameSize().Width() % ring.FrameSize().Height()));
+
+	auto frame = ring.Read(timeout);
+	if (!frame)
+		return false;
+
+	try
+	{
+		Parser::_Parse(*frame, reset);
+	}
+	catch (...)
+	{
+		ring.Release();
+		throw;
+	}
+
+	ring.Release();
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//// PatternWatcher
+///////////////////////////////////////////////////////////////////////////////
+PatternWatcher::PatternWatcher(Parser &parser, const std::string &directory)
+: _parser(parser), _directory(directory), _stop(CreateEvent(nullptr, TRUE, FALSE, nullptr))
+{
+	if (!_stop)
+		ThrowLogic(format("CreateEvent failed with %1%", % GetLastError()));
+}
+PatternWatcher::~PatternWatcher()
+{
+	Stop();
+	CloseHandle(_stop);
+}
+LoadReport PatternWatcher::Sync(unsigned threads)
+{
+	std::lock_guard<std::mutex> guard(_syncLock);
+
+	//files whose time or size differ from the last Sync are reloaded; the rest are carried over
+	std::unordered_map<std::string, WatchedFile> next;
+	std::vector<std::string> changed;
+	for (auto &findData : FindPatternFiles(_directory))
+	{
+		auto file = _directory + "\\" + findData.cFileName;
+
+		WatchedFile state;
+		state.written = (static_cast<unsigned long long>(findData.ftLastWriteTime.dwHighDateTime) << 32) | findData.ftLastWriteTime.dwLowDateTime;
+		state.size = (static_cast<unsigned long long>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+		state.owns = false;
+		state.id = 0;
+
+		auto known = _files.find(file);
+		if (known != _files.end())
+		{
+			if (known->second.written == state.written && known->second.size == state.size)
+			{
+				next[file] = known->second;
+				continue;
+			}
+
+			state.owns = known->second.owns;
+			state.id = known->second.id;
+		}
+
+		next[file] = state;
+		changed.push_back(file);
+	}
+
+	bool removed = false;
+	for (auto &file : _files)
+		removed = removed || (file.second.owns && next.count(file.first) == 0);
+
+	LoadReport report;
+	if (changed.empty() && !removed)
+	{
+		_files.swap(next);
+		return report;
+	}
+
+	std::vector<std::unique_ptr<PixelPattern>> loaded(changed.size());
+	std::vector<LoadError> errors(changed.size());
+
+	ParallelFor(changed.size(), threads, [&](size_t index)
+	{
+		errors[index].file = changed[index];
+		TryLoad(errors[index], [&] { loaded[index].reset(PixelPattern::FromFile(changed[index])); });
+	});
+
+	_parser._EditPatterns([&](PatternMap &patterns)
+	{
+		//deleted files take their patterns with them
+		for (auto &file : _files)
+		{
+			if (file.second.owns && next.count(file.first) == 0)
+				patterns.erase(file.second.id);
+		}
+
+		for (size_t i = 0; i < changed.size(); ++i)
+		{
+			auto &pattern = loaded[i];
+			auto &error = errors[i];
+			auto &state = next[changed[i]];
+
+			if (!pattern)
+			{
+				report.errors.push_back(error);
+				continue;
+			}
+
+			auto id = pattern->Id();
+			auto existing = patterns.find(id);
+			bool ownsExisting = state.owns && state.id == id;
+
+			if (pattern->ImageSize() != _parser._imageSize)
+			{
+				error.code = ErrorCode::Argument;
+				error.message = format("pattern %1% is for %2%x%3% images", % id % pattern->ImageSize().Width() % pattern->ImageSize().Height());
+				report.errors.push_back(error);
+				continue;
+			}
+			else if (existing != patterns.end() && !ownsExisting)
+			{
+				error.code = ErrorCode::DuplicateKey;
+				error.message = format("pattern id %1% was already added", % id);
+				report.errors.push_back(error);
+				continue;
+			}
+
+			//the file now holds a different pattern
+			if (state.owns && !ownsExisting)
+				patterns.erase(state.id);
+
+			state.owns = true;
+			state.id = id;
+			++report.loaded;
+
+			if (existing == patterns.end() || *existing->second != *pattern)
+				patterns[id] = std::shared_ptr<PixelPattern>(pattern.release());
+		}
+	});
+
+	_files.swap(next);
+	return report;
+}
+void PatternWatcher::Start(const SyncCallback &callback)
+{
+	if (Running())
+		ThrowLogic("already started");
+
+	//watching starts before the first Sync so nothing written in between is missed
+	auto change = FindFirstChangeNotification(_directory.c_str(), FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+	if (change == INVALID_HANDLE_VALUE)
+		ThrowFileNotFound(_directory);
+
+	try
+	{
+		auto report = Sync();
+		if (callback)
+			callback(report);
+	}
+	catch (...)
+	{
+		FindCloseChangeNotification(change);
+		throw;
+	}
+
+	ResetEvent(_stop);
+	_thread = std::thread([this, change, callback]()
+	{
+		Trace::NameThread("PatternWatcher");
+		HANDLE handles[] = { _stop, change };
+		while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		{
+			//the directory itself going away is reported like a file that failed to load
+			LoadReport report;
+			LoadError error;
+			error.file = _directory;
+			if (!TryLoad(error, [&] { TraceScope trace("load", "PatternWatcher::Sync"); report = Sync(); }))
+				report.errors.push_back(error);
+
+			//an exception escaping would end the process, so the callback throwing is reported to it
+			//like a failed load, once, and watching carries on
+			if (callback && !TryLoad(error, [&] { callback(report); }))
+			{
+				LoadReport failed;
+				failed.errors.push_back(error);
+				TryLoad(error, [&] { callback(failed); });
+			}
+
+			if (!FindNextChangeNotification(change))
+				break;
+		}
+
+		FindCloseChangeNotification(change);
+		Trace::ReleaseThread();
+	});
+}
+void PatternWatcher::Stop()
+{
+	if (!Running())
+		return;
+
+	SetEvent(_stop);
+	_thread.join();
+}
 
 imgexp::Operator StringToOperator(const std::string &str)
 {
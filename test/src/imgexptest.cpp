@@ -4,6 +4,8 @@
 #include "imgexputil.h"
 #include <boost/filesystem.hpp>
 #include <map>
+#include <fstream>
+#include <thread>
 
 using namespace std;
 using namespace imgexp;
@@ -50,6 +52,18 @@ namespace imgexptest {
 	};
 	class PixelPatternTests : public ::testing::Test {
 	};
+	class ParserTests : public ::testing::Test {
+	};
+	class PatternBundleTests : public ::testing::Test {
+	};
+	class SingleParserTests : public ::testing::Test {
+	};
+	class SeriesParserTests : public ::testing::Test {
+	};
+	class PatternWatcherTests : public ::testing::Test {
+	};
+	class TraceTests : public ::testing::Test {
+	};
 	//=========================================================================
 	//== BitmapTests
 	//=========================================================================
@@ -101,9 +115,348 @@ namespace imgexptest {
 		EXPECT_EQ(*exp, *newExp);
 		delete exp;
 	}
+	TEST_F(ExpressionTests, DeletesLongChainsWithoutRecursing)
+	{
+		std::map<Point, PixelMatch*> pointMatches;
+		for (long i = 0; i < 200000; ++i)
+			pointMatches[Point(i % 1000, i / 1000)] = new ExactPixelMatch(Color(0xff, 0, 0));
+
+		delete BuildExpressionTree(pointMatches);
+	}
 	//=========================================================================
 	//== PixelPatternTests
 	//=========================================================================
+	TEST_F(PixelPatternTests, CompilesAndFindsLongChains)
+	{
+		//as deep as DeletesLongChainsWithoutRecursing, over a frame the chain covers exactly
+		const long width = 1000, height = 200;
+		std::map<Point, PixelMatch*> pointMatches;
+		for (long i = 0; i < width * height; ++i)
+			pointMatches[Point(i % width, i / width)] = new ExactPixelMatch(Color(0xff, 0, 0));
+
+		std::vector<Color> colors(width * height, Color(0xff, 0, 0));
+		BITMAPINFOHEADER info = { sizeof(BITMAPINFOHEADER), width, height, 1, 24 };
+		Bitmap frame(info, colors.data(), false);
+
+		PixelPattern pattern(Size(width, height), 1, BuildExpressionTree(pointMatches));
+		Point found;
+		ASSERT_TRUE(pattern.Find(frame, found));
+		EXPECT_EQ(Point(0, 0), found);
+	}
+	TEST_F(PixelPatternTests, CompilesItsOperandsIntoOneArenaBlock)
+	{
+		std::map<Point, PixelMatch*> pointMatches = {
+			{ Point(0, 0), new ExactPixelMatch(Color(0xff, 0, 0)) },
+			{ Point(1, 0), new RangePixelMatch(Color(0, 0, 0), Color(9, 9, 9)) },
+			{ Point(0, 1), new ExactPixelMatch(Color(0, 0xff, 0)) },
+		};
+
+		auto root = BuildExpressionTree(pointMatches);
+		auto copy = static_cast<Expression*>(root->Clone());
+
+		OperandArena arena(root->ArenaSize());
+		auto compiled = root->Clone(&arena);
+
+		EXPECT_EQ(1u, arena.Blocks());
+		EXPECT_EQ(root->ArenaSize(), arena.Used());
+		EXPECT_EQ(*root, *compiled);
+		//evaluation order: the root comes first, immediately followed by its left operand
+		auto left = static_cast<Expression*>(compiled)->Left();
+		EXPECT_EQ(reinterpret_cast<char*>(compiled) + OperandArena::Align(sizeof(Expression)), reinterpret_cast<char*>(left));
+		delete root;
+
+		PixelPattern pattern(Size(5, 5), 1, copy);
+		PixelPattern patternCopy(pattern);
+		EXPECT_EQ(pattern, patternCopy);
+	}
+	TEST_F(ExpressionTests, OptimizeFlattensChainsAndMergesTestsOnTheSamePixel)
+	{
+		std::map<Point, PixelMatch*> pointMatches = {
+			{ Point(0, 0), new ExactPixelMatch(Color(0xff, 0, 0)) },
+			{ Point(1, 0), new RangePixelMatch(Color(0, 0, 0), Color(100, 100, 100)) },
+			{ Point(2, 0), new ExactPixelMatch(Color(0, 0xff, 0)) },
+		};
+		std::unique_ptr<Expression> chain(BuildExpressionTree(pointMatches));
+
+		auto narrower = new RangePixelMatch(Color(50, 50, 50), Color(200, 200, 200));
+		narrower->Offset(Point(1, 0));
+		Expression root(chain->Clone(), imgexp::Operator::AND, new Expression(narrower));
+
+		OptimizeReport report;
+		std::unique_ptr<Operand> optimized(Optimize(root, report));
+
+		EXPECT_EQ(9u, report.nodesBefore);
+		EXPECT_EQ(4u, report.nodesAfter);
+		EXPECT_EQ(1u, report.merged);
+		EXPECT_EQ(0u, report.contradictions);
+
+		auto compound = dynamic_cast<CompoundExpression*>(optimized.get());
+		ASSERT_NE(nullptr, compound);
+		EXPECT_EQ(imgexp::Operator::AND, compound->Operator());
+		ASSERT_EQ(3u, compound->Count());
+		auto intersection = dynamic_cast<RangePixelMatch*>(compound->Get(1));
+		ASSERT_NE(nullptr, intersection);
+		EXPECT_EQ(Color(50, 50, 50), intersection->Min());
+		EXPECT_EQ(Color(100, 100, 100), intersection->Max());
+
+		auto other = new ExactPixelMatch(Color(0, 0, 0xff));
+		Expression contradiction(chain->Clone(), imgexp::Operator::AND, other);
+
+		std::unique_ptr<Operand> never(Optimize(contradiction, report));
+		EXPECT_EQ(1u, report.contradictions);
+		EXPECT_EQ(1u, report.nodesAfter);
+	}
+	TEST_F(ExpressionTests, RangePixelMatchClassifiesColorsAsItComparesThem)
+	{
+		ColorClassifier classifier;
+		RangePixelMatch compared(Color(0x10, 0x20, 0x30), Color(0x80, 0x20, 0xff));
+		RangePixelMatch classified(compared.Min(), compared.Max());
+		classified.Classify(&classifier);
+		RangePixelMatch same(compared.Min(), compared.Max());
+		same.Classify(&classifier);
+		RangePixelMatch empty(Color(0xff, 0, 0), Color(0, 0, 0));
+		empty.Classify(&classifier);
+		EXPECT_EQ(2u, classifier.Count());
+
+		BYTE values[] = { 0, 0x0f, 0x10, 0x20, 0x21, 0x30, 0x80, 0x81, 0xff };
+		for (auto red : values)
+		{
+			for (auto green : values)
+			{
+				for (auto blue : values)
+				{
+					Color color(red, green, blue);
+					BITMAPINFOHEADER info = { sizeof(BITMAPINFOHEADER), 1, 1, 1, 24 };
+					Bitmap pixel(info, &color, false);
+					EXPECT_EQ(compared.Eval(pixel, Point(0, 0)), classified.Eval(pixel, Point(0, 0)));
+					EXPECT_EQ(compared.Eval(pixel, Point(0, 0)), same.Eval(pixel, Point(0, 0)));
+					EXPECT_FALSE(empty.Eval(pixel, Point(0, 0)));
+				}
+			}
+		}
+
+		for (unsigned i = 2; i < ColorClassifier::CAPACITY; ++i)
+			EXPECT_NE(0u, classifier.Add(Color(i, 0, 0), Color(i, 0, 0)));
+		EXPECT_EQ(0u, classifier.Add(Color(0xff, 0xff, 0xff), Color(0xff, 0xff, 0xff)));
+	}
+	TEST_F(PixelPatternTests, FindAllFindsEveryAnchorTheExpressionMatchesAt)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0x10, 0x10, 0x10));
+		pointMatches[Point(6, 5)] = new ExactPixelMatch(Color(0, 0xff, 0xff));
+		auto root = new Expression(BuildExpressionTree(pointMatches), imgexp::Operator::OR, new ExactPixelMatch(Color(0xff, 0, 0)));
+		std::unique_ptr<Operand> reference(root->Clone());
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, root, new std::vector<Area>(1, Area(0, 0, 1000, 700))));
+		auto &pattern = *parser.Patterns()->patterns.at(1);
+
+		//anchor by anchor over the search area, where every pixel match is on the frame
+		std::vector<Point> expected;
+		for (long y = 0; y <= 700; ++y)
+		{
+			for (long x = 0; x <= 1000; ++x)
+			{
+				if (reference->Eval(*image, Point(x, y)))
+					expected.push_back(Point(x, y));
+			}
+		}
+		ASSERT_FALSE(expected.empty());
+
+		std::vector<Point> found;
+		pattern.FindAll(*image, found);
+		EXPECT_EQ(expected, found);
+
+		FrameContext context(*image);
+		context.ClassifyPixels(*parser.Patterns()->predicates);
+		std::vector<Point> classified;
+		pattern.FindAll(*image, classified, &context);
+		EXPECT_EQ(found, classified);
+		delete image;
+	}
+	TEST_F(PixelPatternTests, FindAllFoldsLongChainsOfPixelMatches)
+	{
+		//a chain thousands of leaves deep, as BuildExpressionTree nests them, on a black frame with
+		//one white pixel
+		const long size = 64;
+		std::vector<Color> colors(size * size, Color(0, 0, 0));
+		colors[(size - 1 - 20) * size + 20] = Color(0xff, 0xff, 0xff);
+		BITMAPINFOHEADER info = { sizeof(BITMAPINFOHEADER), size, size, 1, 24 };
+		Bitmap frame(info, colors.data(), false);
+
+		Operand *chain = new ExactPixelMatch(Color(0, 0, 0));
+		for (long i = 1; i < 3000; ++i)
+		{
+			auto leaf = new ExactPixelMatch(Color(0, 0, 0));
+			leaf->Offset(Point(i % 8, i / 8 % 8));
+			chain = new Expression(leaf, imgexp::Operator::AND, chain);
+		}
+		std::unique_ptr<Operand> reference(chain->Clone());
+		PixelPattern pattern(Size(size, size), 1, new Expression(chain), new std::vector<Area>(1, Area(0, 0, 56, 56)));
+
+		std::vector<Point> expected;
+		for (long y = 0; y <= 56; ++y)
+		{
+			for (long x = 0; x <= 56; ++x)
+			{
+				if (reference->Eval(frame, Point(x, y)))
+					expected.push_back(Point(x, y));
+			}
+		}
+		ASSERT_EQ(57u * 57u - 64u, expected.size());
+
+		std::vector<Point> found;
+		pattern.FindAll(frame, found);
+		EXPECT_EQ(expected, found);
+	}
+	TEST_F(PixelPatternTests, FindsTransformedVariantsInTheSameScan)
+	{
+		//an upright L, with its corner dark, drawn on its side at 10, 5
+		const long width = 32, height = 16;
+		Color white(0xff, 0xff, 0xff), black(0, 0, 0);
+		std::vector<Color> colors(width * height, black);
+		Point drawn[] = { Point(10, 5), Point(11, 5), Point(12, 5), Point(10, 6) };
+		for (auto &pt : drawn)
+			colors[(height - 1 - pt.Y()) * width + pt.X()] = white;
+		BITMAPINFOHEADER info = { sizeof(BITMAPINFOHEADER), width, height, 1, 24 };
+		Bitmap frame(info, colors.data(), false);
+
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new ExactPixelMatch(white);
+		pointMatches[Point(0, 1)] = new ExactPixelMatch(white);
+		pointMatches[Point(0, 2)] = new ExactPixelMatch(white);
+		pointMatches[Point(1, 2)] = new ExactPixelMatch(white);
+		pointMatches[Point(1, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0x10, 0x10, 0x10));
+		PixelPattern pattern(Size(width, height), 1, BuildExpressionTree(pointMatches), new std::vector<Area>(1, Area(0, 0, 28, 12)));
+
+		Point found;
+		Transform variant;
+		EXPECT_FALSE(pattern.Find(frame, found, variant));
+
+		pattern.Transforms({ Transform::MIRROR_X, Transform::NONE, Transform::ROTATE_90, Transform::MIRROR_X });
+		ASSERT_EQ(2u, pattern.Transforms().size());
+		ASSERT_TRUE(pattern.Find(frame, found, variant));
+		EXPECT_EQ(Point(10, 5), found);
+		EXPECT_EQ(Transform::ROTATE_90, variant);
+
+		//through the color index and past rows without the colors
+		FrameContext indexed(frame);
+		indexed.IndexColors();
+		ASSERT_TRUE(pattern.Find(frame, found, variant, &indexed));
+		EXPECT_EQ(Point(10, 5), found);
+		EXPECT_EQ(Transform::ROTATE_90, variant);
+		FrameContext summarized(frame);
+		summarized.SummarizeRows();
+		ASSERT_TRUE(pattern.Find(frame, found, variant, &summarized));
+		EXPECT_EQ(Point(10, 5), found);
+		EXPECT_EQ(Transform::ROTATE_90, variant);
+
+		std::vector<Point> all;
+		pattern.FindAll(frame, all);
+		EXPECT_EQ(std::vector<Point>(1, Point(10, 5)), all);
+
+		pattern.Update(frame);
+		ASSERT_TRUE(pattern.Found() != nullptr);
+		EXPECT_EQ(Transform::ROTATE_90, pattern.FoundVariant());
+		pattern.Update(frame);
+		EXPECT_FALSE(pattern.Changed());
+		EXPECT_EQ(Transform::ROTATE_90, pattern.FoundVariant());
+
+		Json::Value value = pattern;
+		PixelPattern reloaded(value);
+		EXPECT_TRUE(reloaded == pattern);
+		PixelPattern copy(pattern);
+		ASSERT_TRUE(copy.Find(frame, found, variant));
+		EXPECT_EQ(Transform::ROTATE_90, variant);
+
+		//patches turn with the rest of the pattern
+		Color upright[] = { white, black, white, black, white, white };
+		PixelPattern patch(Size(width, height), 2, new Expression(new BitmapPatchMatch(2, 3, upright)));
+		EXPECT_FALSE(patch.Find(frame, found, variant));
+		patch.Transforms({ Transform::ROTATE_90 });
+		ASSERT_TRUE(patch.Find(frame, found, variant));
+		EXPECT_EQ(Point(10, 5), found);
+		EXPECT_EQ(Transform::ROTATE_90, variant);
+	}
+	TEST_F(ExpressionTests, BitmapPatchMatchFindsItsPatchAndSavesAndReloadsTheSame)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		//the first blip in the middle of what's around it
+		BitmapPatchMatch patch(*image, Area(196, 22, 200, 26));
+		patch.Offset(Point(2, 2));
+		PixelPattern whole(Size(1024, 768), 1, new Expression(patch.Clone()));
+		Point found;
+		ASSERT_TRUE(whole.Find(*image, found));
+		EXPECT_EQ(Point(194, 20), found);
+
+		//a different corner, left out of the comparison
+		std::vector<Color> pixels;
+		std::vector<BYTE> mask;
+		for (long y = 0; y < 5; ++y)
+		{
+			for (long x = 0; x < 5; ++x)
+			{
+				bool corner = x == 4 && y == 0;
+				pixels.push_back(corner ? Color(1, 2, 3) : patch.Pixel(x, y));
+				mask.push_back(!corner);
+			}
+		}
+		BitmapPatchMatch masked(5, 5, pixels.data(), mask.data());
+		EXPECT_FALSE(masked.Masked(4, 0));
+		EXPECT_TRUE(masked.Masked(2, 2));
+		PixelPattern maskedPattern(Size(1024, 768), 2, new Expression(masked.Clone()));
+		ASSERT_TRUE(maskedPattern.Find(*image, found));
+		EXPECT_EQ(Point(196, 22), found);
+
+		PixelPattern unmasked(Size(1024, 768), 3, new Expression(new BitmapPatchMatch(5, 5, pixels.data())));
+		EXPECT_FALSE(unmasked.Find(*image, found));
+
+		Json::Value value = masked;
+		BitmapPatchMatch reloaded(value);
+		EXPECT_TRUE(reloaded == masked);
+		EXPECT_FALSE(reloaded == patch);
+
+		PixelPattern copy(maskedPattern);
+		EXPECT_TRUE(copy == maskedPattern);
+		delete image;
+	}
+	TEST_F(ExpressionTests, FuzzyPatchMatchMatchesWithinItsDistance)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		//rows long enough to take a 16 byte block and a remainder, with the blip off by 3, 2 and 1
+		BitmapPatchMatch exact(*image, Area(194, 23, 203, 25));
+		std::vector<Color> pixels;
+		for (long y = 0; y < exact.Height(); ++y)
+		{
+			for (long x = 0; x < exact.Width(); ++x)
+				pixels.push_back(x == 4 && y == 1 ? Color(3, 253, 254) : exact.Pixel(x, y));
+		}
+		BitmapPatchMatch noisy(exact.Width(), exact.Height(), pixels.data());
+
+		FuzzyPatchMatch sad(noisy, 6);
+		FuzzyPatchMatch ssd(noisy, 13, PatchDistance::SSD);
+		EXPECT_EQ(6u, sad.DistanceAt(*image, Point(194, 23), 1000));
+		EXPECT_EQ(14u, ssd.DistanceAt(*image, Point(194, 23), 1000));
+		EXPECT_TRUE(sad.Eval(*image, Point(194, 23)));
+		EXPECT_FALSE(ssd.Eval(*image, Point(194, 23)));
+		EXPECT_FALSE(noisy.Eval(*image, Point(194, 23)));
+		EXPECT_FALSE(sad.Eval(*image, Point(1020, 23)));
+
+		PixelPattern pattern(Size(1024, 768), 1, new Expression(sad.Clone()));
+		Point found;
+		ASSERT_TRUE(pattern.Find(*image, found));
+		EXPECT_EQ(Point(194, 23), found);
+
+		Json::Value value = ssd;
+		FuzzyPatchMatch reloaded(value);
+		EXPECT_TRUE(reloaded == ssd);
+		EXPECT_FALSE(reloaded == sad);
+		EXPECT_FALSE(reloaded == noisy);
+		delete image;
+	}
 	TEST_F(PixelPatternTests, SavesAndReloadsTheSame)
 	{
 		PixelPattern pp(Size(5, 5), 1, new Expression(new ExactPixelMatch(Color(0xff, 0, 0))));
@@ -138,6 +491,15 @@ namespace imgexptest {
 		pattern.Update(*image);
 
 		EXPECT_EQ(Point(198, 24), *pattern.Found());
+
+		PixelPattern optimized(pattern);
+		optimized.Optimize();
+		optimized.Reset();
+		optimized.Update(*image);
+
+		ASSERT_NE(nullptr, optimized.Found());
+		EXPECT_EQ(Point(198, 24), *optimized.Found());
+		delete image;
 	}
 	TEST_F(PixelPatternTests, RangePixelMatchDoesNotFindAllBlipsDueToOffPoint)
 	{
@@ -208,5 +570,756 @@ namespace imgexptest {
 
 		EXPECT_EQ(nullptr, pattern.Found());
 	}
-}
+	//=========================================================================
+	//== ParserTests
+	//=========================================================================
+	TEST_F(ParserTests, LoadDirectoryAddsValidPatternsAndReportsTheRest)
+	{
+		auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		boost::filesystem::create_directory(dir);
+
+		auto write = [&](const std::string &name, const Json::Value &value)
+		{
+			Json::StyledWriter writer;
+			ofstream output((dir / name).c_str(), ios_base::trunc);
+			output << writer.write(value);
+		};
+
+		write("a.pattern", PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))));
+		write("b.pattern", PixelPattern(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0, 0xff, 0)))));
+		write("c.pattern", PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0, 0xff)))));
+		write("d.pattern", PixelPattern(Size(640, 480), 3, new Expression(new ExactPixelMatch(Color(0, 0, 0xff)))));
+		write("e.pattern", Json::Value("not a pattern"));
+		write("ignored.txt", Json::Value("not a pattern either"));
+
+		SingleParser parser(Size(1024, 768));
+		auto report = parser.LoadDirectory(dir.generic_string(), 2);
+
+		EXPECT_EQ(2u, report.loaded);
+		ASSERT_EQ(3u, report.errors.size());
+		EXPECT_EQ(ErrorCode::DuplicateKey, report.errors[0].code);
+		EXPECT_NE(std::string::npos, report.errors[0].file.find("c.pattern"));
+		EXPECT_EQ(ErrorCode::Argument, report.errors[1].code);
+		EXPECT_NE(std::string::npos, report.errors[2].file.find("e.pattern"));
+
+		ASSERT_NE(nullptr, parser.GetPattern(1));
+		EXPECT_EQ(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))), *parser.GetPattern(1));
+		EXPECT_NE(nullptr, parser.GetPattern(2));
+
+		boost::filesystem::remove_all(dir);
+	}
+	TEST_F(ParserTests, SharedSubexpressionsMatchTheSameAsUnshared)
+	{
+		Color c(0, 0xff, 0xff);
+		auto blips = [&](PixelMatch *first)
+		{
+			std::map<Point, PixelMatch*> pointMatches = {
+				{ Point(198, 24), first },
+				{ Point(204, 29), new ExactPixelMatch(c) },
+				{ Point(196, 31), new ExactPixelMatch(c) },
+				{ Point(204, 33), new ExactPixelMatch(c) },
+				{ Point(197, 39), new ExactPixelMatch(c) },
+				{ Point(206, 41), new ExactPixelMatch(c) },
+			};
+			return BuildExpressionTree(pointMatches);
+		};
+
+		PixelPattern exact(Size(1024, 768), 1, blips(new ExactPixelMatch(c)));
+		PixelPattern range(Size(1024, 768), 2, blips(new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff))));
+
+		SeriesParser parser(Size(1024, 768));
+		parser.AddPattern(exact);
+		parser.AddPattern(range);
+
+		auto before = parser.Patterns();
+		auto report = parser.ShareSubexpressions(4);
+		EXPECT_EQ(1u, report.shared);
+		EXPECT_EQ(2u, report.replaced);
+		EXPECT_NE(before->patterns.at(1).get(), parser.GetPattern(1).get());
+		EXPECT_EQ(exact, *before->patterns.at(1));
+		EXPECT_EQ(exact, *parser.GetPattern(1));
+		EXPECT_EQ(range, *parser.GetPattern(2));
+
+		before = parser.Patterns();
+		parser.Optimize();
+		EXPECT_NE(before->patterns.at(2).get(), parser.GetPattern(2).get());
+		EXPECT_EQ(range, *before->patterns.at(2));
+
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		parser.Next(*image);
+		ASSERT_NE(nullptr, parser.GetPattern(1)->Found());
+		ASSERT_NE(nullptr, parser.GetPattern(2)->Found());
+		EXPECT_EQ(Point(198, 24), *parser.GetPattern(1)->Found());
+		EXPECT_EQ(Point(198, 24), *parser.GetPattern(2)->Found());
+		delete image;
+	}
+	TEST_F(ParserTests, AddsAndRemovesPatternsWhileFramesAreParsed)
+	{
+		Color c(0, 0xff, 0xff);
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(c))));
+		FrameResult expected;
+		parser.Match(*image, expected);
+		ASSERT_EQ(1u, expected.count(1));
+
+		std::atomic<bool> done(false);
+		std::atomic<size_t> frames(0);
+		bool consistent = true;
+		std::thread parsing([&]
+		{
+			FrameResult result;
+			while (!done || frames.load() == 0)
+			{
+				parser.Match(*image, result);
+				consistent = consistent && result.count(1) == 1 && result[1] == expected[1];
+				++frames;
+			}
+		});
+
+		auto version = parser.Version();
+		for (int i = 0; i < 100; ++i)
+		{
+			parser.AddPattern(PixelPattern(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))));
+			parser.RemovePattern(2);
+		}
+		done = true;
+		parsing.join();
+
+		EXPECT_TRUE(consistent);
+		EXPECT_EQ(version + 200, parser.Version());
+
+		auto removed = parser.GetPattern(1);
+		parser.RemovePattern(1);
+		EXPECT_EQ(nullptr, parser.GetPattern(1));
+		ASSERT_NE(nullptr, removed);
+		EXPECT_EQ(1u, removed->Id());
+		delete image;
+	}
+	TEST_F(ParserTests, MatchesJustTheRequestedPatterns)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 2, new Expression(new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff)))));
+
+		FrameResult result;
+		parser.Match(*image, result, std::vector<PatternId>(1, 2));
+		ASSERT_EQ(1u, result.size());
+		EXPECT_EQ(Point(0, 0), result[2]);
+
+		//unknown ids are skipped
+		parser.Match(*image, result, std::vector<PatternId>{ 9, 1 });
+		ASSERT_EQ(1u, result.size());
+		EXPECT_EQ(Point(198, 24), result[1]);
+
+		parser.Match(*image, result, std::vector<PatternId>());
+		EXPECT_TRUE(result.empty());
+
+		//an older set still matches as it was
+		auto patterns = parser.Patterns();
+		parser.RemovePattern(1);
+		parser.Match(patterns, *image, result);
+		EXPECT_EQ(2u, result.size());
+		parser.Match(patterns, *image, result, std::vector<PatternId>(1, 1));
+		ASSERT_EQ(1u, result.size());
+		EXPECT_EQ(Point(198, 24), result[1]);
+		parser.Match(*image, result);
+		EXPECT_EQ(1u, result.size());
+		delete image;
+	}
+	TEST_F(ParserTests, FindsTheSameMatchesThroughTheColorIndex)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		//anchored away from its exact leaf
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff));
+		pointMatches[Point(6, 5)] = new ExactPixelMatch(Color(0, 0xff, 0xff));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 2, BuildExpressionTree(pointMatches)));
+		//searching past the first blip
+		parser.AddPattern(PixelPattern(Size(1024, 768), 3, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff))),
+			new std::vector<Area>(1, Area(0, 25, 1023, 767))));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 4, new Expression(new ExactPixelMatch(Color(1, 2, 3)))));
+		//no exact leaves, so it scans
+		parser.AddPattern(PixelPattern(Size(1024, 768), 5, new Expression(new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff)))));
+
+		FrameResult scanned;
+		parser.Match(*image, scanned);
+
+		parser.IndexColors(true);
+		FrameResult indexed;
+		parser.Match(*image, indexed);
+
+		EXPECT_EQ(scanned, indexed);
+		EXPECT_EQ(Point(198, 24), indexed[1]);
+		EXPECT_EQ(Point(192, 19), indexed[2]);
+		EXPECT_EQ(4u, indexed.size());
+		EXPECT_EQ(0u, indexed.count(4));
+		delete image;
+	}
+	TEST_F(ParserTests, FindsTheSameMatchesSkippingRowsByTheirColors)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		//its exact leaf rows below its anchor
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff));
+		pointMatches[Point(6, 5)] = new ExactPixelMatch(Color(0, 0xff, 0xff));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, BuildExpressionTree(pointMatches)));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 2, new Expression(new RangePixelMatch(Color(0, 0xf0, 0xf0), Color(0x10, 0xff, 0xff))),
+			new std::vector<Area>(1, Area(0, 25, 1023, 767))));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 3, new Expression(new RangePixelMatch(Color(0x80, 0, 0), Color(0xff, 0x10, 0x10)))));
+		//an empty range never matches
+		parser.AddPattern(PixelPattern(Size(1024, 768), 4, new Expression(new RangePixelMatch(Color(0xff, 0, 0), Color(0, 0, 0)))));
+
+		FrameResult scanned;
+		parser.Match(*image, scanned);
+
+		parser.SummarizeRows(true);
+		FrameResult summarized;
+		parser.Match(*image, summarized);
+
+		EXPECT_EQ(scanned, summarized);
+		EXPECT_EQ(Point(192, 19), summarized[1]);
+		EXPECT_EQ(0u, summarized.count(4));
+		delete image;
+	}
+	TEST_F(ParserTests, FindsTheSameMatchesFromClassifiedPixels)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		//more than one classifier's worth of predicates
+		for (PatternId id = 0; id < 70; ++id)
+			parser.AddPattern(PixelPattern(Size(1024, 768), id, new Expression(new ExactPixelMatch(Color(static_cast<BYTE>(id), 0, 0)))));
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff));
+		pointMatches[Point(6, 5)] = new ExactPixelMatch(Color(0, 0xff, 0xff));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 100, BuildExpressionTree(pointMatches)));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 101, new Expression(new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff))),
+			new std::vector<Area>(1, Area(0, 25, 1023, 767))));
+		EXPECT_EQ(72u, parser.Patterns()->predicates->Count());
+
+		FrameResult scanned;
+		parser.Match(*image, scanned);
+
+		parser.ClassifyPixels(true);
+		FrameResult classified;
+		parser.Match(*image, classified);
+
+		EXPECT_EQ(scanned, classified);
+		EXPECT_EQ(Point(192, 19), classified[100]);
+		EXPECT_EQ(Point(0, 25), classified[101]);
+		delete image;
+	}
+	TEST_F(ParserTests, LearnsAnEvaluationOrderAndSavesItWithThePattern)
+	{
+		auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		boost::filesystem::create_directory(dir);
+
+		//declared as 0,0 then 1,0 then 6,5: only the last one ever fails
+		std::map<Point, PixelMatch*> pointMatches;
+		pointMatches[Point(0, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff));
+		pointMatches[Point(1, 0)] = new RangePixelMatch(Color(0, 0, 0), Color(0xff, 0xff, 0xff));
+		pointMatches[Point(6, 5)] = new ExactPixelMatch(Color(0, 0xff, 0xff));
+		PixelPattern declared(Size(1024, 768), 1, BuildExpressionTree(pointMatches), new std::vector<Area>(1, Area(0, 0, 1000, 700)));
+		{
+			Json::StyledWriter writer;
+			ofstream output((dir / "a.pattern").c_str(), ios_base::trunc);
+			output << writer.write(declared);
+		}
+
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		Point expected;
+		ASSERT_TRUE(declared.Find(*image, expected));
+
+		SingleParser parser(Size(1024, 768));
+		EXPECT_EQ(1u, parser.LoadDirectory(dir.generic_string()).loaded);
+		parser.Profile(16);
+		parser.Parse(*image);
+		parser.Parse(*image);
+
+		auto profile = parser.Profiles()[1];
+		ASSERT_EQ(3u, profile.failures.size());
+		EXPECT_LT(0u, profile.anchors);
+		EXPECT_EQ(0u, profile.failures[0]);
+		EXPECT_EQ(0u, profile.failures[1]);
+		EXPECT_LT(0u, profile.failures[2]);
+
+		EXPECT_EQ(1u, parser.LearnEvaluationOrder(dir.generic_string()));
+		EXPECT_TRUE(parser.Profiles().empty());
+		std::vector<unsigned> order = { 2, 0, 1 };
+		EXPECT_EQ(order, parser.GetPattern(1)->EvaluationOrder());
+
+		FrameResult result;
+		parser.Match(*image, result);
+		EXPECT_EQ(expected, result[1]);
+
+		//the rewritten file keeps the root as declared, loads in the learned order, and saves back the same
+		EXPECT_EQ(static_cast<Json::Value>(declared)["root"], ParseJsonFromFile((dir / "a.pattern").generic_string())["root"]);
+		std::unique_ptr<PixelPattern> reloaded(PixelPattern::FromFile((dir / "a.pattern").generic_string()));
+		EXPECT_EQ(order, reloaded->EvaluationOrder());
+		EXPECT_EQ(profile.anchors, reloaded->Profile().anchors);
+		EXPECT_EQ(*parser.GetPattern(1), *reloaded);
+		EXPECT_EQ(*reloaded, PixelPattern(static_cast<Json::Value>(*reloaded)));
+
+		delete image;
+		boost::filesystem::remove_all(dir);
+	}
+	//=========================================================================
+	//== PatternBundleTests
+	//=========================================================================
+	TEST_F(PatternBundleTests, ConvertsPatternFilesAndLoadsThemBackTheSame)
+	{
+		std::map<Point, PixelMatch*> pointMatches = {
+			{ Point(198, 24), new ExactPixelMatch(Color(0, 0xff, 0xff)) },
+			{ Point(204, 29), new RangePixelMatch(Color(1, 1, 1), Color(150, 150, 150)) },
+			{ Point(196, 31), new ExactPixelMatch(Color(0, 0xff, 0xff)) },
+		};
+
+		std::vector<Area> *searchAreas = new std::vector<Area>{ Area(0, 0, 300, 100) };
+		PixelPattern first(Size(1024, 768), 1, BuildExpressionTree(pointMatches), searchAreas);
+		PixelPattern second(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0xff, 0, 0))));
+		first.Optimize();
+
+		std::vector<std::string> patternFiles = { WriteJsonToTempFile(first), WriteJsonToTempFile(second) };
+		auto bundleFile = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).generic_string();
+		PatternBundle::Convert(patternFiles, bundleFile);
+
+		{
+			PatternBundle bundle(bundleFile);
+			ASSERT_EQ(2u, bundle.Count());
+			EXPECT_EQ(1u, bundle.Id(0));
+			EXPECT_EQ(2u, bundle.Id(1));
+
+			std::unique_ptr<PixelPattern> loadedFirst(bundle.Load(0));
+			std::unique_ptr<PixelPattern> loadedSecond(bundle.Load(1));
+			EXPECT_EQ(first, *loadedFirst);
+			EXPECT_EQ(second, *loadedSecond);
+		}
+
+		for (auto &file : patternFiles)
+			DeleteFile(file.c_str());
+		DeleteFile(bundleFile.c_str());
+	}
+	TEST_F(PatternBundleTests, BundlesAndLoadsLongChains)
+	{
+		const long width = 1000, height = 200;
+		std::map<Point, PixelMatch*> pointMatches;
+		for (long i = 0; i < width * height; ++i)
+			pointMatches[Point(i % width, i / width)] = new ExactPixelMatch(Color(0xff, 0, 0));
+
+		std::vector<Color> colors(width * height, Color(0xff, 0, 0));
+		BITMAPINFOHEADER info = { sizeof(BITMAPINFOHEADER), width, height, 1, 24 };
+		Bitmap frame(info, colors.data(), false);
+
+		PixelPattern pattern(Size(width, height), 1, BuildExpressionTree(pointMatches));
+		auto bundleFile = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).generic_string();
+		PatternBundle::Write(bundleFile, std::vector<const PixelPattern*>(1, &pattern));
+
+		{
+			PatternBundle bundle(bundleFile);
+			std::unique_ptr<PixelPattern> loaded(bundle.Load(0));
+			Point found;
+			ASSERT_TRUE(loaded->Find(frame, found));
+			EXPECT_EQ(Point(0, 0), found);
+		}
+
+		DeleteFile(bundleFile.c_str());
+	}
+	TEST_F(PatternBundleTests, LeavesTheBundleAsItWasWhenAPatternCantBeBundled)
+	{
+		PixelPattern pattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0xff, 0, 0))));
+		auto bundleFile = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).generic_string();
+		PatternBundle::Write(bundleFile, std::vector<const PixelPattern*>(1, &pattern));
+
+		std::vector<Color> pixels(4, Color(0xff, 0, 0));
+		PixelPattern patch(Size(1024, 768), 2, new Expression(new BitmapPatchMatch(2, 2, pixels.data())));
+		std::vector<const PixelPattern*> patterns = { &pattern, &patch };
+		EXPECT_THROW(PatternBundle::Write(bundleFile, patterns), Exception);
+
+		PixelPattern flipped(pattern);
+		flipped.Transforms(std::vector<Transform>(1, Transform::MIRROR_X));
+		patterns[1] = &flipped;
+		EXPECT_THROW(PatternBundle::Write(bundleFile, patterns), Exception);
+
+		{
+			PatternBundle bundle(bundleFile);
+			ASSERT_EQ(1u, bundle.Count());
+			std::unique_ptr<PixelPattern> loaded(bundle.Load(0));
+			EXPECT_EQ(pattern, *loaded);
+		}
+
+		DeleteFile(bundleFile.c_str());
+	}
+	TEST_F(PatternBundleTests, RejectsRecordsWhoseCountsDontFit)
+	{
+		PixelPattern pattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0xff, 0, 0))));
+		std::vector<std::string> patternFiles = { WriteJsonToTempFile(pattern) };
+		auto bundleFile = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).generic_string();
+		PatternBundle::Convert(patternFiles, bundleFile);
+
+		//the first record's searchAreaCount, after the header, id, width and height
+		{
+			std::fstream file(bundleFile, std::ios::in | std::ios::out | std::ios::binary);
+			file.seekp(16 + 8 + 4 + 4);
+			uint32_t count = 0xffffffff;
+			file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		}
+		EXPECT_THROW(PatternBundle bundle(bundleFile), Exception);
+
+		DeleteFile(patternFiles[0].c_str());
+		DeleteFile(bundleFile.c_str());
+	}
+	//=========================================================================
+	//== SingleParserTests
+	//=========================================================================
+	TEST_F(SingleParserTests, ParseBatchDeliversEachFramesResultsInInputOrder)
+	{
+		Color c(0, 0xff, 0xff);
+
+		std::map<Point, PixelMatch*> pointMatches = {
+			{ Point(198, 24), new ExactPixelMatch(c) },
+			{ Point(204, 29), new ExactPixelMatch(c) },
+			{ Point(196, 31), new ExactPixelMatch(c) },
+		};
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, BuildExpressionTree(pointMatches)));
+
+		std::vector<std::string> files;
+		for (int i = 0; i < 4; ++i)
+		{
+			files.push_back(FindImagesDir + "0255255blips.bmp");
+			files.push_back(FindImagesDir + "111-150150150blips.bmp");
+		}
+
+		size_t expected = 0;
+		parser.ParseBatch(files, [&](size_t index, const Bitmap &, const FrameResult &result)
+		{
+			EXPECT_EQ(expected++, index);
+
+			if (index % 2 == 0)
+			{
+				ASSERT_EQ(1u, result.count(1));
+				EXPECT_EQ(Point(198, 24), result.at(1));
+			}
+			else
+				EXPECT_EQ(0u, result.count(1));
+		}, 3, 4);
+
+		EXPECT_EQ(files.size(), expected);
+		EXPECT_EQ(nullptr, parser.GetPattern(1)->Found());
+	}
+	TEST_F(SingleParserTests, RepeatedFramesAreAnsweredFromTheResultCache)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		auto same = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		auto other = Bitmap::FromFile(FindImagesDir + "111-150150150blips.bmp");
+		EXPECT_EQ(image->Hash(), same->Hash());
+		EXPECT_NE(image->Hash(), other->Hash());
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		auto &cache = parser.EnableResultCache(2);
+
+		std::vector<ChangeEvent> events;
+		parser.AddChangeListener([&](const ChangeEvent &event) { events.push_back(event); });
+
+		parser.Parse(*image);
+		parser.Parse(*other);
+		EXPECT_EQ(0u, cache.Hits());
+		EXPECT_EQ(2u, cache.Misses());
+
+		//as if parsed, events included
+		parser.Parse(*same);
+		EXPECT_EQ(1u, cache.Hits());
+		ASSERT_EQ(3u, events.size());
+		EXPECT_FALSE(events[1].found);
+		EXPECT_EQ(Point(198, 24), events[2].newLocation);
+		ASSERT_NE(nullptr, parser.GetPattern(1)->Found());
+		EXPECT_EQ(Point(198, 24), *parser.GetPattern(1)->Found());
+
+		parser.Parse(*other);
+		EXPECT_EQ(2u, cache.Hits());
+		EXPECT_EQ(nullptr, parser.GetPattern(1)->Found());
+
+		FrameResult result;
+		parser.Match(*same, result);
+		EXPECT_EQ(3u, cache.Hits());
+		EXPECT_EQ(Point(198, 24), result[1]);
+
+		//a new pattern set version never hits
+		parser.AddPattern(PixelPattern(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))));
+		parser.Match(*same, result);
+		EXPECT_EQ(3u, cache.Hits());
+		EXPECT_EQ(2u, cache.Size());
+		EXPECT_DOUBLE_EQ(3.0 / 6, cache.HitRate());
+
+		delete image;
+		delete same;
+		delete other;
+	}
+	TEST_F(SingleParserTests, PublishesOnlyWhatChangedSinceTheLastFrame)
+	{
+		auto found = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		auto notFound = Bitmap::FromFile(FindImagesDir + "111-150150150blips.bmp");
+
+		SingleParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 7, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		std::vector<ChangeEvent> heard;
+		parser.AddChangeListener([&](const ChangeEvent &event) { heard.push_back(event); });
+
+		//found, found in the same place, lost, still lost
+		parser.Parse(*found);
+		parser.Parse(*found);
+		parser.Parse(*notFound);
+		parser.Parse(*notFound);
+
+		ASSERT_EQ(2u, heard.size());
+		EXPECT_EQ(1u, heard[0].frame);
+		EXPECT_FALSE(heard[0].wasFound);
+		EXPECT_TRUE(heard[0].found);
+		EXPECT_EQ(Point(198, 24), heard[0].newLocation);
+		EXPECT_EQ(3u, heard[1].frame);
+		EXPECT_TRUE(heard[1].wasFound);
+		EXPECT_EQ(Point(198, 24), heard[1].oldLocation);
+		EXPECT_FALSE(heard[1].found);
+
+		delete found;
+		delete notFound;
+	}
+	//=========================================================================
+	//== SeriesParserTests
+	//=========================================================================
+	TEST_F(SeriesParserTests, PublishesChangesToListenersAndTheChangeQueue)
+	{
+		Color c(0, 0xff, 0xff);
+
+		std::map<Point, PixelMatch*> pointMatches = {
+			{ Point(198, 24), new ExactPixelMatch(c) },
+			{ Point(204, 29), new ExactPixelMatch(c) },
+		};
+
+		SeriesParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 7, BuildExpressionTree(pointMatches)));
+
+		std::vector<ChangeEvent> heard;
+		parser.AddChangeListener([&](const ChangeEvent &event) { heard.push_back(event); });
+		auto &queue = parser.EnableChangeQueue(4);
+
+		auto found = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		auto notFound = Bitmap::FromFile(FindImagesDir + "111-150150150blips.bmp");
+
+		parser.Next(*found);
+		parser.Next(*found);
+		parser.Next(*notFound);
+
+		ASSERT_EQ(2u, heard.size());
+		EXPECT_EQ(7u, heard[0].id);
+		EXPECT_EQ(1u, heard[0].frame);
+		EXPECT_FALSE(heard[0].wasFound);
+		EXPECT_TRUE(heard[0].found);
+		EXPECT_EQ(Point(198, 24), heard[0].newLocation);
+		EXPECT_EQ(3u, heard[1].frame);
+		EXPECT_TRUE(heard[1].wasFound);
+		EXPECT_EQ(Point(198, 24), heard[1].oldLocation);
+		EXPECT_FALSE(heard[1].found);
+
+		ChangeEvent event;
+		ASSERT_TRUE(queue.Pop(event));
+		EXPECT_EQ(1u, event.frame);
+		ASSERT_TRUE(queue.Pop(event));
+		EXPECT_EQ(3u, event.frame);
+		EXPECT_FALSE(queue.Pop(event));
+		EXPECT_EQ(0u, parser.DroppedChangeEvents());
+
+		delete found;
+		delete notFound;
+	}
+	TEST_F(SeriesParserTests, StatsCountWhatEachPatternCosts)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+
+		SeriesParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		parser.Next(*image);
+		parser.Next(*image);
+
+		auto stats = parser.Stats();
+		if (!StatsEnabled())
+		{
+			EXPECT_TRUE(stats.empty());
+			delete image;
+			return;
+		}
+
+		//the first frame scans up to 198,24; the second finds it still there
+		ASSERT_EQ(1u, stats.count(1));
+		auto &total = stats[1];
+		EXPECT_EQ(2u, total.frames);
+		EXPECT_EQ(1u, total.foundHits);
+		EXPECT_EQ(24u * 1024 + 199, total.anchors);
+		EXPECT_EQ(total.anchors + 1, total.leafTests);
+		EXPECT_EQ(total.anchors, total.depths[1]);
+		EXPECT_LT(0.0, total.seconds);
+
+		auto last = parser.LastFrameStats();
+		EXPECT_EQ(0u, last[1].anchors);
+		EXPECT_EQ(1u, last[1].leafTests);
+
+		parser.ResetStats();
+		EXPECT_TRUE(parser.Stats().empty());
+		delete image;
+	}
+	TEST_F(SeriesParserTests, NextParsesFramesFromAFrameRingInPlace)
+	{
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		auto name = "imgexptest-" + boost::filesystem::unique_path().string();
+
+		//each end as a separate process would open it
+		FrameRing producer(name, image->Size(), 2);
+		FrameRing consumer(name, image->Size(), 2);
+		EXPECT_THROW(FrameRing(name, image->Size(), 3), Exception);
+
+		//fills every slot, after which the producer has to wait for the consumer
+		for (int i = 0; i < 2; ++i)
+		{
+			auto colors = producer.Acquire(0);
+			ASSERT_NE(nullptr, colors);
+			for (long y = 0; y < image->Height(); ++y)
+			{
+				for (long x = 0; x < image->Width(); ++x)
+					colors[(image->Height() - 1 - y) * image->Width() + x] = image->Color(x, y);
+			}
+			producer.Commit();
+		}
+		EXPECT_EQ(nullptr, producer.Acquire(0));
+		EXPECT_EQ(2u, consumer.Committed());
+
+		SeriesParser parser(image->Size());
+		parser.AddPattern(PixelPattern(image->Size(), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		ASSERT_TRUE(parser.Next(consumer, 0));
+		ASSERT_NE(nullptr, parser.GetPattern(1)->Found());
+		EXPECT_EQ(Point(198, 24), *parser.GetPattern(1)->Found());
+
+		EXPECT_NE(nullptr, producer.Acquire(0));
+		ASSERT_TRUE(parser.Next(consumer, 0));
+		EXPECT_FALSE(parser.Next(consumer, 0));
+		EXPECT_EQ(2u, parser.Frame());
+
+		delete image;
+	}
+	//=========================================================================
+	//== PatternWatcherTests
+	//=========================================================================
+	TEST_F(PatternWatcherTests, SyncReloadsOnlyChangedFilesAndKeepsUnchangedPatterns)
+	{
+		auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		boost::filesystem::create_directory(dir);
+
+		auto write = [&](const std::string &name, const Json::Value &value, bool styled)
+		{
+			Json::StyledWriter styledWriter;
+			Json::FastWriter fastWriter;
+			ofstream output((dir / name).c_str(), ios_base::trunc);
+			output << (styled ? styledWriter.write(value) : fastWriter.write(value));
+		};
+
+		Color c(0, 0xff, 0xff);
+		PixelPattern found(Size(1024, 768), 1, new Expression(new ExactPixelMatch(c)));
+		write("a.pattern", found, true);
+		write("b.pattern", PixelPattern(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))), true);
+
+		SeriesParser parser(Size(1024, 768));
+		PatternWatcher watcher(parser, dir.generic_string());
+		auto report = watcher.Sync(2);
+		EXPECT_EQ(2u, report.loaded);
+		EXPECT_TRUE(report.errors.empty());
+
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		parser.Next(*image);
+		auto original = parser.GetPattern(1);
+		ASSERT_NE(nullptr, original->Found());
+
+		//nothing changed
+		auto version = parser.Version();
+		EXPECT_EQ(0u, watcher.Sync().loaded);
+		EXPECT_EQ(version, parser.Version());
+
+		//a rewritten but Equal pattern, a changed one, a new one and a broken one
+		PixelPattern changed(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0, 0xff, 0))));
+		write("a.pattern", found, false);
+		write("b.pattern", changed, true);
+		write("c.pattern", PixelPattern(Size(1024, 768), 3, new Expression(new ExactPixelMatch(Color(0, 0, 0xff)))), true);
+		write("d.pattern", Json::Value("not a pattern"), true);
 
+		report = watcher.Sync();
+		EXPECT_EQ(3u, report.loaded);
+		ASSERT_EQ(1u, report.errors.size());
+		EXPECT_NE(std::string::npos, report.errors[0].file.find("d.pattern"));
+		EXPECT_EQ(original, parser.GetPattern(1));
+		ASSERT_NE(nullptr, parser.GetPattern(1)->Found());
+		EXPECT_EQ(changed, *parser.GetPattern(2));
+		EXPECT_NE(nullptr, parser.GetPattern(3));
+
+		boost::filesystem::remove(dir / "c.pattern");
+		watcher.Sync();
+		EXPECT_EQ(nullptr, parser.GetPattern(3));
+		EXPECT_NE(nullptr, parser.GetPattern(2));
+
+		delete image;
+		boost::filesystem::remove_all(dir);
+	}
+	//=========================================================================
+	//== TraceTests
+	//=========================================================================
+	TEST_F(TraceTests, FlushesRecordedSpansAsTraceEvents)
+	{
+		Trace::Start();
+		Trace::NameThread("test");
+
+		auto image = Bitmap::FromFile(FindImagesDir + "0255255blips.bmp");
+		SeriesParser parser(Size(1024, 768));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 1, new Expression(new ExactPixelMatch(Color(0, 0xff, 0xff)))));
+		parser.AddPattern(PixelPattern(Size(1024, 768), 2, new Expression(new ExactPixelMatch(Color(0xff, 0, 0)))));
+		parser.Next(*image);
+
+		auto fileName = WriteJsonToTempFile(Json::Value());
+		EXPECT_EQ(4u, Trace::Flush(fileName));
+
+		auto events = ParseJsonFromFile(fileName);
+		std::map<std::string, std::vector<Json::Value>> byName;
+		for (auto &event : events)
+			byName[event["name"].asString()].push_back(event);
+
+		ASSERT_EQ(1u, byName["thread_name"].size());
+		EXPECT_EQ("test", byName["thread_name"][0]["args"]["name"].asString());
+		EXPECT_EQ(1u, byName["Bitmap::FromFile"].size());
+		ASSERT_EQ(1u, byName["Parser::Parse"].size());
+		EXPECT_EQ(1, byName["Parser::Parse"][0]["args"]["id"].asInt());
+		ASSERT_EQ(2u, byName["PixelPattern::Update"].size());
+
+		auto &parse = byName["Parser::Parse"][0];
+		for (auto &update : byName["PixelPattern::Update"])
+		{
+			EXPECT_EQ("X", update["ph"].asString());
+			EXPECT_EQ(parse["tid"], update["tid"]);
+			EXPECT_LE(parse["ts"].asDouble(), update["ts"].asDouble());
+		}
+
+		//flushed events are gone, and nothing's recorded once stopped
+		Trace::Stop();
+		parser.Next(*image);
+		EXPECT_EQ(0u, Trace::Flush(fileName));
+
+		boost::filesystem::remove(fileName);
+		delete image;
+	}
+}